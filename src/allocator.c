@@ -33,86 +33,225 @@ struct arena_link {
 
   size_t free;
   size_t used;
-  uint8_t rest[];
+  uint8_t rest[] __attribute__((aligned(H_MAX_ALIGN)));
 } ;
 
 struct HArena_ {
   struct arena_link *head;
+  struct arena_link *spare; // blocks kept by h_arena_reset, ready for reuse
+  struct arena_link *large; // dedicated blocks for oversized requests
   struct HAllocator_ *mm__;
-  size_t block_size;
+  size_t block_size;        // size of the next ordinary block
+  size_t max_block_size;    // block_size doubles up to this
+  size_t block_bytes;       // total size of the ordinary blocks in use
   size_t used;
   size_t wasted;
+  size_t padding;
+  size_t slack;
+  size_t blocks;
+  size_t large_blocks;
+  size_t spare_blocks;
 };
 
+// Requests are rounded up to a multiple of H_MAX_ALIGN, so that every
+// allocation starts suitably aligned for any type.
+static inline size_t size_class(size_t size) {
+  return (size + H_MAX_ALIGN - 1) & ~(H_MAX_ALIGN - 1);
+}
+
+static inline size_t link_size(const struct arena_link *link) {
+  return link->used + link->free;
+}
+
+// While the current block has at least a quarter of its room left, a
+// request that does not fit gets a dedicated block rather than retiring
+// the current one. This caps the slack left behind in each block.
+#define KEEP_HEAD_FREE(link) (link_size(link) / 4)
+
 HArena *h_new_arena(HAllocator* mm__, size_t block_size) {
-  if (block_size == 0)
-    block_size = 4096;
+  size_t max_block_size;
+  if (block_size == 0) {
+    block_size = H_ARENA_BLOCK_SIZE;
+    max_block_size = H_ARENA_MAX_BLOCK_SIZE;
+  } else {
+    block_size = size_class(block_size);
+    max_block_size = block_size;
+  }
   struct HArena_ *ret = h_new(struct HArena_, 1);
   struct arena_link *link = (struct arena_link*)mm__->alloc(mm__, sizeof(struct arena_link) + block_size);
-  memset(link, 0, sizeof(struct arena_link) + block_size);
   link->free = block_size;
   link->used = 0;
   link->next = NULL;
   ret->head = link;
-  ret->block_size = block_size;
+  ret->spare = NULL;
+  ret->large = NULL;
+  ret->block_size = block_size * 2 < max_block_size ? block_size * 2 : max_block_size;
+  ret->max_block_size = max_block_size;
+  ret->block_bytes = block_size;
   ret->used = 0;
   ret->mm__ = mm__;
   ret->wasted = sizeof(struct arena_link) + sizeof(struct HArena_) + block_size;
+  ret->padding = 0;
+  ret->slack = 0;
+  ret->blocks = 1;
+  ret->large_blocks = 0;
+  ret->spare_blocks = 0;
   return ret;
 }
 
+void h_arena_set_max_block_size(HArena *arena, size_t max_block_size) {
+  max_block_size = size_class(max_block_size);
+  // blocks never shrink; a smaller cap just stops them growing
+  arena->max_block_size = max_block_size > arena->block_size
+    ? max_block_size : arena->block_size;
+}
+
+static void* large_malloc(HArena *arena, size_t size) {
+  struct arena_link *link = (struct arena_link*)arena->mm__->alloc(arena->mm__, sizeof(struct arena_link) + size);
+  link->free = 0;
+  link->used = size;
+  link->next = arena->large;
+  arena->large = link;
+  arena->large_blocks++;
+  arena->used += size;
+  arena->wasted += sizeof(struct arena_link);
+  return link->rest;
+}
+
 void* h_arena_malloc(HArena *arena, size_t size) {
-  if (size <= arena->head->free) {
+  struct arena_link *link = arena->head;
+  size_t csize = size_class(size);
+  if (csize <= link->free) {
     // fast path..
-    void* ret = arena->head->rest + arena->head->used;
+    void* ret = link->rest + link->used;
     arena->used += size;
     arena->wasted -= size;
-    arena->head->used += size;
-    arena->head->free -= size;
+    arena->padding += csize - size;
+    link->used += csize;
+    link->free -= csize;
     return ret;
-  } else if (size > arena->block_size) {
-    // We need a new, dedicated block for it, because it won't fit in a standard sized one.
-    // This involves some annoying casting...
-    arena->used += size;
-    arena->wasted += sizeof(struct arena_link*);
-    void* link = arena->mm__->alloc(arena->mm__, size + sizeof(struct arena_link*));
-    memset(link, 0, size + sizeof(struct arena_link*));
-    *(struct arena_link**)link = arena->head->next;
-    arena->head->next = (struct arena_link*)link;
-    return (void*)(((uint8_t*)link) + sizeof(struct arena_link*));
+  } else if (csize > arena->block_size || link->free >= KEEP_HEAD_FREE(link)) {
+    // It won't fit in a standard sized block, or the current one is still
+    // worth filling; either way, it gets a dedicated block.
+    return large_malloc(arena, size);
   } else {
-    // we just need to allocate an ordinary new block.
-    struct arena_link *link = (struct arena_link*)arena->mm__->alloc(arena->mm__, sizeof(struct arena_link) + arena->block_size);
-    memset(link, 0, sizeof(struct arena_link) + arena->block_size);
-    link->free = arena->block_size - size;
-    link->used = size;
+    // we just need a new ordinary block; reuse a spare one if it is big enough.
+    arena->slack += link->free;
+    link = arena->spare;
+    if (link && csize <= link->free) {
+      arena->spare = link->next;
+      arena->spare_blocks--;
+      arena->wasted -= size; // already counted as wasted when it was kept
+    } else {
+      size_t block_size = arena->block_size;
+      link = (struct arena_link*)arena->mm__->alloc(arena->mm__, sizeof(struct arena_link) + block_size);
+      link->free = block_size;
+      arena->wasted += sizeof(struct arena_link) + block_size - size;
+      arena->block_size = block_size * 2 < arena->max_block_size
+        ? block_size * 2 : arena->max_block_size;
+    }
+    arena->block_bytes += link->free;
+    link->free -= csize;
+    link->used = csize;
     link->next = arena->head;
     arena->head = link;
+    arena->blocks++;
     arena->used += size;
-    arena->wasted += sizeof(struct arena_link) + arena->block_size - size;
+    arena->padding += csize - size;
     return link->rest;
   }
 }
 
+void* h_arena_malloc0(HArena *arena, size_t size) {
+  void *ret = h_arena_malloc(arena, size);
+  memset(ret, 0, size);
+  return ret;
+}
+
 void h_arena_free(HArena *arena, void* ptr) {
   // To be used later...
 }
 
-void h_delete_arena(HArena *arena) {
-  HAllocator *mm__ = arena->mm__;
-  struct arena_link *link = arena->head;
+static void free_chain(HAllocator *mm__, struct arena_link *link) {
   while (link) {
-    struct arena_link *next = link->next; 
-    // Even in the case of a special block, without the full arena
-    // header, this is correct, because the next pointer is the first
-    // in the structure.
+    struct arena_link *next = link->next;
     h_free(link);
     link = next;
   }
+}
+
+void h_arena_reset(HArena *arena, size_t keep) {
+  HAllocator *mm__ = arena->mm__;
+  free_chain(mm__, arena->large);
+  arena->large = NULL;
+
+  // Walk the blocks in use, newest (and so largest) first, then the spares,
+  // keeping the first few in that order.
+  struct arena_link *link = arena->head, *spare = arena->spare;
+  struct arena_link *kept = NULL, **tail = &kept;
+  size_t nkept = 0, kept_bytes = 0;
+  if (keep == 0)
+    keep = 1; // an arena always has a current block
+  while (link) {
+    struct arena_link *next = link->next;
+    if (nkept < keep) {
+      link->free = link_size(link);
+      link->used = 0;
+      *tail = link;
+      tail = &link->next;
+      nkept++;
+      kept_bytes += link->free;
+    } else {
+      h_free(link);
+    }
+    link = next;
+    if (!link) {
+      link = spare;
+      spare = NULL;
+    }
+  }
+  *tail = NULL;
+  arena->head = kept;
+  arena->spare = kept->next;
+  kept->next = NULL;
+  arena->block_bytes = link_size(kept);
+  arena->used = 0;
+  arena->wasted = sizeof(struct HArena_)
+    + nkept * sizeof(struct arena_link) + kept_bytes;
+  arena->padding = 0;
+  arena->slack = 0;
+  arena->blocks = 1;
+  arena->large_blocks = 0;
+  arena->spare_blocks = nkept - 1;
+}
+
+void h_delete_arena(HArena *arena) {
+  HAllocator *mm__ = arena->mm__;
+  free_chain(mm__, arena->head);
+  free_chain(mm__, arena->spare);
+  free_chain(mm__, arena->large);
   h_free(arena);
 }
 
+static void block_histogram(HArenaStats *stats, const struct arena_link *link) {
+  for (; link; link = link->next) {
+    size_t bucket = 0;
+    for (size_t size = link_size(link); size > 1 && bucket < H_ARENA_HISTOGRAM_BUCKETS - 1; size >>= 1)
+      bucket++;
+    stats->block_histogram[bucket]++;
+  }
+}
+
 void h_allocator_stats(HArena *arena, HArenaStats *stats) {
   stats->used = arena->used;
   stats->wasted = arena->wasted;
+  stats->padding = arena->padding;
+  stats->slack = arena->slack;
+  stats->blocks = arena->blocks;
+  stats->large_blocks = arena->large_blocks;
+  stats->spare_blocks = arena->spare_blocks;
+  stats->fragmentation = (double)arena->slack / arena->block_bytes;
+  memset(stats->block_histogram, 0, sizeof(stats->block_histogram));
+  block_histogram(stats, arena->head);
+  block_histogram(stats, arena->large);
 }
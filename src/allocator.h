@@ -28,21 +28,65 @@ typedef struct HAllocator_ {
 
 typedef struct HArena_ HArena ; // hidden implementation
 
-HArena *h_new_arena(HAllocator* allocator, size_t block_size); // pass 0 for default...
+// The most strictly aligned basic types (max_align_t is C11). Arenas hand out
+// memory aligned for any of them, and expect an HAllocator to do the same.
+typedef union {
+  long double ld;
+  long long ll;
+  double d;
+  void *p;
+  void (*fp)(void);
+} HMaxAlign;
+#ifndef SWIG
+#define H_MAX_ALIGN (__alignof__(HMaxAlign))
+#endif
+
+// Blocks of a default arena start at H_ARENA_BLOCK_SIZE bytes and double
+// with each new block up to H_ARENA_MAX_BLOCK_SIZE.
+#define H_ARENA_BLOCK_SIZE 4096
+#define H_ARENA_MAX_BLOCK_SIZE (1 << 20)
+
+HArena *h_new_arena(HAllocator* allocator, size_t block_size); // pass 0 for default; otherwise, blocks are fixed-size
+// Let new blocks double in size up to [max_block_size]; pass 0 to stop them
+// growing.
+void h_arena_set_max_block_size(HArena *arena, size_t max_block_size);
+// Arena memory is not initialized; use h_arena_malloc0 where zeroes are needed.
 #ifndef SWIG
 void* h_arena_malloc(HArena *arena, size_t count) __attribute__(( malloc, alloc_size(2) ));
+void* h_arena_malloc0(HArena *arena, size_t count) __attribute__(( malloc, alloc_size(2) ));
 #else
 void* h_arena_malloc(HArena *arena, size_t count);
+void* h_arena_malloc0(HArena *arena, size_t count);
 #endif
 void h_arena_free(HArena *arena, void* ptr); // For future expansion, with alternate memory managers.
 void h_delete_arena(HArena *arena);
+// Free everything allocated from the arena at once, but keep up to [keep]
+// of its blocks (at least one) around to serve later allocations.
+void h_arena_reset(HArena *arena, size_t keep);
+
+#define H_ARENA_HISTOGRAM_BUCKETS 32
 
 typedef struct {
-  size_t used;
-  size_t wasted;
+  size_t used;         // bytes requested
+  size_t wasted;       // everything else taken from the allocator
+  size_t padding;      // part of wasted: rounding requests up to size classes
+  size_t slack;        // part of wasted: unused tails of blocks left behind
+  size_t blocks;       // ordinary blocks in use, including the current one
+  size_t large_blocks; // dedicated blocks for oversized requests
+  size_t spare_blocks; // blocks kept by h_arena_reset, not yet reused
+  double fragmentation; // slack / total size of the ordinary blocks
+  // blocks in use, ordinary and dedicated, by size: bucket i counts those
+  // of [2^i, 2^(i+1)) bytes.
+  size_t block_histogram[H_ARENA_HISTOGRAM_BUCKETS];
 } HArenaStats;
 
 void h_allocator_stats(HArena *arena, HArenaStats *stats);
 
+// A thread-safe HAllocator for parsing on many threads at once. Freed blocks
+// are cached per thread and size class (arena blocks above all), so arenas
+// rarely reach malloc. A block may be freed on any thread; it goes back to
+// the cache of the thread that allocated it.
+HAllocator* h_thread_cache_allocator(void);
+
 
 #endif // #ifndef LIB_ALLOCATOR__H__
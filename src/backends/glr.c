@@ -37,39 +37,51 @@ static HLREngine *lrengine_merge(HLREngine *old, HLREngine *new)
   assert(old->input.input == new->input.input);
 
   *ret = *old;
-  ret->stack = h_slist_new(arena);
+  ret->stack = (HLRStack){ NULL, 0, 0 };
   ret->merged[0] = old;
   ret->merged[1] = new;
 
   return ret;
 }
 
-static HSlist *demerge_stack(HSlistNode *bottom, HSlist *stack)
+static inline void share_stack(const HLREngine *engine)
 {
-  HArena *arena = stack->arena;
-
-  HSlist *ret = h_slist_new(arena);
-
-  // copy the stack from the top
-  HSlistNode **y = &ret->head;
-  for(HSlistNode *x=stack->head; x; x=x->next) {
-    HSlistNode *node = h_arena_malloc(arena, sizeof(HSlistNode));
-    node->elem = x->elem;
-    node->next = NULL;
-    *y = node;
-    y = &node->next;
-  }
-  *y = bottom;  // attach the ancestor stack
-
-  return ret;
+  if(engine->stack.seg)
+    engine->stack.seg->shared = true;
 }
 
-static inline HLREngine *respawn(HLREngine *eng, HSlist *stack)
+// a copy of ancestor eng, at where the merged engine is now, with the merged
+// engine's stack put on top of its own
+static HLREngine *respawn(const HLREngine *eng, const HLREngine *merged)
 {
-  // NB: this can be a destructive update because an engine is not used for
-  // anything after it is merged.
-  eng->stack = demerge_stack(eng->stack->head, stack);
-  return eng;
+  HArena *tarena = eng->tarena;
+  HLREngine *ret = h_arena_malloc(tarena, sizeof(HLREngine));
+  *ret = *eng;
+  ret->state = merged->state;
+  ret->input = merged->input;
+  share_stack(eng);   // so the ancestor stays as it was, for other respawns
+  const HLRStack *stack = &merged->stack;
+
+  // gather the stack, which is short (else it needed no demerge)...
+  size_t n = stack->depth;
+  size_t *states = h_arena_malloc(tarena, n * sizeof(size_t));
+  HParsedToken **values = h_arena_malloc(tarena, n * sizeof(HParsedToken *));
+  const HLRStackSeg *seg = stack->seg;
+  for(size_t i=n, count=stack->count; i>0; ) {
+    while(count == 0) {
+      count = seg->nbelow;
+      seg = seg->below;
+    }
+    i--, count--;
+    states[i] = seg->states[count];
+    values[i] = seg->values[count];
+  }
+
+  // ...and push it from the bottom
+  for(size_t i=0; i<n; i++)
+    h_lrstack_push(tarena, &ret->stack, states[i], values[i]);
+
+  return ret;
 }
 
 static HLREngine *
@@ -80,24 +92,20 @@ demerge(HParseResult **result, HSlist *engines,
   if(!engine->merged[0])
     return engine;
 
-  HSlistNode *p = engine->stack->head;
-  for(size_t i=0; i<depth; i++) {
-    // if stack hits bottom, respawn ancestors
-    if(p == NULL) {
-      HLREngine *a = respawn(engine->merged[0], engine->stack);
-      HLREngine *b = respawn(engine->merged[1], engine->stack);
-
-      // continue demerge until final depth reached
-      a = demerge(result, engines, a, action, depth-i);
-      b = demerge(result, engines, b, action, depth-i);
-      
-      // step and stow one ancestor...
-      glr_step(result, engines, a, action);
-
-      // ...and return the other
-      return b;
-    }
-    p = p->next;
+  if(engine->stack.depth < depth) {
+    // the reduce reaches below the merge point; respawn the ancestors
+    HLREngine *a = respawn(engine->merged[0], engine);
+    HLREngine *b = respawn(engine->merged[1], engine);
+
+    // continue demerge, in case they were merged in turn
+    a = demerge(result, engines, a, action, depth);
+    b = demerge(result, engines, b, action, depth);
+
+    // step and stow one ancestor...
+    glr_step(result, engines, a, action);
+
+    // ...and return the other
+    return b;
   }
 
   return engine;    // there is enough stack before the merge point
@@ -113,12 +121,13 @@ HLREngine *fork_engine(const HLREngine *engine)
   eng2->state = engine->state;
   eng2->input = engine->input;
 
-  // shallow-copy the stack
-  // this works because h_slist_push and h_slist_drop never modify
-  // the underlying structure of HSlistNodes, only the head pointer.
-  // in fact, this gives us prefix sharing for free.
-  eng2->stack = h_arena_malloc(engine->tarena, sizeof(HSlist));
-  *eng2->stack = *engine->stack;
+  // share the stack, copy-on-write
+  eng2->stack = engine->stack;
+  share_stack(engine);
+
+  // and what it was merged from, which respawn leaves as it was
+  eng2->merged[0] = engine->merged[0];
+  eng2->merged[1] = engine->merged[1];
 
   eng2->arena = engine->arena;
   eng2->tarena = engine->tarena;
@@ -186,14 +195,14 @@ static bool glr_step(HParseResult **result, HSlist *engines,
   return run;
 }
 
-HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream, HParseCtx *ctx)
 {
   HLRTable *table = parser->backend_data;
   if(!table)
     return NULL;
 
-  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
-  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
+  HArena *arena  = h_parse_arena(mm__, ctx);     // will hold the results
+  HArena *tarena = h_parse_tmp_arena(mm__, ctx); // tmp, deleted after parse
 
   // allocate engine lists (will hold one engine per state)
   // these are swapped each iteration
@@ -221,8 +230,8 @@ HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream*
   }
 
   if(!result)
-    h_delete_arena(arena);
-  h_delete_arena(tarena);
+    h_parse_arena_done(ctx, arena);
+  h_parse_arena_done(ctx, tarena);
   return result;
 }
 
@@ -23,7 +23,7 @@ lrtable_lookup(const HLRTable *table, size_t state, const HCFChoice *symbol)
     return h_stringmap_get(table->tmap[state], &symbol->chr, 1, false);
   default:
     // nonterminal case
-    return h_hashtable_get(table->ntmap[state], symbol);
+    return h_opentable_get(table->ntmap[state], symbol);
   }
 }
 
@@ -306,6 +306,7 @@ int h_lalr_compile(HAllocator* mm__, HParser* parser, const void* params)
   }
 
   h_cfgrammar_free(g);
+  h_lrtable_pack(table);
   parser->backend_data = table;
   return has_conflicts(table)? -1 : 0;
 }
@@ -1,35 +1,81 @@
 #include <assert.h>
+#include <string.h>
 #include "../internal.h"
 #include "../cfgrammar.h"
 #include "../parsers/parser_internal.h"
+#include "llk.h"
 
 static const size_t DEFAULT_KMAX = 1;
 
 
 /* Generating the LL(k) parse table */
 
-/* Maps each nonterminal (HCFChoice) of the grammar to a HStringMap that
- * maps lookahead strings to productions (HCFSequence).
+/* The parse table, lowered to arrays once it is built.
+ *
+ * The nonterminals are numbered, and row n holds the entries for nonterminal
+ * n: one for each byte of lookahead, and one (H_LLK_END) for the end of the
+ * input. An entry is 0 where no production applies, p+1 for production p, or
+ * H_LLK_NODE|m where further lookahead decides. The entries of such a node m
+ * are few, so the nodes share one array by row displacement: entry c of node
+ * m is next[base[m] + c] if check[base[m] + c] == m, and 0 otherwise.
  */
+#define H_LLK_END   256
+#define H_LLK_WIDTH 257         // entries per row or node
+#define H_LLK_NODE  0x80000000u
+
+typedef struct HLLkSym_ {
+  const HCFChoice *x;
+  uint32_t row;                 // x's row, if it is a nonterminal
+} HLLkSym;
+
+typedef struct HLLkProd_ {
+  size_t len;
+  const HLLkSym *rhs;
+} HLLkProd;
+
 typedef struct HLLkTable_ {
-  HHashTable *rows;
-  HCFChoice  *start;    // start symbol
+  uint32_t   *rows;     // H_LLK_WIDTH entries for each nonterminal
+  size_t     nrows;
+  uint32_t   *base;     // for each node; they are numbered from 1
+  size_t     nnodes;
+  uint32_t   *next, *check;
+  size_t     ncomb;     // length of next and check
+  HLLkProd   *prods;
+  size_t     nprods;
+  HLLkSym    *start;    // start symbol
+  size_t     kmax;      // the most lookahead a prediction takes
   HArena     *arena;
   HAllocator *mm__;
 } HLLkTable;
 
 
-/* Interface to look up an entry in the parse table. */
-const HCFSequence *h_llk_lookup(const HLLkTable *table, const HCFChoice *x,
-                                const HInputStream *stream)
+// the next byte of lookahead, or H_LLK_END
+static inline unsigned int next_lookahead(HInputStream *la)
 {
-  const HStringMap *row = h_hashtable_get(table->rows, x);
-  assert(row != NULL);  // the table should have one row for each nonterminal
+  if((la->bit_offset & 7) == 0)         // byte-aligned: index the input
+    return la->index < la->length ? la->input[la->index++] : H_LLK_END;
 
-  assert(!row->epsilon_branch); // would match without looking at the input
-                                // XXX cases where this could be useful?
+  uint8_t c = h_read_bits(la, 8, false);
+  // XXX assumption of byte-wise grammar and input
+  return la->overrun ? H_LLK_END : c;
+}
+
+/* Interface to look up an entry in the parse table. */
+const HLLkProd *h_llk_lookup(const HLLkTable *table, uint32_t row,
+                             const HInputStream *stream)
+{
+  // note the lookahead stream is a copy.
+  // reading from it does not consume the real input.
+  HInputStream la = *stream;
+
+  uint32_t e = table->rows[row * H_LLK_WIDTH + next_lookahead(&la)];
+  while(e & H_LLK_NODE) {
+    uint32_t m = e & ~H_LLK_NODE;
+    size_t i = table->base[m] + next_lookahead(&la);
+    e = (table->check[i] == m)? table->next[i] : 0;
+  }
 
-  return h_stringmap_get_lookahead(row, *stream);
+  return e? &table->prods[e - 1] : NULL;
 }
 
 /* Allocate a new parse table. */
@@ -39,14 +85,12 @@ HLLkTable *h_llktable_new(HAllocator *mm__)
   //    the latter after table generation.
   HArena *arena = h_new_arena(mm__, 0);    // default blocksize
   assert(arena != NULL);
-  HHashTable *rows = h_hashtable_new(arena, h_eq_ptr, h_hash_ptr);
-  assert(rows != NULL);
 
   HLLkTable *table = h_new(HLLkTable, 1);
   assert(table != NULL);
+  memset(table, 0, sizeof(HLLkTable));
   table->mm__  = mm__;
   table->arena = arena;
-  table->rows  = rows;
 
   return table;
 }
@@ -56,6 +100,10 @@ void h_llktable_free(HLLkTable *table)
   if(table == NULL)
     return;
   HAllocator *mm__ = table->mm__;
+  if(table->rows)  h_free(table->rows);
+  if(table->base)  h_free(table->base);
+  if(table->next)  h_free(table->next);
+  if(table->check) h_free(table->check);
   h_delete_arena(table->arena);
   h_free(table);
 }
@@ -81,7 +129,7 @@ static void *combine_entries(HHashSet *workset, void *dst, const void *src)
 
 // add the mappings of src to dst, marking conflicts and adding the conflicting
 // values to workset.
-// note: reuses parts of src to build dst!
+// note: inner nodes are copied into dst's arena rather than shared with src.
 static void stringmap_merge(HHashSet *workset, HStringMap *dst, HStringMap *src)
 {
   if(src->epsilon_branch) {
@@ -107,24 +155,16 @@ static void stringmap_merge(HHashSet *workset, HStringMap *dst, HStringMap *src)
   }
 
   // iterate over src->char_branches
-  const HHashTable *ht = src->char_branches;
-  for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-
-      HCharKey c = (HCharKey)hte->key;
-      HStringMap *src_ = hte->value;
-
-      if(src_) {
-        HStringMap *dst_ = h_hashtable_get(dst->char_branches, (void *)c);
-        if(dst_)
-          stringmap_merge(workset, dst_, src_);
-        else
-          h_hashtable_put(dst->char_branches, (void *)c, src_);
+  H_FOREACH(src->char_branches, void *c, HStringMap *src_)
+    if(src_) {
+      HStringMap *dst_ = h_hashtable_get(dst->char_branches, c);
+      if(!dst_) {
+        dst_ = h_stringmap_new(dst->arena);
+        h_hashtable_put(dst->char_branches, c, dst_);
       }
+      stringmap_merge(workset, dst_, src_);
     }
-  }
+  H_END_FOREACH
 }
 
 /* Generate entries for the productions of A in the given table row. */
@@ -145,25 +185,19 @@ static int fill_table_row(size_t kmax, HCFGrammar *g, HStringMap *row,
     HHashSet *nextset = h_hashset_new(g->arena, h_eq_ptr, h_hash_ptr);
 
     // iterate over the productions in workset...
-    const HHashTable *ht = workset;
-    for(size_t i=0; i < ht->capacity; i++) {
-      for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-        if(hte->key == NULL)
-          continue;
-
-        HCFSequence *rhs = (void *)hte->key;
-        assert(rhs != NULL);
-        assert(rhs != CONFLICT);  // just to be sure there's no mixup
-
-        // calculate predict set; let values map to rhs
-        HStringMap *pred = h_predict(k, g, A, rhs);
-        h_stringmap_replace(pred, NULL, rhs);
-
-        // merge predict set into the row
-        // accumulates conflicts in new workset
-        stringmap_merge(nextset, row, pred);
-      }
-    }
+    H_FOREACH_KEY(workset, void *key)
+      HCFSequence *rhs = (void *)key;
+      assert(rhs != NULL);
+      assert(rhs != CONFLICT);  // just to be sure there's no mixup
+
+      // calculate predict set; let values map to rhs
+      HStringMap *pred = h_predict(k, g, A, rhs);
+      h_stringmap_replace(pred, NULL, rhs);
+
+      // merge predict set into the row
+      // accumulates conflicts in new workset
+      stringmap_merge(nextset, row, pred);
+    H_END_FOREACH
 
     // switch to the updated workset
     h_hashset_free(workset);
@@ -181,36 +215,205 @@ static int fill_table_row(size_t kmax, HCFGrammar *g, HStringMap *row,
   return (k>kmax)? -1 : 0;
 }
 
+/* Lowering the table (as HStringMaps) to arrays. */
+
+typedef struct HLLkLowering_ {
+  HLLkTable   *table;
+  HOpenTable  *rownum;   // nonterminal -> its row + 1
+  HOpenTable  *prodnum;  // HCFSequence -> its production + 1
+  HCountedArray *seqs;   // the productions, in order
+  size_t      base_cap;  // capacity of table->base
+  size_t      first_free;// no slot of table->check below this is used
+} HLLkLowering;
+
+static uint32_t row_of(HLLkLowering *l, const HCFChoice *a)
+{
+  uintptr_t r = (uintptr_t)h_opentable_get(l->rownum, a);
+  assert(r > 0);
+  return r - 1;
+}
+
+static uint32_t prod_entry(HLLkLowering *l, HCFSequence *seq)
+{
+  uintptr_t p = (uintptr_t)h_opentable_get(l->prodnum, seq);
+  if(!p) {
+    h_carray_append(l->seqs, seq);
+    p = l->seqs->used;
+    h_opentable_put(l->prodnum, seq, (void *)p);
+  }
+  return p;
+}
+
+// put node m, with the given entries, where they fit among the others
+static void place_node(HLLkLowering *l, uint32_t m, const uint32_t *ent)
+{
+  HLLkTable *table = l->table;
+  HAllocator *mm__ = table->mm__;
+
+  unsigned int used[H_LLK_WIDTH], n=0;
+  for(unsigned int c=0; c<H_LLK_WIDTH; c++)
+    if(ent[c])
+      used[n++] = c;
+  assert(n > 0);
+
+  // first fit
+  size_t b = (l->first_free > used[0])? l->first_free - used[0] : 0;
+  for(;; b++) {
+    unsigned int i;
+    for(i=0; i<n && b + used[i] < table->ncomb; i++)
+      if(table->check[b + used[i]])
+        break;
+    if(i == n || b + used[i] >= table->ncomb)
+      break;
+  }
+
+  // every lookup of m must stay within the arrays
+  if(b + H_LLK_WIDTH > table->ncomb) {
+    size_t ncomb = b + H_LLK_WIDTH;
+    table->next  = mm__->realloc(mm__, table->next, ncomb * sizeof(uint32_t));
+    table->check = mm__->realloc(mm__, table->check, ncomb * sizeof(uint32_t));
+    memset(table->check + table->ncomb, 0,
+           (ncomb - table->ncomb) * sizeof(uint32_t));
+    table->ncomb = ncomb;
+  }
+
+  for(unsigned int i=0; i<n; i++) {
+    table->next[b + used[i]]  = ent[used[i]];
+    table->check[b + used[i]] = m;
+  }
+  while(l->first_free < table->ncomb && table->check[l->first_free])
+    l->first_free++;
+
+  if(m >= l->base_cap) {
+    l->base_cap = l->base_cap? 2 * l->base_cap : 64;
+    table->base = mm__->realloc(mm__, table->base, l->base_cap * sizeof(uint32_t));
+  }
+  table->base[m] = b;
+}
+
+static uint32_t lower_node(HLLkLowering *l, const HStringMap *m);
+
+// the entries for the strings of m, one byte of lookahead on
+static bool lower_entries(HLLkLowering *l, const HStringMap *m, uint32_t *ent)
+{
+  bool any = false;
+
+  memset(ent, 0, H_LLK_WIDTH * sizeof(uint32_t));
+  if(m->end_branch) {
+    ent[H_LLK_END] = prod_entry(l, m->end_branch);
+    any = true;
+  }
+
+  // iterate over m->char_branches
+  H_FOREACH(m->char_branches, void *key, HStringMap *m_)
+    uint8_t c = key_char((HCharKey)key);
+    if((ent[c] = lower_node(l, m_)))
+      any = true;
+  H_END_FOREACH
+
+  return any;
+}
+
+// the entry for m, where the lookahead has led
+static uint32_t lower_node(HLLkLowering *l, const HStringMap *m)
+{
+  if(m == NULL)
+    return 0;
+  if(m->epsilon_branch)         // input matched
+    return prod_entry(l, m->epsilon_branch);
+
+  uint32_t ent[H_LLK_WIDTH];
+  if(!lower_entries(l, m, ent))
+    return 0;
+
+  uint32_t n = ++l->table->nnodes;
+  assert(n < H_LLK_NODE);
+  place_node(l, n, ent);
+  return H_LLK_NODE | n;
+}
+
+static void lower_row(HLLkLowering *l, const HCFChoice *a, const HStringMap *row)
+{
+  uint32_t *ent = l->table->rows + row_of(l, a) * H_LLK_WIDTH;
+
+  if(row->epsilon_branch) {
+    // matches without looking at the input
+    // XXX cases where this could be useful?
+    uint32_t p = prod_entry(l, row->epsilon_branch);
+    for(size_t c=0; c<H_LLK_WIDTH; c++)
+      ent[c] = p;
+  } else {
+    lower_entries(l, row, ent);
+  }
+}
+
+static void lower_prods(HLLkLowering *l)
+{
+  HLLkTable *table = l->table;
+
+  table->nprods = l->seqs->used;
+  table->prods = h_arena_malloc(table->arena, table->nprods * sizeof(HLLkProd));
+  for(size_t p=0; p<table->nprods; p++) {
+    HCFSequence *seq = (void *)l->seqs->elements[p];
+    size_t len = 0;
+    while(seq->items[len])
+      len++;
+
+    HLLkSym *rhs = h_arena_malloc(table->arena, (len + 1) * sizeof(HLLkSym));
+    for(size_t i=0; i<len; i++) {
+      rhs[i].x = seq->items[i];
+      rhs[i].row = (seq->items[i]->type == HCF_CHOICE)?
+                   row_of(l, seq->items[i]) : 0;
+    }
+    table->prods[p].len = len;
+    table->prods[p].rhs = rhs;
+  }
+}
+
 /* Generate the LL(k) parse table from the given grammar.
  * Returns -1 on error, 0 on success.
  */
 static int fill_table(size_t kmax, HCFGrammar *g, HLLkTable *table)
 {
-  table->start = g->start;
+  HAllocator *mm__ = table->mm__;
+  table->kmax = kmax;
+
+  HLLkLowering l = {
+    .table   = table,
+    .rownum  = h_opentable_new(g->arena, h_eq_ptr, h_hash_ptr),
+    .prodnum = h_opentable_new(g->arena, h_eq_ptr, h_hash_ptr),
+    .seqs    = h_carray_new(g->arena),
+  };
+
+  // number the nonterminals
+  H_FOREACH_KEY(g->nts, HCFChoice *a)
+    h_opentable_put(l.rownum, a, (void *)(uintptr_t)++table->nrows);
+  H_END_FOREACH
+  table->rows = h_new(uint32_t, table->nrows * H_LLK_WIDTH);
 
   // iterate over g->nts
-  size_t i;
-  HHashTableEntry *hte;
-  for(i=0; i < g->nts->capacity; i++) {
-    for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      const HCFChoice *a = hte->key;        // production's left-hand symbol
-      assert(a->type == HCF_CHOICE);
-
-      // create table row for this nonterminal
-      HStringMap *row = h_stringmap_new(table->arena);
-      h_hashtable_put(table->rows, a, row);
-
-      if(fill_table_row(kmax, g, row, a) < 0) {
-        // unresolvable conflicts in row
-        // NB we don't worry about deallocating anything, h_llk_compile will
-        //    delete the whole arena for us.
-        return -1;
-      }
+  H_FOREACH_KEY(g->nts, HCFChoice *a)   // production's left-hand symbol
+    assert(a->type == HCF_CHOICE);
+
+    // build the table row for this nonterminal, then lower it.
+    // the HStringMap goes with the grammar's arena.
+    HStringMap *row = h_stringmap_new(g->arena);
+
+    if(fill_table_row(kmax, g, row, a) < 0) {
+      // unresolvable conflicts in row
+      // NB we don't worry about deallocating anything, h_llk_compile will
+      //    delete the whole table for us.
+      return -1;
     }
-  }
-  
+    lower_row(&l, a, row);
+  H_END_FOREACH
+
+  lower_prods(&l);
+
+  table->start = h_arena_malloc(table->arena, sizeof(HLLkSym));
+  table->start->x = g->start;
+  table->start->row = row_of(&l, g->start);
+
   return 0;
 }
 
@@ -257,79 +460,185 @@ void h_llk_free(HParser *parser)
 
 /* LL(k) driver */
 
-HParseResult *h_llk_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+/* The symbol stack. In order to construct the parse tree, we delimit it into
+ * frames corresponding to production right-hand sides. since only left-most
+ * derivations are produced this linearization is unique.
+ * nonterminals, instead of being popped and forgotten, are put back onto the
+ * stack as the frame's delimiter, to tell us which validations and semantic
+ * actions to execute on their corresponding result. with them we store the
+ * previously accumulated value for the surrounding production, which also
+ * tells the delimiters from the symbols still to be parsed.
+ *
+ * The stack is one array, kept by the parse context from one parse to the
+ * next.
+ */
+typedef struct HLLkStackEntry_ {
+  const HLLkSym *sym;
+  HCountedArray *saved;         // NULL unless this delimits a frame
+} HLLkStackEntry;
+
+typedef struct HLLkStack_ {
+  HAllocator *mm__;
+  HLLkStackEntry *entries;
+  size_t n, cap;
+} HLLkStack;
+
+static void stack_free(void *p)
 {
-  const HLLkTable *table = parser->backend_data;
-  assert(table != NULL);
+  HLLkStack *stack = p;
+  HAllocator *mm__ = stack->mm__;
+  if(stack->entries)
+    h_free(stack->entries);
+  h_free(stack);
+}
 
-  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
-  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
-  HSlist *stack  = h_slist_new(tarena);
-  HCountedArray *seq = h_carray_new(arena); // accumulates current parse result
-
-  // in order to construct the parse tree, we delimit the symbol stack into
-  // frames corresponding to production right-hand sides. since only left-most
-  // derivations are produced this linearization is unique.
-  // the 'mark' allocated below simply reserves a memory address to use as the
-  // frame delimiter.
-  // nonterminals, instead of being popped and forgotten, are put back onto the
-  // stack below the mark to tell us which validations and semantic actions to
-  // execute on their corresponding result.
-  // also on the stack below the mark, we store the previously accumulated
-  // value for the surrounding production.
-  void *mark = h_arena_malloc(tarena, 1);
+// The stack kept by the parse context, or a new one.
+static HLLkStack *get_stack(HAllocator *mm__, HParseCtx *ctx)
+{
+  if(ctx && ctx->cache_key == &h__llk_backend_vtable)
+    return ctx->cache;
+
+  HLLkStack *stack = h_new(HLLkStack, 1);
+  stack->mm__ = mm__;
+  stack->entries = NULL;
+  stack->n = stack->cap = 0;
+  if(ctx) {
+    if(ctx->cache_free)
+      ctx->cache_free(ctx->cache);
+    ctx->cache_key = &h__llk_backend_vtable;
+    ctx->cache = stack;
+    ctx->cache_free = stack_free;
+  }
+  return stack;
+}
+
+// make room for n more entries
+static inline void stack_reserve(HLLkStack *stack, size_t n)
+{
+  if(stack->n + n <= stack->cap)
+    return;
+  HAllocator *mm__ = stack->mm__;
+  do
+    stack->cap = stack->cap? 2 * stack->cap : 256;
+  while(stack->n + n > stack->cap);
+  stack->entries = mm__->realloc(mm__, stack->entries,
+                                 stack->cap * sizeof(HLLkStackEntry));
+  // TODO: Handle the allocation failed case nicely.
+}
+
+static inline void stack_push(HLLkStack *stack, const HLLkSym *sym,
+                              HCountedArray *saved)
+{
+  HLLkStackEntry *e = &stack->entries[stack->n++];
+  e->sym = sym;
+  e->saved = saved;
+}
+
+/* A parse in progress. h_llk_parse runs one over the whole input at once;
+ * h_llk_feed, a chunk at a time.
+ */
+struct HLLkRun_ {
+  HAllocator *mm__;
+  HParseCtx *ctx;
+  const HLLkTable *table;
+  HArena *arena;                // will hold the results
+  HArena *tarena;               // tmp, deleted after parse
+  HLLkStack *stack;
+  HCountedArray *seq;           // accumulates current parse result
+  size_t base;                  // where the input stream starts in the whole
+  bool done;                    // the stack has emptied, or the parse failed
+  bool failed;
+  // input fed but not yet parsed, as the lookahead from it could reach past
+  // the end of its chunk: fewer than kmax bytes, and room for kmax more
+  uint8_t *carry;
+  size_t ncarry;
+};
+
+static void run_begin(HLLkRun *run, HAllocator *mm__, HParseCtx *ctx,
+                      const HLLkTable *table, HArena *tarena)
+{
+  run->mm__   = mm__;
+  run->ctx    = ctx;
+  run->table  = table;
+  run->arena  = h_parse_arena(mm__, ctx);
+  run->tarena = tarena;
+  run->stack  = get_stack(mm__, ctx);
+  run->seq    = h_carray_new(run->arena);
+  run->base   = 0;
+  run->done   = false;
+  run->failed = false;
+  run->carry  = NULL;
+  run->ncarry = 0;
 
   // initialize with the start symbol on the stack.
-  h_slist_push(stack, table->start);
+  run->stack->n = 0;
+  stack_reserve(run->stack, 1);
+  stack_push(run->stack, table->start, NULL);
+}
+
+/* Run the parse on over the input in stream. Returns true once it is over,
+ * having failed or not. Unless the end of stream is the end of the input
+ * (last), returns false where a prediction or a terminal could need to look
+ * past it, with stream at the symbol that could.
+ */
+static bool run_drive(HLLkRun *run, HInputStream *stream, bool last)
+{
+  const HLLkTable *table = run->table;
+  HArena *arena = run->arena;
+  HArena *tarena = run->tarena;
+  HLLkStack *stack = run->stack;
+  HCountedArray *seq = run->seq;
 
   // when we empty the stack, the parse is complete.
-  while(!h_slist_empty(stack)) {
-    // pop top of stack for inspection
-    HCFChoice *x = h_slist_pop(stack);
-    assert(x != NULL);
+  while(stack->n > 0) {
+    // inspect top of stack
+    HLLkStackEntry top = stack->entries[stack->n - 1];
+    const HCFChoice *x = top.sym->x;
 
-    if(x != mark && x->type == HCF_CHOICE) {
+    if(!top.saved && x->type == HCF_CHOICE) {
       // x is a nonterminal; apply the appropriate production and continue
-
-      // push stack frame
-      h_slist_push(stack, seq);   // save current partial value
-      h_slist_push(stack, x);     // save the nonterminal
-      h_slist_push(stack, mark);  // frame delimiter
-
-      // open a fresh result sequence
-      seq = h_carray_new(arena);
+      if(!last && stream->length - stream->index < table->kmax)
+        goto suspend;
+      stack->n--;
 
       // look up applicable production in parse table
-      const HCFSequence *p = h_llk_lookup(table, x, stream);
+      const HLLkProd *p = h_llk_lookup(table, top.sym->row, stream);
       if(p == NULL)
         goto no_parse;
 
       // an infinite loop case that shouldn't happen
-      assert(!p->items[0] || p->items[0] != x);
+      assert(p->len == 0 || p->rhs[0].x != x);
+
+      // push stack frame, saving the current partial value
+      stack_reserve(stack, p->len + 1);
+      stack_push(stack, top.sym, seq);
+
+      // open a fresh result sequence
+      seq = h_carray_new(arena);
 
       // push production's rhs onto the stack (in reverse order)
-      HCFChoice **s;
-      for(s = p->items; *s; s++);
-      for(s--; s >= p->items; s--)
-        h_slist_push(stack, *s);
+      for(size_t i=p->len; i-- > 0; )
+        stack_push(stack, &p->rhs[i], NULL);
 
       continue; // no result to record
     }
+    if(!top.saved && !last && stream->index >= stream->length)
+      goto suspend;
+    stack->n--;
 
     // the top of stack is such that there will be a result...
     HParsedToken *tok;  // will hold result token
     tok = h_arena_malloc(arena, sizeof(HParsedToken));
-    tok->index = stream->index;
+    tok->index = run->base + stream->index;
     tok->bit_offset = stream->bit_offset;
-    if(x == mark) {
+    if(top.saved) {
       // hit stack frame boundary...
       // wrap the accumulated parse result, this sequence is finished
       tok->token_type = TT_SEQUENCE;
       tok->seq = seq;
 
-      // recover original nonterminal and result sequence
-      x   = h_slist_pop(stack);
-      seq = h_slist_pop(stack);
+      // recover original result sequence
+      seq = top.saved;
       // tok becomes next left-most element of higher-level sequence
     }
     else {
@@ -387,13 +696,133 @@ HParseResult *h_llk_parse(HAllocator* mm__, const HParser* parser, HInputStream*
   // since we started with a single nonterminal on the stack, seq should
   // contain exactly the parse result.
   assert(seq->used == 1);
-  h_delete_arena(tarena);
-  return make_result(arena, seq->elements[0]);
+  run->seq = seq;
+  run->done = true;
+  return true;
+
+ suspend:
+  run->seq = seq;
+  return false;
 
  no_parse:
-  h_delete_arena(tarena);
-  h_delete_arena(arena);
-  return NULL;
+  run->done = true;
+  run->failed = true;
+  return true;
+}
+
+// The result, if any; frees the run's temporaries.
+static HParseResult *run_end(HLLkRun *run)
+{
+  HParseCtx *ctx = run->ctx;
+  HParseResult *ret = NULL;
+
+  if(run->done && !run->failed)
+    ret = make_result(run->arena, run->seq->elements[0]);
+  if(!ctx)
+    stack_free(run->stack);
+  if(!ret)
+    h_parse_arena_done(ctx, run->arena);
+  h_parse_arena_done(ctx, run->tarena);
+  return ret;
+}
+
+HParseResult *h_llk_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream, HParseCtx *ctx)
+{
+  const HLLkTable *table = parser->backend_data;
+  assert(table != NULL);
+
+  HLLkRun run;
+  run_begin(&run, mm__, ctx, table, h_parse_tmp_arena(mm__, ctx));
+  run_drive(&run, stream, true);
+  return run_end(&run);
+}
+
+static HInputStream chunk_stream(const uint8_t *input, size_t length)
+{
+  HInputStream stream = {
+    .index = 0,
+    .bit_offset = 8,
+    .overrun = 0,
+    .endianness = BIT_BIG_ENDIAN | BYTE_BIG_ENDIAN,
+    .length = length,
+    .input = input
+  };
+  return stream;
+}
+
+HLLkRun *h_llk_start(HParseCtx *ctx, const HParser *parser)
+{
+  return h_llk_start__m(ctx ? ctx->mm__ : &system_allocator, ctx, parser);
+}
+
+HLLkRun *h_llk_start__m(HAllocator *mm__, HParseCtx *ctx, const HParser *parser)
+{
+  const HLLkTable *table = parser->backend_data;
+  if(parser->backend != PB_LLk || table == NULL)
+    return NULL;
+
+  if(ctx)
+    h_parse_ctx_reset(ctx);     // as h_parse_ctx_parse does
+  HArena *tarena = h_parse_tmp_arena(mm__, ctx);
+  HLLkRun *run = h_arena_malloc(tarena, sizeof(HLLkRun));
+  run_begin(run, mm__, ctx, table, tarena);
+  run->carry = h_arena_malloc(tarena, 2 * table->kmax);
+  return run;
+}
+
+bool h_llk_feed(HLLkRun *run, const uint8_t *chunk, size_t len)
+{
+  if(run == NULL)
+    return true;
+  if(run->done || len == 0)
+    return run->done;
+
+  size_t kmax = run->table->kmax;
+  size_t start = 0;             // where in chunk to go on from
+
+  if(run->ncarry > 0) {
+    // parse across the seam, from the carried bytes into enough of chunk
+    // that no lookahead from them can reach past it.
+    size_t old = run->ncarry;
+    size_t n = (len < kmax)? len : kmax;
+    memcpy(run->carry + old, chunk, n);
+    HInputStream stream = chunk_stream(run->carry, old + n);
+    if(run_drive(run, &stream, false))
+      return true;
+    if(stream.index < old) {
+      // chunk was too short to get past them
+      memmove(run->carry, run->carry + stream.index, old + n - stream.index);
+      run->ncarry = old + n - stream.index;
+      run->base += stream.index;
+      return false;
+    }
+    start = stream.index - old;
+    run->base += old;
+    run->ncarry = 0;
+  }
+
+  HInputStream stream = chunk_stream(chunk, len);
+  stream.index = start;
+  if(run_drive(run, &stream, false))
+    return true;
+
+  // keep what is left of chunk for next time
+  assert(len - stream.index < kmax || stream.index == len);
+  run->ncarry = len - stream.index;
+  memcpy(run->carry, chunk + stream.index, run->ncarry);
+  run->base += stream.index;
+  return false;
+}
+
+HParseResult *h_llk_finish(HLLkRun *run)
+{
+  if(run == NULL)
+    return NULL;
+  if(!run->done) {
+    HInputStream stream = chunk_stream(run->carry, run->ncarry);
+    run_drive(run, &stream, true);
+  }
+  return run_end(run);
 }
 
 
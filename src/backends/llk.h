@@ -0,0 +1,32 @@
+/*
+ * NOTE: This is an internal header and installed for use by extensions. The
+ * API is not guaranteed stable.
+*/
+
+#ifndef HAMMER_BACKEND_LLK__H
+#define HAMMER_BACKEND_LLK__H
+
+#include "../hammer.h"
+#include "../internal.h"
+
+// Parsing input that arrives in pieces, with a parser compiled for PB_LLk.
+// A run keeps the parse between calls to h_llk_feed, which takes the next
+// chunk of input and returns true once more input could no longer change
+// the result. h_llk_finish marks the end of the input, and returns the
+// result as h_parse would, then frees the run.
+//
+// The parse goes as far into each chunk as its lookahead allows. The few
+// bytes that are left are copied, so a chunk need not outlive h_llk_feed.
+// With a parse context, the result lives in the context as with
+// h_parse_ctx_parse, and the context must not be used for anything else
+// until h_llk_finish.
+//
+// h_llk_start returns NULL if the parser is not compiled for PB_LLk, or
+// failed to compile. h_llk_feed then returns true, and h_llk_finish NULL.
+typedef struct HLLkRun_ HLLkRun;
+HLLkRun *h_llk_start(HParseCtx *ctx, const HParser *parser);
+HLLkRun *h_llk_start__m(HAllocator *mm__, HParseCtx *ctx, const HParser *parser);
+bool h_llk_feed(HLLkRun *run, const uint8_t *chunk, size_t len);
+HParseResult *h_llk_finish(HLLkRun *run);
+
+#endif
@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 #include "../parsers/parser_internal.h"
 #include "lr.h"
 
@@ -119,15 +121,22 @@ HLRTable *h_lrtable_new(HAllocator *mm__, size_t nrows)
 
   HLRTable *ret = h_new(HLRTable, 1);
   ret->nrows = nrows;
-  ret->ntmap = h_arena_malloc(arena, nrows * sizeof(HHashTable *));
+  ret->ntmap = h_arena_malloc(arena, nrows * sizeof(HOpenTable *));
   ret->tmap = h_arena_malloc(arena, nrows * sizeof(HStringMap *));
   ret->forall = h_arena_malloc(arena, nrows * sizeof(HLRAction *));
   ret->inadeq = h_slist_new(arena);
+  ret->actions = NULL;
+  ret->nactions = 0;
+  ret->tdefault = NULL;
+  memset(&ret->terminals, 0, sizeof(HLRComb));
+  ret->nnts = 0;
+  ret->gdefault = NULL;
+  memset(&ret->gotos, 0, sizeof(HLRComb));
   ret->arena = arena;
   ret->mm__ = mm__;
 
   for(size_t i=0; i<nrows; i++) {
-    ret->ntmap[i] = h_hashtable_new(arena, h_eq_symbol, h_hash_symbol);
+    ret->ntmap[i] = h_opentable_new(arena, h_eq_symbol, h_hash_symbol);
     ret->tmap[i] = h_stringmap_new(arena);
     ret->forall[i] = NULL;
   }
@@ -135,9 +144,19 @@ HLRTable *h_lrtable_new(HAllocator *mm__, size_t nrows)
   return ret;
 }
 
+static void comb_free(HAllocator *mm__, HLRComb *comb)
+{
+  if(comb->next)  h_free(comb->next);
+  if(comb->check) h_free(comb->check);
+}
+
 void h_lrtable_free(HLRTable *table)
 {
   HAllocator *mm__ = table->mm__;
+  if(table->actions)
+    h_free(table->actions);
+  comb_free(mm__, &table->terminals);
+  comb_free(mm__, &table->gotos);
   h_delete_arena(table->arena);
   h_free(table);
 }
@@ -156,6 +175,7 @@ HLRAction *h_reduce_action(HArena *arena, const HLRItem *item)
   action->type = HLR_REDUCE;
   action->production.lhs = item->lhs;
   action->production.length = item->len;
+  action->production.nt = 0;    // see h_lrtable_pack
 #ifndef NDEBUG
   action->production.rhs = item->rhs;
 #endif
@@ -191,12 +211,286 @@ HLRAction *h_lr_conflict(HArena *arena, HLRAction *action, HLRAction *new)
 
 bool h_lrtable_row_empty(const HLRTable *table, size_t i)
 {
-  return (h_hashtable_empty(table->ntmap[i])
+  return (h_opentable_empty(table->ntmap[i])
           && h_stringmap_empty(table->tmap[i]));
 }
 
 
 
+/* Packing the table for the parse */
+
+typedef struct HLRPacking_ {
+  HLRTable   *table;
+  HArena     *arena;        // scratch, deleted once the table is packed
+  HOpenTable *actnum;       // HLRAction -> its number
+  HOpenTable *ntnum;        // nonterminal -> its number + 1
+  size_t     actions_cap;
+  size_t     nts_cap;
+  const HCFChoice **nts;    // the nonterminals, by number
+} HLRPacking;
+
+static size_t nt_num(HLRPacking *pk, const HCFChoice *symbol)
+{
+  uintptr_t n = (uintptr_t)h_opentable_get(pk->ntnum, symbol);
+  if(!n) {
+    HLRTable *table = pk->table;
+    if(table->nnts == pk->nts_cap) {
+      pk->nts_cap = pk->nts_cap? 2 * pk->nts_cap : 64;
+      const HCFChoice **nts = h_arena_malloc(pk->arena,
+                                             pk->nts_cap * sizeof(HCFChoice *));
+      if(table->nnts)
+        memcpy(nts, pk->nts, table->nnts * sizeof(HCFChoice *));
+      pk->nts = nts;
+    }
+    pk->nts[table->nnts] = symbol;
+    n = ++table->nnts;
+    h_opentable_put(pk->ntnum, symbol, (void *)n);
+  }
+  return n - 1;
+}
+
+// the number of action, numbering it if it is new
+static uint32_t action_num(HLRPacking *pk, HLRAction *action)
+{
+  if(action == NULL)
+    return 0;
+
+  uintptr_t n = (uintptr_t)h_opentable_get(pk->actnum, action);
+  if(!n) {
+    HLRTable *table = pk->table;
+    HAllocator *mm__ = table->mm__;
+
+    n = ++table->nactions;
+    if(n == pk->actions_cap) {
+      pk->actions_cap *= 2;
+      table->actions = mm__->realloc(mm__, table->actions,
+                                     pk->actions_cap * sizeof(HLRAction *));
+    }
+    table->actions[n] = action;
+    h_opentable_put(pk->actnum, action, (void *)n);
+
+    // reductions look up their lhs's column
+    if(action->type == HLR_REDUCE) {
+      action->production.nt = nt_num(pk, action->production.lhs);
+    } else if(action->type == HLR_CONFLICT) {
+      for(HSlistNode *x=action->branches->head; x; x=x->next) {
+        HLRAction *branch = x->elem;
+        if(branch->type == HLR_REDUCE)
+          branch->production.nt = nt_num(pk, branch->production.lhs);
+      }
+    }
+  }
+  return n;
+}
+
+// put row r, the n entries val at the ascending positions pos, where they
+// fit among the others; a lookup anywhere up to width must stay in bounds.
+static void comb_place(HAllocator *mm__, HLRComb *comb, size_t width, size_t r,
+                       const uint32_t *pos, const uint32_t *val, size_t n)
+{
+  size_t b = 0;
+  if(n > 0) {
+    // first fit
+    for(;; b++) {
+      size_t i;
+      for(i=0; i<n && b + pos[i] < comb->len; i++)
+        if(comb->check[b + pos[i]] != H_LR_FREE)
+          break;
+      if(i == n || b + pos[i] >= comb->len)
+        break;
+    }
+  }
+
+  if(b + width > comb->len) {
+    size_t len = b + width;
+    comb->next  = mm__->realloc(mm__, comb->next, len * sizeof(uint32_t));
+    comb->check = mm__->realloc(mm__, comb->check, len * sizeof(uint32_t));
+    memset(comb->check + comb->len, 0xFF, (len - comb->len) * sizeof(uint32_t));
+    comb->len = len;
+  }
+
+  for(size_t i=0; i<n; i++) {
+    comb->next[b + pos[i]]  = val[i];
+    comb->check[b + pos[i]] = r;
+  }
+  comb->base[r] = b;
+}
+
+#define H_LR_WIDTH (H_LR_END + 1)
+
+static int cmp_size(const void *p, const void *q)
+{
+  size_t x = *(const size_t *)p, y = *(const size_t *)q;
+  return (x > y) - (x < y);
+}
+
+// what an entry does: where a goto goes, or else which action it is
+static inline size_t entry_key(const HLRTable *table, uint32_t x, bool gotos)
+{
+  return gotos? table->actions[x]->nextstate : x;
+}
+
+// may the entry be a default? not for a row's shifts, nor for the reduce
+// that accepts: that must wait for the end of the input.
+static inline bool can_default(const HLRTable *table, uint32_t x, bool gotos)
+{
+  const HLRAction *a = table->actions[x];
+  return gotos || (a->type == HLR_REDUCE && a->production.lhs != table->start);
+}
+
+// the entry of a state's row, or of a nonterminal's column, that most of
+// the n in val do the same as, and that may be a default
+static uint32_t most_common(const HLRTable *table, const uint32_t *val, size_t n,
+                            bool gotos, size_t *keys)
+{
+  size_t m = 0;
+  for(size_t i=0; i<n; i++)
+    if(can_default(table, val[i], gotos))
+      keys[m++] = entry_key(table, val[i], gotos);
+  if(m == 0)
+    return 0;
+  qsort(keys, m, sizeof(size_t), cmp_size);
+
+  size_t best = keys[0], best_count = 0;
+  for(size_t i=0, j; i<m; i=j) {
+    for(j=i; j<m && keys[j] == keys[i]; j++);
+    if(j - i > best_count) {
+      best = keys[i];
+      best_count = j - i;
+    }
+  }
+
+  for(size_t i=0; ; i++)
+    if(can_default(table, val[i], gotos)
+       && entry_key(table, val[i], gotos) == best)
+      return val[i];
+}
+
+static bool same_entry(const HLRTable *table, uint32_t x, uint32_t y, bool gotos)
+{
+  if(!x || !y)
+    return x == y;
+  return entry_key(table, x, gotos) == entry_key(table, y, gotos);
+}
+
+/* Lower the table to arrays, for the parse. A state's default action is the
+ * reduce that most of its row has, as yacc does, so that it also applies
+ * where the row had no action: the error then comes to light only at the
+ * next shift, or at the accept, which a reduce cannot make possible.
+ */
+void h_lrtable_pack(HLRTable *table)
+{
+  HAllocator *mm__ = table->mm__;
+  HArena *arena = table->arena;
+  HArena *tmp = h_new_arena(mm__, 0);
+  HLRPacking pk = {
+    .table   = table,
+    .arena   = tmp,
+    .actnum  = h_opentable_new(tmp, h_eq_ptr, h_hash_ptr),
+    .ntnum   = h_opentable_new(tmp, h_eq_ptr, h_hash_ptr),
+  };
+  uint32_t pos[H_LR_WIDTH], val[H_LR_WIDTH], row[H_LR_WIDTH];
+  size_t nkeys = (table->nrows > H_LR_WIDTH)? table->nrows : H_LR_WIDTH;
+  size_t *keys = h_arena_malloc(tmp, nkeys * sizeof(size_t));
+
+  // action 0 is none
+  pk.actions_cap = 64;
+  table->actions = h_new(const HLRAction *, pk.actions_cap);
+  table->actions[0] = NULL;
+
+  // number the nonterminals
+  for(size_t i=0; i<table->nrows; i++) {
+    H_OPENTABLE_FOREACH(table->ntmap[i], HCFChoice *symbol, void *v)
+      (void)v;
+      nt_num(&pk, symbol);
+    H_OPENTABLE_END_FOREACH
+  }
+
+  // the rows
+  table->tdefault = h_arena_malloc(arena, table->nrows * sizeof(uint32_t));
+  table->terminals.base = h_arena_malloc(arena, table->nrows * sizeof(uint32_t));
+  for(size_t i=0; i<table->nrows; i++) {
+    const HStringMap *m = table->tmap[i];
+    assert(m->epsilon_branch == NULL);
+
+    memset(row, 0, sizeof(row));
+    row[H_LR_END] = action_num(&pk, m->end_branch);
+    H_FOREACH(m->char_branches, void *key, HStringMap *m_)
+      if(m_)
+        row[key_char((HCharKey)key)] = action_num(&pk, m_->epsilon_branch);
+    H_END_FOREACH
+
+    size_t n = 0;
+    for(size_t c=0; c<H_LR_WIDTH; c++) {
+      if(row[c]) {
+        pos[n] = c;
+        val[n++] = row[c];
+      }
+    }
+
+    if(table->forall[i]) {
+      assert(n == 0);   // that would be a conflict
+      table->tdefault[i] = action_num(&pk, table->forall[i]);
+    } else {
+      table->tdefault[i] = most_common(table, val, n, false, keys);
+    }
+
+    // leave out what the default gives
+    size_t k = 0;
+    for(size_t j=0; j<n; j++) {
+      if(!same_entry(table, val[j], table->tdefault[i], false)) {
+        pos[k] = pos[j];
+        val[k++] = val[j];
+      }
+    }
+    comb_place(mm__, &table->terminals, H_LR_WIDTH, i, pos, val, k);
+  }
+
+  // the columns, gathered from the rows' nonterminal maps
+  size_t nnts = table->nnts;
+  size_t *count = h_arena_malloc(tmp, (nnts + 1) * sizeof(size_t));
+  memset(count, 0, (nnts + 1) * sizeof(size_t));
+  for(size_t i=0; i<table->nrows; i++) {
+    H_OPENTABLE_FOREACH(table->ntmap[i], HCFChoice *symbol, void *v)
+      (void)v;
+      count[nt_num(&pk, symbol) + 1]++;
+    H_OPENTABLE_END_FOREACH
+  }
+  for(size_t nt=0; nt<nnts; nt++)
+    count[nt + 1] += count[nt];
+  size_t total = count[nnts];
+  uint32_t *gpos = h_arena_malloc(tmp, (total + 1) * sizeof(uint32_t));
+  uint32_t *gval = h_arena_malloc(tmp, (total + 1) * sizeof(uint32_t));
+  for(size_t i=0; i<table->nrows; i++) {    // by state, so ascending
+    H_OPENTABLE_FOREACH(table->ntmap[i], HCFChoice *symbol, HLRAction *action)
+      size_t j = count[nt_num(&pk, symbol)]++;
+      gpos[j] = i;
+      gval[j] = action_num(&pk, action);
+    H_OPENTABLE_END_FOREACH
+  }
+
+  table->gdefault = h_arena_malloc(arena, nnts * sizeof(uint32_t));
+  table->gotos.base = h_arena_malloc(arena, nnts * sizeof(uint32_t));
+  for(size_t nt=0, start=0; nt<nnts; start=count[nt++]) {
+    uint32_t *p = gpos + start, *v = gval + start;
+    size_t n = count[nt] - start;
+    table->gdefault[nt] = most_common(table, v, n, true, keys);
+
+    size_t k = 0;
+    for(size_t j=0; j<n; j++) {
+      if(!same_entry(table, v[j], table->gdefault[nt], true)) {
+        p[k] = p[j];
+        v[k++] = v[j];
+      }
+    }
+    comb_place(mm__, &table->gotos, table->nrows, nt, p, v, k);
+  }
+
+  h_delete_arena(tmp);
+}
+
+
+
 /* LR driver */
 
 HLREngine *h_lrengine_new(HArena *arena, HArena *tarena, const HLRTable *table,
@@ -206,7 +500,7 @@ HLREngine *h_lrengine_new(HArena *arena, HArena *tarena, const HLRTable *table,
 
   engine->table = table;
   engine->state = 0;
-  engine->stack = h_slist_new(tarena);
+  engine->stack = (HLRStack){ NULL, 0, 0 };
   engine->input = *stream;
   engine->merged[0] = NULL;
   engine->merged[1] = NULL;
@@ -216,6 +510,85 @@ HLREngine *h_lrengine_new(HArena *arena, HArena *tarena, const HLRTable *table,
   return engine;
 }
 
+#define H_LR_STACK_SEG 32   // the size a segment starts at
+
+static HLRStackSeg *stackseg_new(HArena *arena, HLRStackSeg *below, size_t nbelow)
+{
+  HLRStackSeg *seg = h_arena_malloc(arena, sizeof(HLRStackSeg));
+  seg->below = below;
+  seg->nbelow = nbelow;
+  seg->states = h_arena_malloc(arena, H_LR_STACK_SEG * sizeof(size_t));
+  seg->values = h_arena_malloc(arena, H_LR_STACK_SEG * sizeof(HParsedToken *));
+  seg->top = 0;
+  seg->capacity = H_LR_STACK_SEG;
+  seg->shared = false;
+  return seg;
+}
+
+static void stackseg_grow(HArena *arena, HLRStackSeg *seg)
+{
+  size_t cap = 2 * seg->capacity;
+  size_t *states = h_arena_malloc(arena, cap * sizeof(size_t));
+  HParsedToken **values = h_arena_malloc(arena, cap * sizeof(HParsedToken *));
+  memcpy(states, seg->states, seg->top * sizeof(size_t));
+  memcpy(values, seg->values, seg->top * sizeof(HParsedToken *));
+  seg->states = states;
+  seg->values = values;
+  seg->capacity = cap;
+}
+
+void h_lrstack_push(HArena *arena, HLRStack *stack, size_t state, HParsedToken *value)
+{
+  HLRStackSeg *seg = stack->seg;
+
+  // another engine's entries may be above ours in a shared segment
+  if(seg == NULL || (seg->shared && stack->count != seg->top)) {
+    seg = stack->seg = stackseg_new(arena, seg, stack->count);
+    stack->count = 0;
+  }
+  if(stack->count == seg->capacity)
+    stackseg_grow(arena, seg);
+
+  seg->states[stack->count] = state;
+  seg->values[stack->count] = value;
+  seg->top = ++stack->count;
+  stack->depth++;
+}
+
+static inline void lrstack_pop(HLRStack *stack, size_t *state, HParsedToken **value)
+{
+  while(stack->count == 0) {
+    stack->count = stack->seg->nbelow;
+    stack->seg = stack->seg->below;
+  }
+  stack->count--;
+  stack->depth--;
+  *state = stack->seg->states[stack->count];
+  *value = stack->seg->values[stack->count];
+}
+
+// the next byte of lookahead, or H_LR_END
+static inline unsigned int lookahead(const HInputStream *stream)
+{
+  if((stream->bit_offset & 7) == 0)     // byte-aligned: index the input
+    return (stream->index < stream->length)?
+           stream->input[stream->index] : H_LR_END;
+
+  // note the lookahead stream is a copy.
+  // reading from it does not consume the real input.
+  HInputStream la = *stream;
+  uint8_t c = h_read_bits(&la, 8, false);
+  // XXX assumption of byte-wise grammar and input
+  return la.overrun? H_LR_END : c;
+}
+
+static inline uint32_t comb_get(const HLRComb *comb, size_t r, size_t c,
+                                uint32_t deflt)
+{
+  size_t i = comb->base[r] + c;
+  return (comb->check[i] == r)? comb->next[i] : deflt;
+}
+
 static const HLRAction *
 terminal_lookup(const HLREngine *engine, const HInputStream *stream)
 {
@@ -223,24 +596,20 @@ terminal_lookup(const HLREngine *engine, const HInputStream *stream)
   size_t state = engine->state;
 
   assert(state < table->nrows);
-  if(table->forall[state]) {
-    assert(h_lrtable_row_empty(table, state));  // that would be a conflict
-    return table->forall[state];
-  } else {
-    return h_stringmap_get_lookahead(table->tmap[state], *stream);
-  }
+  return table->actions[comb_get(&table->terminals, state, lookahead(stream),
+                                 table->tdefault[state])];
 }
 
 static const HLRAction *
-nonterminal_lookup(const HLREngine *engine, const HCFChoice *symbol)
+nonterminal_lookup(const HLREngine *engine, size_t nt)
 {
   const HLRTable *table = engine->table;
   size_t state = engine->state;
 
   assert(state < table->nrows);
-  assert(!table->forall[state]);    // contains only reduce entries
-                                    // we are only looking for shifts
-  return h_hashtable_get(table->ntmap[state], symbol);
+  assert(nt < table->nnts);
+  return table->actions[comb_get(&table->gotos, nt, state,
+                                 table->gdefault[nt])];
 }
 
 const HLRAction *h_lrengine_action(const HLREngine *engine)
@@ -257,7 +626,7 @@ static HParsedToken *consume_input(HLREngine *engine)
   if(engine->input.overrun) {     // end of input
     v = NULL;
   } else {
-    v = h_arena_malloc(engine->arena, sizeof(HParsedToken));
+    v = h_arena_malloc0(engine->arena, sizeof(HParsedToken));
     v->token_type = TT_UINT;
     v->uint = c;
   }
@@ -269,7 +638,7 @@ static HParsedToken *consume_input(HLREngine *engine)
 bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
 {
   // short-hand names
-  HSlist *stack = engine->stack;
+  HLRStack *stack = &engine->stack;
   HArena *arena = engine->arena;
   HArena *tarena = engine->tarena;
 
@@ -282,27 +651,40 @@ bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
     size_t len = action->production.length;
     HCFChoice *symbol = action->production.lhs;
 
+    if(len > stack->depth)
+      return false;     // can't be, but for a broken table
+
     // semantic value of the reduction result
     HParsedToken *value = h_arena_malloc(arena, sizeof(HParsedToken));
     value->token_type = TT_SEQUENCE;
     value->seq = h_carray_new_sized(arena, len);
     
     // pull values off the stack, rewinding state accordingly
-    HParsedToken *v = NULL;
-    for(size_t i=0; i<len; i++) {
-      v = h_slist_drop(stack);
-      engine->state = (uintptr_t)h_slist_drop(stack);
-
-      // collect values in result sequence
-      value->seq->elements[len-1-i] = v;
-      value->seq->used++;
+    HParsedToken **elements = value->seq->elements;
+    if(len == 0) {
+      // nothing to pull
+    } else if(len <= stack->count) {
+      // all in the top segment, as always without GLR forks and merges
+      stack->count -= len;
+      stack->depth -= len;
+      memcpy(elements, stack->seg->values + stack->count,
+             len * sizeof(HParsedToken *));
+      engine->state = stack->seg->states[stack->count];
+    } else {
+      for(size_t i=0; i<len; i++)
+        lrstack_pop(stack, &engine->state, &elements[len-1-i]);
     }
+    value->seq->used = len;
+
+    HParsedToken *v = len? elements[0] : NULL;
     if(v) {
       // result position equals position of left-most symbol
       value->index = v->index;
       value->bit_offset = v->bit_offset;
     } else {
       // XXX how to get the position in this case?
+      value->index = 0;
+      value->bit_offset = 0;
     }
 
     // perform token reshape if indicated
@@ -318,14 +700,13 @@ bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
     // this is LR, building a right-most derivation bottom-up, so no reduce can
     // follow a reduce. we can also assume no conflict follows for GLR if we
     // use LALR tables, because only terminal symbols (lookahead) get reduces.
-    const HLRAction *shift = nonterminal_lookup(engine, symbol);
+    const HLRAction *shift = nonterminal_lookup(engine, action->production.nt);
     if(shift == NULL)
       return false;     // parse error
     assert(shift->type == HLR_SHIFT);
 
     // piggy-back the shift right here, never touching the input
-    h_slist_push(stack, (void *)(uintptr_t)engine->state);
-    h_slist_push(stack, value);
+    h_lrstack_push(tarena, stack, engine->state, value);
     engine->state = shift->nextstate;
 
     // check for success
@@ -336,8 +717,7 @@ bool h_lrengine_step(HLREngine *engine, const HLRAction *action)
   } else {
     assert(action->type == HLR_SHIFT);
     HParsedToken *value = consume_input(engine);
-    h_slist_push(stack, (void *)(uintptr_t)engine->state);
-    h_slist_push(stack, value);
+    h_lrstack_push(tarena, stack, engine->state, value);
     engine->state = action->nextstate;
   }
 
@@ -349,22 +729,22 @@ HParseResult *h_lrengine_result(HLREngine *engine)
   // parsing was successful iff the engine reaches the end state
   if(engine->state == HLR_SUCCESS) {
     // on top of the stack is the start symbol's semantic value
-    assert(!h_slist_empty(engine->stack));
-    HParsedToken *tok = engine->stack->head->elem;
+    assert(engine->stack.count > 0);
+    HParsedToken *tok = engine->stack.seg->values[engine->stack.count - 1];
     return make_result(engine->arena, tok);
   } else {
     return NULL;
   }
 }
 
-HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream)
+HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream, HParseCtx *ctx)
 {
   HLRTable *table = parser->backend_data;
   if(!table)
     return NULL;
 
-  HArena *arena  = h_new_arena(mm__, 0);    // will hold the results
-  HArena *tarena = h_new_arena(mm__, 0);    // tmp, deleted after parse
+  HArena *arena  = h_parse_arena(mm__, ctx);     // will hold the results
+  HArena *tarena = h_parse_tmp_arena(mm__, ctx); // tmp, deleted after parse
   HLREngine *engine = h_lrengine_new(arena, tarena, table, stream);
 
   // iterate engine to completion
@@ -372,8 +752,8 @@ HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream*
 
   HParseResult *result = h_lrengine_result(engine);
   if(!result)
-    h_delete_arena(arena);
-  h_delete_arena(tarena);
+    h_parse_arena_done(ctx, arena);
+  h_parse_arena_done(ctx, tarena);
   return result;
 }
 
@@ -517,12 +897,12 @@ void h_pprint_lrtable(FILE *f, const HCFGrammar *g, const HLRTable *table,
       if(!h_lrtable_row_empty(table, i))
         fputs(" !!", f);
     }
-    H_FOREACH(table->ntmap[i], HCFChoice *symbol, HLRAction *action)
+    H_OPENTABLE_FOREACH(table->ntmap[i], HCFChoice *symbol, HLRAction *action)
       fputc(' ', f);    // separator
       h_pprint_symbol(f, g, symbol);
       fputc(':', f);
       pprint_lraction(f, g, action);
-    H_END_FOREACH
+    H_OPENTABLE_END_FOREACH
     fputc(' ', f);    // separator
     pprint_lrtable_terminals(f, g, table->tmap[i]);
     fputc('\n', f);
@@ -37,6 +37,7 @@ typedef struct HLRAction_ {
     struct {
       HCFChoice *lhs;   // symbol carrying semantic actions etc.
       size_t length;    // # of symbols in rhs
+      size_t nt;        // lhs's column of the goto table
 #ifndef NDEBUG
       HCFChoice **rhs;  // NB: the rhs symbols are not needed for the parse
 #endif
@@ -47,13 +48,38 @@ typedef struct HLRAction_ {
   };
 } HLRAction;
 
+/* Rows or columns of a table, packed into one array by displacement: entry
+ * c of row r is next[base[r] + c] if check[base[r] + c] == r.
+ */
+typedef struct HLRComb_ {
+  uint32_t *base;       // for each row
+  uint32_t *next;
+  uint32_t *check;      // H_LR_FREE where no row has an entry
+  size_t   len;         // of next and check
+} HLRComb;
+
+#define H_LR_FREE UINT32_MAX
+#define H_LR_END  256   // the lookahead "byte" at the end of the input
+
 typedef struct HLRTable_ {
   size_t     nrows;     // dimension of the pointer arrays below
-  HHashTable **ntmap;   // map nonterminal symbols to HLRActions, per row
+  HOpenTable **ntmap;   // map nonterminal symbols to HLRActions, per row
   HStringMap **tmap;    // map lookahead strings to HLRActions, per row
   HLRAction  **forall;  // shortcut to set an action for an entire row
   HCFChoice  *start;    // start symbol
   HSlist     *inadeq;   // indices of any inadequate states
+  // The table, packed for parsing by h_lrtable_pack. Its entries are
+  // numbers of actions, or 0 for none. A state's row holds its actions on
+  // each byte of lookahead and on H_LR_END, but for those that are its
+  // default action; a nonterminal's column holds its shifts (gotos) from
+  // each state, but for those to its default state.
+  const HLRAction **actions;    // numbered from 1
+  size_t     nactions;
+  uint32_t   *tdefault;         // for each state: a reduce, or 0
+  HLRComb    terminals;         // rows by state
+  size_t     nnts;
+  uint32_t   *gdefault;         // for each nonterminal
+  HLRComb    gotos;             // columns by nonterminal
   HArena     *arena;
   HAllocator *mm__;
 } HLRTable;
@@ -66,11 +92,32 @@ typedef struct HLREnhGrammar_ {
   HArena *arena;
 } HLREnhGrammar;
 
+/* An engine's stack, of pairs (saved state, semantic value), lies in
+ * segments: arrays of the pairs that the engine's forks can share. A shared
+ * segment is copy-on-write, but for its top, where the first engine that
+ * gets there may go on pushing.
+ */
+typedef struct HLRStackSeg_ {
+  struct HLRStackSeg_ *below;   // the segment this one is stacked on
+  size_t nbelow;                // how much of it is under this one
+  size_t *states;
+  HParsedToken **values;
+  size_t top;                   // entries in use, by any engine
+  size_t capacity;
+  bool shared;                  // by more than one engine
+} HLRStackSeg;
+
+typedef struct HLRStack_ {
+  HLRStackSeg *seg;     // the top segment, or NULL when empty
+  size_t count;         // entries of it on the stack
+  size_t depth;         // entries in all
+} HLRStack;
+
 typedef struct HLREngine_ {
   const HLRTable *table;
   size_t state;
 
-  HSlist *stack;        // holds pairs: (saved state, semantic value)
+  HLRStack stack;
   HInputStream input;
 
   struct HLREngine_ *merged[2]; // ancestors merged into this engine
@@ -82,29 +129,6 @@ typedef struct HLREngine_ {
 #define HLR_SUCCESS ((size_t)~0)    // parser end state
 
 
-// XXX move to internal.h or something
-// XXX replace other hashtable iterations with this
-#define H_FOREACH_(HT) {                                                    \
-    const HHashTable *ht__ = HT;                                            \
-    for(size_t i__=0; i__ < ht__->capacity; i__++) {                        \
-      for(HHashTableEntry *hte__ = &ht__->contents[i__];                    \
-          hte__;                                                            \
-          hte__ = hte__->next) {                                            \
-        if(hte__->key == NULL) continue;
-
-#define H_FOREACH_KEY(HT, KEYVAR) H_FOREACH_(HT)                            \
-        const KEYVAR = hte__->key;
-
-#define H_FOREACH(HT, KEYVAR, VALVAR) H_FOREACH_KEY(HT, KEYVAR)             \
-        VALVAR = hte__->value;
-
-#define H_END_FOREACH                                                       \
-      }                                                                     \
-    }                                                                       \
-  }
-
-
-
 HLRItem *h_lritem_new(HArena *a, HCFChoice *lhs, HCFChoice **rhs, size_t mark);
 HLRState *h_lrstate_new(HArena *arena);
 HLRTable *h_lrtable_new(HAllocator *mm__, size_t nrows);
@@ -115,6 +139,7 @@ HLRAction *h_reduce_action(HArena *arena, const HLRItem *item);
 HLRAction *h_shift_action(HArena *arena, size_t nextstate);
 HLRAction *h_lr_conflict(HArena *arena, HLRAction *action, HLRAction *new);
 bool h_lrtable_row_empty(const HLRTable *table, size_t i);
+void h_lrtable_pack(HLRTable *table);
 
 bool h_eq_symbol(const void *p, const void *q);
 bool h_eq_lr_itemset(const void *p, const void *q);
@@ -130,11 +155,12 @@ HCFChoice *h_desugar_augmented(HAllocator *mm__, HParser *parser);
 int h_lalr_compile(HAllocator* mm__, HParser* parser, const void* params);
 void h_lalr_free(HParser *parser);
 
+void h_lrstack_push(HArena *arena, HLRStack *stack, size_t state, HParsedToken *value);
 const HLRAction *h_lrengine_action(const HLREngine *engine);
 bool h_lrengine_step(HLREngine *engine, const HLRAction *action);
 HParseResult *h_lrengine_result(HLREngine *engine);
-HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream);
-HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream);
+HParseResult *h_lr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream, HParseCtx *ctx);
+HParseResult *h_glr_parse(HAllocator* mm__, const HParser* parser, HInputStream* stream, HParseCtx *ctx);
 
 void h_pprint_lritem(FILE *f, const HCFGrammar *g, const HLRItem *item);
 void h_pprint_lrstate(FILE *f, const HCFGrammar *g,
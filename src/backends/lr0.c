@@ -176,7 +176,7 @@ void put_shift(HLRTable *table, size_t state, const HCFChoice *symbol,
     break;
   default:
     // nonterminal case
-    h_hashtable_put(table->ntmap[state], symbol, action);
+    h_opentable_put(table->ntmap[state], symbol, action);
   }
 }
 
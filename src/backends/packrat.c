@@ -35,16 +35,124 @@ static inline HParseResult* perform_lowlevel_parse(HParseState *state, const HPa
     return NULL; // overrun is always failure.
 #ifdef CONSISTENCY_CHECK
   if (!tmp_res) {
-    state->input_stream = INVALID;
-    state->input_stream.input = key->input_pos.input;
+    // a failed parse leaves no position; whoever goes on must restore one
+    const uint8_t *input = state->input_stream.input;
+    memset(&state->input_stream, 0xFF, sizeof(HInputStream));
+    state->input_stream.input = input;
   }
 #endif
   return tmp_res;
 }
 
+/* Cache keys pack the input position and the parser id into 64 bits:
+ *
+ *   | index (35 bits) | bit_offset (4) | overrun (1) | parser id (24) |
+ *
+ * The input pointer, length and endianness are the same throughout a parse
+ * and need not be part of the key. Parser ids are truncated to 24 bits;
+ * cache_key_equal() also compares the parser pointer, so a truncated id
+ * can only cost a hash collision, never a wrong answer.
+ */
+#define H_CACHE_KEY_ID_BITS 24
+#define H_CACHE_KEY_MAX_INDEX (((uint64_t)1 << (64 - H_CACHE_KEY_ID_BITS - 5)) - 1)
+
+static inline uint64_t cache_key_pos(const HInputStream *stream, const HParser *parser) {
+  uint64_t pos = ((uint64_t)stream->index << 5)
+               | ((uint64_t)(stream->bit_offset & 0xF) << 1)
+               | (stream->overrun ? 1 : 0);
+  return (pos << H_CACHE_KEY_ID_BITS)
+       | (parser->id & ((1 << H_CACHE_KEY_ID_BITS) - 1));
+}
+
+/* Compiled rule table.
+ *
+ * h_packrat_compile numbers the parsers reachable from the root and
+ * decides which of them to memoize (see memo_analysis below). rule_of
+ * maps a parser id to its slot among the memoized parsers, to
+ * H_RULE_BYPASS for parsers that are run without touching the memo,
+ * or to H_RULE_UNKNOWN for parsers the compiler never saw, which are
+ * memoized in the hash cache as if uncompiled. owner records which
+ * parser each entry is for, since ids alone need not be unique.
+ *
+ * With H_PACKRAT_DENSE_MEMO, results at byte-aligned positions live in
+ * a position-major array of nslots per position, split into columns of
+ * H_DENSE_COLUMN positions that are allocated on first use. Keys at
+ * other positions go to the hash cache as usual.
+ */
+#define H_DENSE_COLUMN 64
+#define H_RULES_MAX 1024
+#define H_RULES_MAX_SPAN (64 * H_RULES_MAX)
+#define H_RULE_UNKNOWN (-1)
+#define H_RULE_BYPASS (-2)
+
+struct HPackratTable_ {
+  HAllocator *mm__;
+  unsigned int min_id;
+  size_t span;      // length of rule_of
+  size_t nslots;    // number of memoized parsers
+  int16_t *rule_of; // parser->id - min_id -> slot, or H_RULE_*
+  const HParser **owner; // parser->id - min_id -> parser, or NULL
+  bool dense;
+};
+
+struct HPackratDense_ {
+  size_t ncolumns;
+  HParserCacheValue ***columns;
+};
+
+static inline int rule_of(const HPackratTable *t, const HParser *parser) {
+  size_t off = parser->id - t->min_id;
+  return off < t->span && t->owner[off] == parser ? t->rule_of[off] : H_RULE_UNKNOWN;
+}
+
+static HPackratDense *dense_new(HArena *arena, size_t length) {
+  HPackratDense *d = h_arena_malloc(arena, sizeof(HPackratDense));
+  d->ncolumns = length / H_DENSE_COLUMN + 1;
+  d->columns = h_arena_malloc(arena, d->ncolumns * sizeof(HParserCacheValue**));
+  memset(d->columns, 0, d->ncolumns * sizeof(HParserCacheValue**));
+  return d;
+}
+
+// Returns the memo slot for k, or NULL if k belongs in the hash cache.
+static HParserCacheValue **dense_slot(HParseState *state, const HParserCacheKey *k) {
+  HPackratDense *d = state->dense;
+  if (!d)
+    return NULL;
+  uint64_t pos = k->pos >> H_CACHE_KEY_ID_BITS;
+  if (pos & 0xF) // overrun, or not on a byte boundary
+    return NULL;
+  const HPackratTable *t = state->rules;
+  int slot = rule_of(t, k->parser);
+  if (slot < 0)
+    return NULL;
+  size_t index = pos >> 5;
+  HParserCacheValue **column = d->columns[index / H_DENSE_COLUMN];
+  if (!column) {
+    size_t size = H_DENSE_COLUMN * t->nslots * sizeof(HParserCacheValue*);
+    column = h_arena_malloc(state->arena, size);
+    memset(column, 0, size);
+    d->columns[index / H_DENSE_COLUMN] = column;
+  }
+  return &column[(index % H_DENSE_COLUMN) * t->nslots + slot];
+}
+
+static inline HParserCacheValue *cache_get(HParseState *state, HParserCacheKey *k) {
+  HParserCacheValue **slot = dense_slot(state, k);
+  return slot ? *slot : h_opentable_get(state->cache, k);
+}
+
+static inline void cache_put(HParseState *state, HParserCacheKey *k, HParserCacheValue *v) {
+  HParserCacheValue **slot = dense_slot(state, k);
+  if (slot)
+    *slot = v;
+  else
+    h_opentable_put(state->cache, k, v);
+}
+
 HParserCacheValue* recall(HParserCacheKey *k, HParseState *state) {
-  HParserCacheValue *cached = h_hashtable_get(state->cache, k);
-  HRecursionHead *head = h_hashtable_get(state->recursion_heads, k);
+  HParserCacheValue *cached = cache_get(state, k);
+  HRecursionHead *head = h_opentable_empty(state->recursion_heads)
+    ? NULL : h_opentable_get(state->recursion_heads, k);
   if (!head) { // No heads found
     return cached;
   } else { // Some heads found
@@ -99,8 +207,8 @@ void setupLR(const HParser *p, HParseState *state, HLeftRec *rec_detect) {
 
 HParseResult* grow(HParserCacheKey *k, HParseState *state, HRecursionHead *head) {
   // Store the head into the recursion_heads
-  h_hashtable_put(state->recursion_heads, k, head);
-  HParserCacheValue *old_cached = h_hashtable_get(state->cache, k);
+  h_opentable_put(state->recursion_heads, k, head);
+  HParserCacheValue *old_cached = cache_get(state, k);
   if (!old_cached || PC_LEFT == old_cached->value_type)
     errx(1, "impossible match");
   HParseResult *old_res = old_cached->right->result;
@@ -114,12 +222,12 @@ HParseResult* grow(HParserCacheKey *k, HParseState *state, HRecursionHead *head)
 	(old_res->ast->index == tmp_res->ast->index && old_res->ast->bit_offset < tmp_res->ast->bit_offset)) {
       HParserCacheValue *v = a_new(HParserCacheValue, 1);
       v->value_type = PC_RIGHT; v->right = cached_result(state, tmp_res);
-      h_hashtable_put(state->cache, k, v);
+      cache_put(state, k, v);
       return grow(k, state, head);
     } else {
       // we're done with growing, we can remove data from the recursion head
-      h_hashtable_del(state->recursion_heads, k);
-      HParserCacheValue *cached = h_hashtable_get(state->cache, k);
+      h_opentable_del(state->recursion_heads, k);
+      HParserCacheValue *cached = cache_get(state, k);
       if (cached && PC_RIGHT == cached->value_type) {
 	return cached->right->result;
       } else {
@@ -127,7 +235,7 @@ HParseResult* grow(HParserCacheKey *k, HParseState *state, HRecursionHead *head)
       }
     }
   } else {
-    h_hashtable_del(state->recursion_heads, k);
+    h_opentable_del(state->recursion_heads, k);
     return old_res;
   }
 }
@@ -142,7 +250,7 @@ HParseResult* lr_answer(HParserCacheKey *k, HParseState *state, HLeftRec *growab
       // update cache
       HParserCacheValue *v = a_new(HParserCacheValue, 1);
       v->value_type = PC_RIGHT; v->right = cached_result(state, growable->seed);
-      h_hashtable_put(state->cache, k, v);
+      cache_put(state, k, v);
       if (!growable->seed)
 	return NULL;
       else
@@ -155,8 +263,10 @@ HParseResult* lr_answer(HParserCacheKey *k, HParseState *state, HLeftRec *growab
 
 /* Warth's recursion. Hi Alessandro! */
 HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
+  if (state->rules && rule_of(state->rules, parser) == H_RULE_BYPASS)
+    return perform_lowlevel_parse(state, parser);
   HParserCacheKey *key = a_new(HParserCacheKey, 1);
-  key->input_pos = state->input_stream; key->parser = parser;
+  key->pos = cache_key_pos(&state->input_stream, parser); key->parser = parser;
   HParserCacheValue *m = recall(key, state);
   // check to see if there is already a result for this object...
   if (!m) {
@@ -167,7 +277,7 @@ HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
     // cache it
     HParserCacheValue *dummy = a_new(HParserCacheValue, 1);
     dummy->value_type = PC_LEFT; dummy->left = base;
-    h_hashtable_put(state->cache, key, dummy);
+    cache_put(state, key, dummy);
     // parse the input
     HParseResult *tmp_res = perform_lowlevel_parse(state, parser);
     // the base variable has passed equality tests with the cache
@@ -176,7 +286,7 @@ HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
     if (NULL == base->head) {
       HParserCacheValue *right = a_new(HParserCacheValue, 1);
       right->value_type = PC_RIGHT; right->right = cached_result(state, tmp_res);
-      h_hashtable_put(state->cache, key, right);
+      cache_put(state, key, right);
       return tmp_res;
     } else {
       base->seed = tmp_res;
@@ -195,40 +305,222 @@ HParseResult* h_do_parse(const HParser* parser, HParseState *state) {
   }
 }
 
+/* Memoization analysis.
+ *
+ * Memoizing a parser only pays off if it can be asked for the same
+ * position twice, and terminals are cheaper to re-run than to look up.
+ * A composite parser is memoized when it is reachable along more than
+ * one edge of the combinator graph (a choice that backtracks into it,
+ * a lookahead followed by the same parser, ...), or when it lies on a
+ * cycle, which left recursion needs in order to terminate. Parsers with
+ * a single incoming edge are re-run only when their parent is, and the
+ * parent is either memoized or in turn has a single parent.
+ *
+ * h_set_memoize overrides the first rule for a given parser. Parsers on
+ * a cycle are memoized regardless.
+ */
+typedef struct {
+  HHashTable *refs;   // parser -> number of incoming edges
+  HHashTable *num;    // parser -> node number + 1
+  const HParser **nodes;
+  size_t *order, *lowlink, *stack;
+  bool *on_stack, *cyclic;
+  size_t sp, counter;
+} HMemoAnalysis;
+
+static void count_refs(const HParser *p, void *arg) {
+  HMemoAnalysis *ma = arg;
+  if (!p)
+    return;
+  uintptr_t n = (uintptr_t)h_hashtable_get(ma->refs, p);
+  h_hashtable_put(ma->refs, p, (void*)(n + 1));
+  if (n == 0 && p->vtable->visit)
+    p->vtable->visit(p->env, count_refs, ma);
+}
+
+static inline size_t node_of(HMemoAnalysis *ma, const HParser *p) {
+  return (uintptr_t)h_hashtable_get(ma->num, p) - 1;
+}
+
+typedef struct {
+  HMemoAnalysis *ma;
+  size_t v;
+} HSCCFrame;
+
+static void strongconnect(HMemoAnalysis *ma, size_t v);
+
+// Tarjan's algorithm, one edge v -> p at a time
+static void scc_edge(const HParser *p, void *arg) {
+  HSCCFrame *f = arg;
+  HMemoAnalysis *ma = f->ma;
+  if (!p)
+    return;
+  size_t w = node_of(ma, p);
+  if (w == f->v)
+    ma->cyclic[w] = true;
+  if (ma->order[w] == 0) {
+    strongconnect(ma, w);
+    if (ma->lowlink[w] < ma->lowlink[f->v])
+      ma->lowlink[f->v] = ma->lowlink[w];
+  } else if (ma->on_stack[w] && ma->order[w] < ma->lowlink[f->v]) {
+    ma->lowlink[f->v] = ma->order[w];
+  }
+}
+
+static void strongconnect(HMemoAnalysis *ma, size_t v) {
+  ma->order[v] = ma->lowlink[v] = ++ma->counter;
+  ma->stack[ma->sp++] = v;
+  ma->on_stack[v] = true;
+  const HParser *p = ma->nodes[v];
+  if (p->vtable->visit) {
+    HSCCFrame f = { ma, v };
+    p->vtable->visit(p->env, scc_edge, &f);
+  }
+  if (ma->lowlink[v] == ma->order[v]) {
+    size_t base = ma->sp;
+    do {
+      ma->on_stack[ma->stack[--base]] = false;
+    } while (ma->stack[base] != v);
+    if (ma->sp - base > 1)
+      for (size_t i = base; i < ma->sp; i++)
+	ma->cyclic[ma->stack[i]] = true;
+    ma->sp = base;
+  }
+}
+
+static bool should_memoize(HMemoAnalysis *ma, size_t v) {
+  const HParser *p = ma->nodes[v];
+  if (ma->cyclic[v] || p->memoize == H_MEMO_ALWAYS)
+    return true;
+  if (p->memoize == H_MEMO_NEVER || !p->vtable->visit)
+    return false;
+  return (uintptr_t)h_hashtable_get(ma->refs, p) > 1;
+}
+
+// Returns NULL if there are too many parsers, or their ids are too
+// scattered, for a rule table; the parse then memoizes everything.
+static HPackratTable *rule_table_new(HAllocator *mm__, const HParser *root, bool dense) {
+  HArena *arena = h_new_arena(mm__, 0);
+  HMemoAnalysis ma;
+  memset(&ma, 0, sizeof(ma));
+  ma.refs = h_hashtable_new(arena, h_eq_ptr, h_hash_ptr);
+  count_refs(root, &ma);
+
+  HPackratTable *table = NULL;
+  size_t n = ma.refs->used;
+  unsigned int min_id = root->id, max_id = root->id;
+  H_FOREACH_KEY(ma.refs, const HParser *p)
+    if (p->id < min_id) min_id = p->id;
+    if (p->id > max_id) max_id = p->id;
+  H_END_FOREACH
+  size_t span = (size_t)max_id - min_id + 1;
+  if (n > H_RULES_MAX || span > H_RULES_MAX_SPAN)
+    goto out;
+
+  ma.num = h_hashtable_new(arena, h_eq_ptr, h_hash_ptr);
+  ma.nodes = h_arena_malloc(arena, n * sizeof(const HParser*));
+  size_t i = 0;
+  H_FOREACH_KEY(ma.refs, const HParser *p)
+    ma.nodes[i] = p;
+    h_hashtable_put(ma.num, p, (void*)(uintptr_t)++i);
+  H_END_FOREACH
+  ma.order = h_arena_malloc(arena, 3 * n * sizeof(size_t));
+  ma.lowlink = ma.order + n;
+  ma.stack = ma.lowlink + n;
+  ma.on_stack = h_arena_malloc(arena, 2 * n * sizeof(bool));
+  ma.cyclic = ma.on_stack + n;
+  memset(ma.order, 0, n * sizeof(size_t));
+  memset(ma.on_stack, 0, 2 * n * sizeof(bool));
+  strongconnect(&ma, node_of(&ma, root));
+
+  table = h_new(HPackratTable, 1);
+  table->mm__ = mm__;
+  table->min_id = min_id;
+  table->span = span;
+  table->nslots = 0;
+  table->dense = dense;
+  table->rule_of = h_new(int16_t, span);
+  table->owner = h_new(const HParser*, span);
+  for (size_t j = 0; j < span; j++) {
+    table->rule_of[j] = H_RULE_UNKNOWN;
+    table->owner[j] = NULL;
+  }
+  // Parsers that share an id can't share its slot; they are left unknown,
+  // so they go to the hashed memo, which tells them apart by pointer.
+  bool *shared = h_arena_malloc(arena, 2 * span * sizeof(bool));
+  bool *seen = shared + span;
+  memset(shared, 0, 2 * span * sizeof(bool));
+  for (size_t v = 0; v < n; v++) {
+    size_t off = ma.nodes[v]->id - min_id;
+    shared[off] = seen[off];
+    seen[off] = true;
+  }
+  for (size_t v = 0; v < n; v++) {
+    size_t off = ma.nodes[v]->id - min_id;
+    if (shared[off])
+      continue;
+    table->owner[off] = ma.nodes[v];
+    table->rule_of[off] =
+      should_memoize(&ma, v) ? (int16_t)table->nslots++ : H_RULE_BYPASS;
+  }
+
+ out:
+  h_delete_arena(arena);
+  return table;
+}
+
 int h_packrat_compile(HAllocator* mm__, HParser* parser, const void* params) {
+  parser->backend_data = rule_table_new(mm__, parser,
+					(uintptr_t)params == H_PACKRAT_DENSE_MEMO);
   parser->backend = PB_PACKRAT;
-  return 0; // No compilation necessary, and everything should work
-	    // out of the box.
+  return 0; // Everything works out of the box; the rule table is only
+	    // an optimization, so there is nothing to fail here.
 }
 
 void h_packrat_free(HParser *parser) {
+  HPackratTable *table = parser->backend_data;
+  if (table) {
+    HAllocator *mm__ = table->mm__;
+    h_free(table->rule_of);
+    h_free(table->owner);
+    h_free(table);
+    parser->backend_data = NULL;
+  }
   parser->backend = PB_PACKRAT; // revert to default, oh that's us
 }
 
-static uint32_t cache_key_hash(const void* key) {
-  return h_djbhash(key, sizeof(HParserCacheKey));
+// Fibonacci hashing: one multiply, keep the well-mixed high bits
+static HHashValue cache_key_hash(const void* key) {
+  const HParserCacheKey *k = key;
+  return (HHashValue)((k->pos * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
 }
 static bool cache_key_equal(const void* key1, const void* key2) {
-  return memcmp(key1, key2, sizeof(HParserCacheKey)) == 0;
+  const HParserCacheKey *k1 = key1, *k2 = key2;
+  return k1->pos == k2->pos && k1->parser == k2->parser;
 }
 
-HParseResult *h_packrat_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream) {
-  HArena * arena = h_new_arena(mm__, 0);
+HParseResult *h_packrat_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream, HParseCtx *ctx) {
+  assert_message(input_stream->length <= H_CACHE_KEY_MAX_INDEX,
+                 "input too long for the packrat backend");
+  HArena * arena = h_parse_arena(mm__, ctx);
   HParseState *parse_state = a_new_(arena, HParseState, 1);
-  parse_state->cache = h_hashtable_new(arena, cache_key_equal, // key_equal_func
+  parse_state->cache = h_opentable_new(arena, cache_key_equal, // key_equal_func
 				       cache_key_hash); // hash_func
   parse_state->input_stream = *input_stream;
   parse_state->lr_stack = h_slist_new(arena);
-  parse_state->recursion_heads = h_hashtable_new(arena, cache_key_equal,
+  parse_state->recursion_heads = h_opentable_new(arena, cache_key_equal,
 						 cache_key_hash);
   parse_state->arena = arena;
+  parse_state->rules = parser->backend_data;
+  parse_state->dense = parse_state->rules && parse_state->rules->dense
+    ? dense_new(arena, input_stream->length) : NULL;
   HParseResult *res = h_do_parse(parser, parse_state);
   h_slist_free(parse_state->lr_stack);
-  h_hashtable_free(parse_state->recursion_heads);
+  h_opentable_free(parse_state->recursion_heads);
   // tear down the parse state
-  h_hashtable_free(parse_state->cache);
+  h_opentable_free(parse_state->cache);
   if (!res)
-    h_delete_arena(parse_state->arena);
+    h_parse_arena_done(ctx, arena);
 
   return res;
 }
@@ -14,170 +14,1277 @@ typedef enum HSVMOp_ {
   SVM_ACTION, // Same meaning as RVM_ACTION
   SVM_CAPTURE, // Same meaning as RVM_CAPTURE
   SVM_ACCEPT,
+  SVM_BITS, // Same meaning as RVM_BITS
   SVM_OPCOUNT
 } HSVMOp;
 
-typedef struct HRVMTrace_ {
-  struct HRVMTrace_ *next; // When parsing, these are
-			   // reverse-threaded. There is a postproc
-			   // step that inverts all the pointers.
+// One op of a trace: what the SVM is to do, and where in the input.
+typedef struct HRVMTraceOp_ {
   size_t input_pos;
-  uint16_t arg;
+  uint32_t arg;
   uint8_t opcode;
-} HRVMTrace;
+} HRVMTraceOp;
+
+// The traces of threads, as they run, in one array that only grows: each
+// entry is an op and the index of the op before it in its thread's trace.
+// Threads that fork share what came before, as in a persistent stack, so
+// that recording an op is an append. The array is kept, and reused, from
+// one run to the next.
+#define H_RVM_NO_TRACE SIZE_MAX
+
+typedef struct HRVMTraceEntry_ {
+  HRVMTraceOp op;
+  size_t prev;
+} HRVMTraceEntry;
+
+typedef struct HRVMTraces_ {
+  HAllocator *mm__;
+  HRVMTraceEntry *entries;
+  size_t n, cap;
+} HRVMTraces;
+
+// A trace, in order
+typedef struct HRVMOps_ {
+  HRVMTraceOp *ops;
+  size_t n;
+} HRVMOps;
 
 typedef struct HRVMThread_ {
-  HRVMTrace *trace;
-  uint16_t ip;
+  size_t trace;     // its newest op, or H_RVM_NO_TRACE
+  size_t parent;    // which of the threads stepped from this round it came from
+  size_t start;     // where its match would start; see h_rvm_find
+  uint32_t ip;
+  uint32_t count;   // the counts of the loops it is in; see rvm_slots
 } HRVMThread;
 
-HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace, const uint8_t *input, int len);
+static void traces_grow(HRVMTraces *tr) {
+  HAllocator *mm__ = tr->mm__;
+  tr->cap = tr->cap ? tr->cap * 2 : 1024;
+  tr->entries = mm__->realloc(mm__, tr->entries, tr->cap * sizeof(*tr->entries));
+  // TODO: Handle the allocation failed case nicely.
+}
 
-HRVMTrace *invert_trace(HRVMTrace *trace) {
-  HRVMTrace *last = NULL;
-  if (!trace)
-    return NULL;
-  if (!trace->next)
-    return trace;
-  do {
-    HRVMTrace *next = trace->next;
-    trace->next = last;
-    last = trace;
-    trace = next;
-  } while (trace);
-  return last;
-}
-
-void* h_rvm_run__m(HAllocator *mm__, HRVMProg *prog, const uint8_t* input, size_t len) {
-  HArena *arena = h_new_arena(mm__, 0);
-  HSArray *heads_n = h_sarray_new(mm__, prog->length), // Both of these contain HRVMTrace*'s
-    *heads_p = h_sarray_new(mm__, prog->length);
-
-  HRVMTrace *ret_trace = NULL;
-  
-  uint8_t *insn_seen = a_new(uint8_t, prog->length); // 0 -> not seen, 1->processed, 2->queued
-  HRVMThread *ip_queue = a_new(HRVMThread, prog->length);
-  size_t ipq_top;
-
-#define THREAD ip_queue[ipq_top-1]
-#define PUSH_SVM(op_, arg_) do { \
-	  HRVMTrace *nt = a_new(HRVMTrace, 1); \
-	  nt->arg = (arg_);		       \
-	  nt->opcode = (op_);		       \
-	  nt->next = THREAD.trace;	       \
-	  nt->input_pos = off;		       \
-	  THREAD.trace = nt;		       \
+// Add an op after prev; returns its index.
+static inline size_t trace_push(HRVMTraces *tr, size_t prev, uint8_t opcode, uint32_t arg, size_t pos) {
+  if (tr->n == tr->cap)
+    traces_grow(tr);
+  HRVMTraceEntry *e = &tr->entries[tr->n];
+  e->op.input_pos = pos;
+  e->op.arg = arg;
+  e->op.opcode = opcode;
+  e->prev = prev;
+  return tr->n++;
+}
+
+// The trace that ends at t, in order, copied into arena.
+static HRVMOps trace_ops(HArena *arena, const HRVMTraces *tr, size_t t) {
+  HRVMOps ret = { NULL, 0 };
+  for (size_t i = t; i != H_RVM_NO_TRACE; i = tr->entries[i].prev)
+    ret.n++;
+  if (ret.n == 0)
+    return ret;
+  ret.ops = a_new(HRVMTraceOp, ret.n);
+  for (size_t i = ret.n; i-- > 0; t = tr->entries[t].prev)
+    ret.ops[i] = tr->entries[t].op;
+  return ret;
+}
+
+typedef struct HRVMChunk_ HRVMChunk;
+static HParseResult *run_trace(HAllocator *mm__, HParseCtx *pctx, HRVMProg *orig_prog, HRVMOps trace,
+			       const HRVMChunk *chunks, size_t nchunks);
+
+// {{{ Threaded code
+//
+// The interpreter does not run prog->insns but prog->code, built from them
+// once the program is complete. Each insn is turned into a superinstruction
+// that also does the work of the insns after it, as long as those can only
+// be reached by falling through: MATCH+STEP, MATCH+GOTO, FORK+MATCH+GOTO,
+// PUSH+MATCH+STEP (a ch, or the first byte of a token), the same two with
+// MATCH_SET (a charset), BITS+MATCH+STEP (a field that starts a byte), and
+// CAPTURE+ACTION. Such insns can't be reached twice in a step, so
+// they skip the insn_seen check, too. Every ip keeps an entry of its own, so
+// that a thread may resume anywhere.
+
+typedef enum HRVMSuperOp_ {
+  // The plain ops, with the same numbers as in HRVMOp
+  RVMS_ACCEPT,
+  RVMS_GOTO,
+  RVMS_FORK,
+  RVMS_PUSH,
+  RVMS_ACTION,
+  RVMS_CAPTURE,
+  RVMS_EOF,
+  RVMS_MATCH,
+  RVMS_STEP,
+  RVMS_MATCH_SET,
+  RVMS_SWITCH,
+  RVMS_BITS,
+  RVMS_COUNT_PUSH,
+  RVMS_COUNT_LOOP,
+  RVMS_COUNT_INC,
+  RVMS_COUNT_POP,
+  // and the fused ones
+  RVMS_MATCH_STEP,
+  RVMS_MATCH_GOTO,
+  RVMS_FORK_MATCH_GOTO,
+  RVMS_PUSH_MATCH_STEP,
+  RVMS_MATCH_SET_STEP,
+  RVMS_PUSH_MATCH_SET_STEP,
+  RVMS_CAPTURE_ACTION,
+  RVMS_BITS_MATCH_STEP,
+  RVMS_OPCOUNT
+} HRVMSuperOp;
+
+struct HRVMSuperInsn_ {
+  uint8_t op;
+  uint8_t lo, hi; // the range of the MATCH, if any
+  bool target;    // reachable other than by falling through
+  uint32_t arg;   // the FORK target, the action, the charset, the field or the bounds
+  uint32_t next;  // where to go on to, or resume at after a STEP
+  uint32_t slot;  // its first entry in insn_seen; see rvm_slots
+};
+
+// The rounds of a loop that its count tells apart: up to the max, or with
+// none, up to the min, past which one round is as good as the next.
+static inline uint32_t bounds_range(const HRVMBounds *b) {
+  return (b->max == H_RVM_UNBOUNDED ? b->min : b->max) + 1;
+}
+
+// A thread is where it is in the program, and how far it is into each
+// counted loop it is in: the counts of those, innermost last, make up one
+// mixed-radix number, th.count. Each insn has a slot in insn_seen for every
+// value th.count can take there, so that threads that only differ in their
+// counts don't kill each other, and no more threads than slots can be
+// about at once. COUNT_PUSH is outside its loop, COUNT_POP still in it.
+//
+// Lays the slots out, in code unless that's NULL, and returns how many
+// there are: prog->length, but for counted loops. Stops at more than
+// H_RVM_MAX_LENGTH.
+static size_t rvm_slots(const HRVMProg *prog, HRVMSuperInsn *code) {
+  uint64_t scale = 1; // the values th.count can take
+  size_t nslots = 0;
+  for (size_t i = 0; i < prog->length && nslots <= H_RVM_MAX_LENGTH; i++) {
+    if (code)
+      code[i].slot = nslots;
+    nslots += scale;
+    if (prog->insns[i].op == RVM_COUNT_PUSH)
+      scale *= bounds_range(&prog->bounds[prog->insns[i].arg]);
+    else if (prog->insns[i].op == RVM_COUNT_POP)
+      scale /= bounds_range(&prog->bounds[prog->insns[i].arg]);
+  }
+  return nslots;
+}
+
+static HRVMSuperInsn *rvm_superinsns(HAllocator *mm__, const HRVMProg *prog) {
+  const size_t n = prog->length;
+  const HRVMInsn *insns = prog->insns;
+  HRVMSuperInsn *code = h_new(HRVMSuperInsn, n);
+  for (size_t i = 0; i < n; i++)
+    code[i].target = (i == 0);
+  for (size_t i = 0; i < n; i++) {
+    if ((insns[i].op == RVM_GOTO || insns[i].op == RVM_FORK) && insns[i].arg < n)
+      code[insns[i].arg].target = true;
+    else if (insns[i].op == RVM_STEP && i + 1 < n)
+      code[i + 1].target = true;
+  }
+
+  // Whether insns i+1..i+k are only reached from i, and have the given ops.
+#define FUSES(k, op1, op2) (i + (k) < n && !code[i + 1].target && insns[i + 1].op == (op1) \
+			    && ((k) < 2 || (!code[i + 2].target && insns[i + 2].op == (op2))))
+  for (size_t i = 0; i < n; i++) {
+    HRVMSuperInsn *c = &code[i];
+    c->op = insns[i].op;
+    c->arg = insns[i].arg;
+    c->lo = insns[i].arg & 0xff;
+    c->hi = (insns[i].arg >> 8) & 0xff;
+    c->next = i + 1;
+    switch (insns[i].op) {
+    case RVM_GOTO:
+      c->next = insns[i].arg;
+      break;
+    case RVM_COUNT_LOOP:
+      c->next = i + 2; // round again; the GOTO at i + 1 leaves
+      break;
+    case RVM_MATCH:
+      if (FUSES(1, RVM_STEP, 0)) {
+	c->op = RVMS_MATCH_STEP;
+	c->next = i + 2;
+      } else if (FUSES(1, RVM_GOTO, 0)) {
+	c->op = RVMS_MATCH_GOTO;
+	c->next = insns[i + 1].arg;
+      }
+      break;
+    case RVM_MATCH_SET:
+      if (FUSES(1, RVM_STEP, 0)) {
+	c->op = RVMS_MATCH_SET_STEP;
+	c->next = i + 2;
+      }
+      break;
+    case RVM_FORK:
+      // If the FORK is taken, the MATCH+GOTO at i+1 carries on later.
+      if (FUSES(2, RVM_MATCH, RVM_GOTO)) {
+	c->op = RVMS_FORK_MATCH_GOTO;
+	c->lo = insns[i + 1].arg & 0xff;
+	c->hi = (insns[i + 1].arg >> 8) & 0xff;
+	c->next = insns[i + 2].arg;
+      }
+      break;
+    case RVM_PUSH:
+      if (FUSES(2, RVM_MATCH, RVM_STEP)) {
+	c->op = RVMS_PUSH_MATCH_STEP;
+	c->lo = insns[i + 1].arg & 0xff;
+	c->hi = (insns[i + 1].arg >> 8) & 0xff;
+	c->next = i + 3;
+      } else if (FUSES(2, RVM_MATCH_SET, RVM_STEP)) {
+	c->op = RVMS_PUSH_MATCH_SET_STEP;
+	c->arg = insns[i + 1].arg;
+	c->next = i + 3;
+      }
+      break;
+    case RVM_BITS:
+      if (FUSES(2, RVM_MATCH, RVM_STEP)) {
+	c->op = RVMS_BITS_MATCH_STEP;
+	c->lo = insns[i + 1].arg & 0xff;
+	c->hi = (insns[i + 1].arg >> 8) & 0xff;
+	c->next = i + 3;
+      }
+      break;
+    case RVM_CAPTURE:
+      if (FUSES(1, RVM_ACTION, 0)) {
+	c->op = RVMS_CAPTURE_ACTION;
+	c->arg = insns[i + 1].arg;
+	c->next = i + 2;
+      }
+      break;
+    }
+  }
+#undef FUSES
+  rvm_slots(prog, code);
+  return code;
+}
+
+// How many of the bytes in set come before ch.
+static inline size_t set_rank(const uint8_t *set, uint8_t ch) {
+  size_t rank = 0;
+  for (size_t i = 0; i < (size_t)(ch >> 3); i++)
+    rank += __builtin_popcount(set[i]);
+  return rank + __builtin_popcount(set[ch >> 3] & ((1u << (ch & 7)) - 1));
+}
+
+// Scratch space for rvm_step; prog->nslots of each.
+typedef struct HRVMStep_ {
+  const HRVMProg *prog;
+  uint8_t *insn_seen; // 0 -> not seen, 1->processed, 2->queued
+  HRVMThread *stack;
+  HRVMThread *next;   // the threads that stepped, in priority order
+  HRVMTraces *traces; // for the ops the threads add; NULL to not record them
+} HRVMStep;
+
+// Run each of threads, in order, up to its next STEP, on one byte of input
+// (ch is 0 at the end of it). The first thread to reach an insn keeps it.
+// Returns how many threads stepped; sets *accept, and the accepting thread,
+// if one accepted: the last of those with the first start. Ops are recorded
+// as happening at pos.
+static size_t rvm_step(HRVMStep *st, const HRVMThread *threads, size_t nthreads,
+		       uint8_t ch, bool eof, size_t pos, bool *accept, HRVMThread *accepted) {
+  static const void *const dispatch[RVMS_OPCOUNT] = {
+    [RVMS_ACCEPT] = &&op_accept,
+    [RVMS_GOTO] = &&op_goto,
+    [RVMS_FORK] = &&op_fork,
+    [RVMS_PUSH] = &&op_push,
+    [RVMS_ACTION] = &&op_action,
+    [RVMS_CAPTURE] = &&op_capture,
+    [RVMS_EOF] = &&op_eof,
+    [RVMS_MATCH] = &&op_match,
+    [RVMS_STEP] = &&op_step,
+    [RVMS_MATCH_SET] = &&op_match_set,
+    [RVMS_SWITCH] = &&op_switch,
+    [RVMS_BITS] = &&op_bits,
+    [RVMS_COUNT_PUSH] = &&op_count_push,
+    [RVMS_COUNT_LOOP] = &&op_count_loop,
+    [RVMS_COUNT_INC] = &&op_count_inc,
+    [RVMS_COUNT_POP] = &&op_count_pop,
+    [RVMS_MATCH_STEP] = &&op_match_step,
+    [RVMS_MATCH_GOTO] = &&op_match_goto,
+    [RVMS_FORK_MATCH_GOTO] = &&op_fork_match_goto,
+    [RVMS_PUSH_MATCH_STEP] = &&op_push_match_step,
+    [RVMS_MATCH_SET_STEP] = &&op_match_set_step,
+    [RVMS_PUSH_MATCH_SET_STEP] = &&op_push_match_set_step,
+    [RVMS_CAPTURE_ACTION] = &&op_capture_action,
+    [RVMS_BITS_MATCH_STEP] = &&op_bits_match_step,
+  };
+  const HRVMSuperInsn *code = st->prog->code;
+  uint8_t (*charsets)[32] = st->prog->charsets;
+  const HRVMBounds *bounds = st->prog->bounds;
+  uint8_t *insn_seen = st->insn_seen;
+  HRVMThread *stack = st->stack;
+  HRVMTraces *traces = st->traces;
+  size_t nnext = 0;
+  *accept = false;
+  memset(insn_seen, 0, st->prog->nslots); // no insns seen yet
+
+#define RECORD(op_, arg_) do {					\
+    if (traces)								\
+      th.trace = trace_push(traces, th.trace, (op_), (arg_), pos);	\
   } while(0)
+#define SEEN(ip_) insn_seen[code[ip_].slot + th.count]
+#define MATCHES(c) (ch >= (c)->lo && ch <= (c)->hi)
+#define IN_SET(c) ((charsets[(c)->arg][ch >> 3] >> (ch & 7)) & 1)
 
-  ((HRVMTrace*)h_sarray_set(heads_n, 0, a_new(HRVMTrace, 1)))->opcode = SVM_NOP; // Initial thread
-  
-  size_t off = 0;
-  int live_threads = 1; // May be redundant
-  for (off = 0; off <= len; off++) {
-    uint8_t ch = ((off == len) ? 0 : input[off]);
-    /* scope */ {
-      HSArray *heads_t;
-      heads_t = heads_n;
-      heads_n = heads_p;
-      heads_p = heads_t;
-      h_sarray_clear(heads_n);
+  for (size_t t = 0; t < nthreads; t++) {
+    HRVMThread th = threads[t];
+    th.parent = t;
+    size_t top = 0;
+    const HRVMSuperInsn *c;
+  next_insn:
+    c = &code[th.ip];
+    if (c->target) {
+      if (SEEN(th.ip) == 1)
+	goto kill;
+      SEEN(th.ip) = 1;
     }
-    memset(insn_seen, 0, prog->length); // no insns seen yet
-    if (!live_threads)
-      goto match_fail;
-    live_threads = 0;
-    HRVMTrace *tr_head;
-    H_SARRAY_FOREACH_KV(tr_head,ip_s,heads_p) {
-      ipq_top = 1;
-      // TODO: Write this as a threaded VM
-      THREAD.ip = ip_s;
-      THREAD.trace = tr_head;
-      uint8_t hi, lo;
-      uint16_t arg;
-      while(ipq_top > 0) {
-	if (insn_seen[THREAD.ip] == 1) {
-	  ipq_top--; // Kill thread.
-	  continue;
-	}
-	insn_seen[THREAD.ip] = 1;
-	arg = prog->insns[THREAD.ip].arg;
-	switch(prog->insns[THREAD.ip].op) {
-	case RVM_ACCEPT:
-	  PUSH_SVM(SVM_ACCEPT, 0);
-	  ret_trace = THREAD.trace;
-	  ipq_top--;
-	  goto next_insn;
-	case RVM_MATCH:
-	  hi = (arg >> 8) & 0xff;
-	  lo = arg & 0xff;
-	  THREAD.ip++;
-	  if (ch < lo || ch > hi)
-	    ipq_top--; // terminate thread
-	  goto next_insn;
-	case RVM_GOTO:
-	  THREAD.ip = arg;
-	  goto next_insn;
-	case RVM_FORK:
-	  THREAD.ip++;
-	  if (!insn_seen[arg]) {
-	    insn_seen[THREAD.ip] = 2;
-	    HRVMTrace* tr = THREAD.trace;
-	    ipq_top++;
-	    THREAD.ip = arg;
-	    THREAD.trace = tr;
-	  }
-	  goto next_insn;
-	case RVM_PUSH:
-	  PUSH_SVM(SVM_PUSH, 0);
-	  THREAD.ip++;
-	  goto next_insn;
-	case RVM_ACTION:
-	  PUSH_SVM(SVM_ACTION, arg);
-	  THREAD.ip++;
-	  goto next_insn;
-	case RVM_CAPTURE:
-	  PUSH_SVM(SVM_CAPTURE, 0);
-	  THREAD.ip++;
-	  goto next_insn;
-	case RVM_EOF:
-	  THREAD.ip++;
-	  if (off != len)
-	    ipq_top--; // Terminate thread
-	  goto next_insn;
-	case RVM_STEP:
-	  // save thread
-	  live_threads++;
-	  h_sarray_set(heads_n, ++THREAD.ip, THREAD.trace);
-	  ipq_top--;
-	  goto next_insn;
-	}
-      next_insn:
-	;
-	
+    goto *dispatch[c->op];
+
+  op_accept:
+    RECORD(SVM_ACCEPT, 0);
+    if (!*accept || th.start == accepted->start)
+      *accepted = th;
+    *accept = true;
+    goto kill;
+  op_fork:
+    th.ip = c->next;
+    if (!SEEN(c->arg)) {
+      SEEN(th.ip) = 2;
+      stack[top++] = th;
+      th.ip = c->arg;
+    }
+    goto next_insn;
+  op_push:
+    RECORD(SVM_PUSH, 0);
+    th.ip = c->next;
+    goto next_insn;
+  op_action:
+    RECORD(SVM_ACTION, c->arg);
+    th.ip = c->next;
+    goto next_insn;
+  op_capture:
+    RECORD(SVM_CAPTURE, 0);
+    th.ip = c->next;
+    goto next_insn;
+  op_bits:
+    RECORD(SVM_BITS, c->arg);
+    th.ip = c->next;
+    goto next_insn;
+  op_count_push:
+    th.count *= bounds_range(&bounds[c->arg]);
+    th.ip = c->next;
+    goto next_insn;
+  op_count_loop: {
+    const HRVMBounds *b = &bounds[c->arg];
+    uint32_t n = th.count % bounds_range(b);
+    uint32_t out = code[th.ip + 1].next;
+    if (n >= b->max) {
+      th.ip = out;
+    } else if (n < b->min) {
+      th.ip = c->next;
+    } else {
+      // as a FORK to the next round, with leaving as the way not taken
+      th.ip = out;
+      if (!SEEN(c->next)) {
+	SEEN(th.ip) = 2;
+	stack[top++] = th;
+	th.ip = c->next;
+      }
+    }
+    goto next_insn;
+  }
+  op_count_inc: {
+    uint32_t range = bounds_range(&bounds[c->arg]);
+    if (th.count % range != range - 1)
+      th.count++;
+    th.ip = c->next;
+    goto next_insn;
+  }
+  op_count_pop:
+    th.count /= bounds_range(&bounds[c->arg]);
+    th.ip = c->next;
+    goto next_insn;
+  op_capture_action:
+    RECORD(SVM_CAPTURE, 0);
+    RECORD(SVM_ACTION, c->arg);
+    th.ip = c->next;
+    goto next_insn;
+  op_eof:
+    if (!eof)
+      goto kill;
+    th.ip = c->next;
+    goto next_insn;
+  op_fork_match_goto:
+    if (!SEEN(c->arg)) {
+      th.ip++;
+      SEEN(th.ip) = 2;
+      stack[top++] = th;
+      th.ip = c->arg;
+      goto next_insn;
+    }
+    // fall through
+  op_match_goto:
+  op_match:
+    if (!MATCHES(c))
+      goto kill;
+    // fall through
+  op_goto:
+    th.ip = c->next;
+    goto next_insn;
+  op_match_set:
+    if (!IN_SET(c))
+      goto kill;
+    th.ip = c->next;
+    goto next_insn;
+  op_switch:
+    if (!IN_SET(c))
+      goto kill;
+    th.ip = code[th.ip + 1 + set_rank(charsets[c->arg], ch)].next;
+    goto next_insn;
+  op_push_match_step:
+    if (!MATCHES(c))
+      goto kill;
+    RECORD(SVM_PUSH, 0);
+    goto op_step;
+  op_bits_match_step:
+    if (!MATCHES(c))
+      goto kill;
+    RECORD(SVM_BITS, c->arg);
+    goto op_step;
+  op_push_match_set_step:
+    if (!IN_SET(c))
+      goto kill;
+    RECORD(SVM_PUSH, 0);
+    goto op_step;
+  op_match_set_step:
+    if (!IN_SET(c))
+      goto kill;
+    goto op_step;
+  op_match_step:
+    if (!MATCHES(c))
+      goto kill;
+    // fall through
+  op_step:
+    th.ip = c->next;
+    st->next[nnext++] = th;
+    // fall through
+  kill:
+    if (top > 0) {
+      th = stack[--top];
+      goto next_insn;
+    }
+  }
+#undef IN_SET
+#undef MATCHES
+#undef SEEN
+#undef RECORD
+  return nnext;
+}
+
+// }}}
+
+// {{{ Lazy DFA
+//
+// Recognition runs on a DFA whose states are the lists of NFA threads, by
+// resume ip (and count, in a counted loop) and in priority order, that the
+// NFA would hold between two bytes. States and transitions are built on
+// first use and cached, so once warm, matching costs one table lookup per
+// byte. Bytes that no RVM_MATCH tells apart share a symbol; one more symbol
+// stands for the end of input.
+//
+// Only once a match is found are the SVM ops of the accepting thread worked
+// out, by walking back along the states it went through. A DFA that grows
+// past H_RVM_DFA_MAX_SIZE is dropped, and the parse falls back to the NFA;
+// after H_RVM_DFA_MAX_OVERFLOWS such parses in a row, the DFA is given up.
+
+#define H_RVM_DFA_MAX_SIZE (1 << 20)
+#define H_RVM_DFA_MAX_OVERFLOWS 3
+
+#define DS_KNOWN 1  // next and DS_ACCEPT are filled in for this symbol
+#define DS_ACCEPT 2 // the program accepts on this symbol
+
+// How each thread of the next state, and the accept, descend from the
+// threads of this one: the parent thread, and the ops added, in order.
+typedef struct HRVMDEdge_ {
+  size_t *parent;
+  HRVMOps *ops;
+  size_t accept_parent;
+  HRVMOps accept_ops;
+} HRVMDEdge;
+
+typedef struct HRVMDState_ {
+  size_t nthreads;
+  uint32_t *ips;
+  uint32_t *counts;          // of each thread; NULL if the program has no counted loops
+  HHashValue hash;
+  struct HRVMDState_ **next; // per symbol
+  uint8_t *flags;            // per symbol
+  HRVMDEdge **edges;         // per symbol; allocated on first replay
+} HRVMDState;
+
+struct HRVMDFA_ {
+  HAllocator *mm__;
+  const HRVMProg *prog;
+  size_t serial;
+  size_t nsyms;       // byte classes, then the end of input
+  uint8_t classes[256];
+  uint8_t reps[256];  // a byte of each class
+  HArena *arena;      // states and edges
+  size_t size;        // bytes of them
+  HOpenTable *states;
+  HRVMDState *start;
+  HRVMDState *dead;
+  unsigned overflows; // parses in a row that outgrew the DFA
+  // scratch for dfa_step, prog->nslots of each
+  HRVMStep step;
+  HRVMThread *threads;
+  // The ops recorded by a run on the NFA, or by dfa_step for an edge
+  HRVMTraces traces;
+};
+
+static HHashValue dstate_hash(const void *key) {
+  return ((const HRVMDState*)key)->hash;
+}
+
+static bool dstate_equal(const void *a, const void *b) {
+  const HRVMDState *sa = a, *sb = b;
+  return sa->nthreads == sb->nthreads
+    && memcmp(sa->ips, sb->ips, sa->nthreads * sizeof(uint32_t)) == 0
+    && (!sa->counts || memcmp(sa->counts, sb->counts, sa->nthreads * sizeof(uint32_t)) == 0);
+}
+
+static void* dfa_alloc(HRVMDFA *dfa, size_t size) {
+  dfa->size += size;
+  return h_arena_malloc(dfa->arena, size);
+}
+
+static void* dfa_alloc0(HRVMDFA *dfa, size_t size) {
+  dfa->size += size;
+  return h_arena_malloc0(dfa->arena, size);
+}
+
+// counts is NULL if the program has no counted loops.
+static HRVMDState *dfa_state(HRVMDFA *dfa, const uint32_t *ips, const uint32_t *counts,
+			     size_t nthreads) {
+  HRVMDState key;
+  key.nthreads = nthreads;
+  key.ips = (uint32_t*)ips;
+  key.counts = (uint32_t*)counts;
+  key.hash = 0;
+  for (size_t i = 0; i < nthreads; i++)
+    key.hash = key.hash * 31 + ips[i] + (counts ? counts[i] * 17 : 0);
+  HRVMDState *s = h_opentable_get(dfa->states, &key);
+  if (s)
+    return s;
+  s = dfa_alloc(dfa, sizeof(HRVMDState));
+  *s = key;
+  s->ips = dfa_alloc(dfa, nthreads * sizeof(uint32_t));
+  memcpy(s->ips, ips, nthreads * sizeof(uint32_t));
+  if (counts) {
+    s->counts = dfa_alloc(dfa, nthreads * sizeof(uint32_t));
+    memcpy(s->counts, counts, nthreads * sizeof(uint32_t));
+  }
+  s->next = dfa_alloc(dfa, dfa->nsyms * sizeof(HRVMDState*));
+  s->flags = dfa_alloc0(dfa, dfa->nsyms);
+  s->edges = NULL;
+  h_opentable_put(dfa->states, s, s);
+  return s;
+}
+
+static void dfa_reset(HRVMDFA *dfa) {
+  if (dfa->arena)
+    h_delete_arena(dfa->arena);
+  dfa->arena = h_new_arena(dfa->mm__, 0);
+  dfa->size = 0;
+  dfa->states = h_opentable_new(dfa->arena, dstate_equal, dstate_hash);
+  uint32_t zero = 0;
+  const uint32_t *counts = dfa->prog->bounds_count ? &zero : NULL;
+  dfa->start = dfa_state(dfa, &zero, counts, 1);
+  dfa->dead = dfa_state(dfa, &zero, counts, 0);
+  for (size_t sym = 0; sym < dfa->nsyms; sym++) {
+    dfa->dead->next[sym] = dfa->dead;
+    dfa->dead->flags[sym] = DS_KNOWN;
+  }
+}
+
+static HRVMDFA *dfa_new(HAllocator *mm__, const HRVMProg *prog) {
+  HRVMDFA *dfa = h_new(HRVMDFA, 1);
+  dfa->mm__ = mm__;
+  dfa->prog = prog;
+  dfa->serial = prog->serial;
+  dfa->overflows = 0;
+
+  // A new class starts at every bound of every RVM_MATCH range, and
+  // wherever a charset goes in or out. Each byte an RVM_SWITCH tells apart
+  // is a class of its own.
+  bool bound[257] = { true };
+  for (size_t i = 0; i < prog->length; i++) {
+    if (prog->insns[i].op == RVM_MATCH) {
+      bound[prog->insns[i].arg & 0xff] = true;
+      bound[((prog->insns[i].arg >> 8) & 0xff) + 1] = true;
+    } else if (prog->insns[i].op == RVM_SWITCH) {
+      const uint8_t *set = prog->charsets[prog->insns[i].arg];
+      for (size_t c = 0; c < 256; c++) {
+	if ((set[c >> 3] >> (c & 7)) & 1)
+	  bound[c] = bound[c + 1] = true;
       }
     }
   }
-  // No accept was reached.
- match_fail:
-  if (ret_trace == NULL) {
-    // No match found; definite failure.
-    h_delete_arena(arena);
+  for (size_t i = 0; i < prog->charset_count; i++) {
+    const uint8_t *set = prog->charsets[i];
+    for (size_t c = 1; c < 256; c++) {
+      if (((set[c >> 3] >> (c & 7)) ^ (set[(c - 1) >> 3] >> ((c - 1) & 7))) & 1)
+	bound[c] = true;
+    }
+  }
+  size_t nclasses = 0;
+  for (size_t c = 0; c < 256; c++) {
+    if (bound[c])
+      dfa->reps[nclasses++] = c;
+    dfa->classes[c] = nclasses - 1;
+  }
+  dfa->nsyms = nclasses + 1;
+
+  dfa->step.prog = prog;
+  dfa->step.insn_seen = h_new(uint8_t, prog->nslots);
+  dfa->step.stack = h_new(HRVMThread, prog->nslots);
+  dfa->step.next = h_new(HRVMThread, prog->nslots);
+  dfa->threads = h_new(HRVMThread, prog->nslots);
+  dfa->traces.mm__ = mm__;
+  dfa->traces.entries = NULL;
+  dfa->traces.n = dfa->traces.cap = 0;
+  dfa->arena = NULL;
+  dfa_reset(dfa);
+  return dfa;
+}
+
+static void dfa_free(void *p) {
+  HRVMDFA *dfa = p;
+  HAllocator *mm__ = dfa->mm__;
+  h_delete_arena(dfa->arena);
+  h_free(dfa->step.insn_seen);
+  h_free(dfa->step.stack);
+  h_free(dfa->step.next);
+  h_free(dfa->threads);
+  h_free(dfa->traces.entries);
+  h_free(dfa);
+}
+
+// Run every thread of s over one symbol, exactly as the NFA would. Leaves
+// the next threads in dfa->step.next and returns how many there are; with
+// record set, the ops each of them (and the accept, if any) added are
+// recorded in dfa->traces.
+static size_t dfa_step(HRVMDFA *dfa, const HRVMDState *s, size_t sym, bool record,
+                       bool *accept, HRVMThread *accepted) {
+  bool eof = (sym == dfa->nsyms - 1);
+  for (size_t t = 0; t < s->nthreads; t++) {
+    dfa->threads[t].trace = H_RVM_NO_TRACE;
+    dfa->threads[t].start = 0;
+    dfa->threads[t].ip = s->ips[t];
+    dfa->threads[t].count = s->counts ? s->counts[t] : 0;
+  }
+  dfa->step.traces = record ? &dfa->traces : NULL;
+  dfa->traces.n = 0;
+  return rvm_step(&dfa->step, dfa->threads, s->nthreads, eof ? 0 : dfa->reps[sym], eof, 0,
+		  accept, accepted);
+}
+
+// Fill in s's transition on sym. False if that would outgrow the DFA.
+static bool dfa_transition(HRVMDFA *dfa, HRVMDState *s, size_t sym) {
+  if (dfa->size > H_RVM_DFA_MAX_SIZE)
+    return false;
+  bool accept;
+  HRVMThread accepted;
+  size_t nnext = dfa_step(dfa, s, sym, false, &accept, &accepted);
+  HRVMDState *next = dfa->dead;
+  if (nnext > 0 && sym != dfa->nsyms - 1) {
+    uint32_t ips[nnext], counts[nnext];
+    for (size_t i = 0; i < nnext; i++) {
+      ips[i] = dfa->step.next[i].ip;
+      counts[i] = dfa->step.next[i].count;
+    }
+    next = dfa_state(dfa, ips, dfa->prog->bounds_count ? counts : NULL, nnext);
+  }
+  s->next[sym] = next;
+  s->flags[sym] = DS_KNOWN | (accept ? DS_ACCEPT : 0);
+  return true;
+}
+
+static HRVMDEdge *dfa_edge(HRVMDFA *dfa, HRVMDState *s, size_t sym) {
+  if (!s->edges)
+    s->edges = dfa_alloc0(dfa, dfa->nsyms * sizeof(HRVMDEdge*));
+  if (s->edges[sym])
+    return s->edges[sym];
+  bool accept;
+  HRVMThread accepted;
+  size_t nnext = dfa_step(dfa, s, sym, true, &accept, &accepted);
+  HRVMDEdge *e = dfa_alloc(dfa, sizeof(HRVMDEdge));
+  e->parent = dfa_alloc(dfa, nnext * sizeof(size_t));
+  e->ops = dfa_alloc(dfa, nnext * sizeof(HRVMOps));
+  for (size_t i = 0; i < nnext; i++) {
+    e->parent[i] = dfa->step.next[i].parent;
+    e->ops[i] = trace_ops(dfa->arena, &dfa->traces, dfa->step.next[i].trace);
+    dfa->size += e->ops[i].n * sizeof(HRVMTraceOp);
+  }
+  e->accept_parent = accept ? accepted.parent : 0;
+  e->accept_ops = trace_ops(dfa->arena, &dfa->traces, accept ? accepted.trace : H_RVM_NO_TRACE);
+  dfa->size += e->accept_ops.n * sizeof(HRVMTraceOp);
+  s->edges[sym] = e;
+  return e;
+}
+
+// The DFA kept by the parse context for this program, or, without a
+// context, the program's own. A parse takes that one for as long as it runs,
+// so that others at the same time build their own; see put_dfa.
+static HRVMDFA *get_dfa(HAllocator *mm__, HParseCtx *pctx, HRVMProg *prog) {
+  if (pctx && pctx->cache_key == prog && ((HRVMDFA*)pctx->cache)->serial == prog->serial)
+    return pctx->cache;
+  if (!pctx) {
+    HRVMDFA *dfa = __atomic_exchange_n(&prog->dfa, NULL, __ATOMIC_ACQUIRE);
+    return dfa ? dfa : dfa_new(prog->allocator, prog);
+  }
+  HRVMDFA *dfa = dfa_new(mm__, prog);
+  if (pctx->cache_free)
+    pctx->cache_free(pctx->cache);
+  pctx->cache_key = prog;
+  pctx->cache = dfa;
+  pctx->cache_free = dfa_free;
+  return dfa;
+}
+
+// Give the program back the DFA a parse without a context took, unless
+// another parse has given it one since.
+static void put_dfa(HRVMProg *prog, HRVMDFA *dfa) {
+  HRVMDFA *none = NULL;
+  if (!__atomic_compare_exchange_n(&prog->dfa, &none, dfa, false,
+				   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    dfa_free(dfa);
+}
+
+// }}}
+
+// {{{ Runs
+//
+// A run matches a program against input that is fed to it a chunk at a
+// time: the DFA state, or the NFA's threads, carry over from one chunk to
+// the next. Chunks are not copied; the run only keeps track of them, and
+// once the match is known, a capture is made to point into its chunk. Only
+// one that spans two chunks is copied.
+
+struct HRVMChunk_ {
+  const uint8_t *input;
+  size_t len;
+  size_t start; // where input[0] is in the whole of the input
+};
+
+struct HRVMRun_ {
+  HAllocator *mm__;
+  HParseCtx *pctx;
+  HRVMProg *prog;
+  HArena *arena;        // scratch space for the run
+  HRVMChunk *chunks;
+  size_t nchunks, chunks_cap;
+  size_t len;           // bytes fed so far
+  bool done;            // no threads are left, so more input changes nothing
+  HRVMDFA *dfa;
+  bool nfa;             // running the NFA, not the DFA
+  // The DFA: the state before each byte (and after the last), and the
+  // offset of the last accept, if any.
+  HRVMDState **path;
+  size_t path_cap;
+  bool matched;
+  size_t end;
+  // The NFA: its threads, and the last op of the last accept, in
+  // dfa->traces (or H_RVM_NO_TRACE).
+  HRVMStep st;
+  HRVMThread *threads;
+  size_t nthreads;
+  size_t accepted;
+};
+
+// The bytes from start to end, in place if they are in one chunk, or else
+// copied into arena.
+static const uint8_t *run_bytes(HArena *arena, const HRVMChunk *chunks, size_t nchunks,
+				size_t start, size_t end) {
+  if (nchunks == 0)
     return NULL;
+  // The last chunk that starts at or before start
+  size_t lo = 0, hi = nchunks;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (chunks[mid].start <= start)
+      lo = mid;
+    else
+      hi = mid;
   }
-  
-  // Invert the direction of the trace linked list.
+  const HRVMChunk *c = &chunks[lo];
+  if (end <= c->start + c->len)
+    return c->input + (start - c->start);
+  uint8_t *ret = a_new(uint8_t, end - start);
+  for (size_t pos = start; pos < end; c++) {
+    size_t n = c->start + c->len - pos;
+    if (n > end - pos)
+      n = end - pos;
+    memcpy(ret + (pos - start), c->input + (pos - c->start), n);
+    pos += n;
+  }
+  return ret;
+}
+
+// The Pike VM: every thread, step by step.
+static void nfa_start(HRVMRun *run) {
+  HArena *arena = run->arena;
+  HRVMProg *prog = run->prog;
+  run->nfa = true;
+  run->done = false;
+  run->st.prog = prog;
+  run->st.insn_seen = a_new(uint8_t, prog->nslots);
+  run->st.stack = a_new(HRVMThread, prog->nslots);
+  run->st.next = a_new(HRVMThread, prog->nslots);
+  run->st.traces = &run->dfa->traces;
+  run->dfa->traces.n = 0;
+  run->threads = a_new(HRVMThread, prog->nslots);
+
+  run->threads[0].trace = H_RVM_NO_TRACE; // Initial thread
+  run->threads[0].parent = 0;
+  run->threads[0].start = 0;
+  run->threads[0].ip = 0;
+  run->threads[0].count = 0;
+  run->nthreads = 1;
+  run->accepted = H_RVM_NO_TRACE;
+}
+
+static void nfa_step(HRVMRun *run, uint8_t ch, bool eof, size_t pos) {
+  bool accept;
+  HRVMThread accepted;
+  run->nthreads = rvm_step(&run->st, run->threads, run->nthreads, ch, eof, pos,
+			   &accept, &accepted);
+  if (accept)
+    run->accepted = accepted.trace;
+  HRVMThread *tmp = run->threads;
+  run->threads = run->st.next;
+  run->st.next = tmp;
+  if (run->nthreads == 0)
+    run->done = true;
+}
+
+static void nfa_feed(HRVMRun *run, const uint8_t *input, size_t len, size_t pos) {
+  for (size_t i = 0; i < len && !run->done; i++)
+    nfa_step(run, input[i], false, pos + i);
+}
+
+static void path_reserve(HRVMRun *run, size_t n) {
+  if (n <= run->path_cap)
+    return;
+  HArena *arena = run->arena;
+  size_t cap = run->path_cap * 2 > n ? run->path_cap * 2 : n;
+  HRVMDState **path = a_new(HRVMDState*, cap);
+  if (run->path_cap)
+    memcpy(path, run->path, run->path_cap * sizeof(*path));
+  run->path = path;
+  run->path_cap = cap;
+}
+
+// Run the DFA over len more bytes. False if it outgrew its budget.
+static bool dfa_feed(HRVMRun *run, const uint8_t *input, size_t len) {
+  HRVMDFA *dfa = run->dfa;
+  path_reserve(run, run->len + len + 1);
+  HRVMDState **path = run->path + run->len;
+  HRVMDState *s = path[0];
+  bool matched = run->matched;
+  size_t end = run->end;
+  bool ok = true;
+  for (size_t i = 0; i < len; i++) {
+    size_t sym = dfa->classes[input[i]];
+    if (!(s->flags[sym] & DS_KNOWN) && !dfa_transition(dfa, s, sym)) {
+      ok = false;
+      break;
+    }
+    if (s->flags[sym] & DS_ACCEPT) {
+      matched = true;
+      end = run->len + i;
+    }
+    s = s->next[sym];
+    path[i + 1] = s;
+    if (s == dfa->dead) {
+      run->done = true;
+      break;
+    }
+  }
+  run->matched = matched;
+  run->end = end;
+  return ok;
+}
+
+// The end of input, for the DFA.
+static bool dfa_finish(HRVMRun *run) {
+  HRVMDFA *dfa = run->dfa;
+  if (run->done)
+    return true;
+  HRVMDState *s = run->path[run->len];
+  size_t sym = dfa->nsyms - 1;
+  if (!(s->flags[sym] & DS_KNOWN) && !dfa_transition(dfa, s, sym))
+    return false;
+  if (s->flags[sym] & DS_ACCEPT) {
+    run->matched = true;
+    run->end = run->len;
+  }
+  return true;
+}
 
-  ret_trace = invert_trace(ret_trace);
-  HParseResult *ret = run_trace(mm__, prog, ret_trace, input, len);
-  // ret is in its own arena
-  h_delete_arena(arena);
+// The symbol at off, for offsets visited from the last one back; *ci is the
+// chunk the last one was in.
+static inline size_t run_sym(const HRVMRun *run, size_t *ci, size_t off) {
+  if (off == run->len)
+    return run->dfa->nsyms - 1;
+  while (run->chunks[*ci].start > off)
+    (*ci)--;
+  const HRVMChunk *c = &run->chunks[*ci];
+  return run->dfa->classes[c->input[off - c->start]];
+}
+
+// The trace of the DFA's accepting thread, in order, as the NFA would have
+// it. Walking back from the accept finds the ops its ancestors added on
+// each byte; then they are copied out in order.
+static HRVMOps dfa_trace(HRVMRun *run) {
+  HRVMDFA *dfa = run->dfa;
+  HArena *arena = run->arena;
+  size_t ci = run->nchunks - 1;
+  size_t end = run->end;
+  const HRVMOps **added = a_new(const HRVMOps*, end + 1);
+  HRVMDEdge *e = dfa_edge(dfa, run->path[end], run_sym(run, &ci, end));
+  size_t t = e->accept_parent;
+  added[end] = &e->accept_ops;
+  size_t n = e->accept_ops.n;
+  for (size_t off = end; off-- > 0; ) {
+    e = dfa_edge(dfa, run->path[off], run_sym(run, &ci, off));
+    added[off] = &e->ops[t];
+    n += e->ops[t].n;
+    t = e->parent[t];
+  }
+  HRVMOps ret = { a_new(HRVMTraceOp, n), n };
+  HRVMTraceOp *op = ret.ops;
+  for (size_t off = 0; off <= end; off++) {
+    for (size_t i = 0; i < added[off]->n; i++, op++) {
+      *op = added[off]->ops[i];
+      op->input_pos = off;
+    }
+  }
   return ret;
 }
-#undef PUSH_SVM
-#undef THREAD
 
+// The DFA gave out: start over on the NFA, with the input so far.
+static void run_fall_back(HRVMRun *run) {
+  run->dfa->overflows++;
+  dfa_reset(run->dfa);
+  nfa_start(run);
+  for (size_t i = 0; i < run->nchunks && !run->done; i++)
+    nfa_feed(run, run->chunks[i].input, run->chunks[i].len, run->chunks[i].start);
+}
+
+static HRVMRun *run_start(HAllocator *mm__, HParseCtx *pctx, HRVMProg *prog) {
+  HArena *arena = h_parse_tmp_arena(mm__, pctx);
+  HRVMRun *run = a_new(HRVMRun, 1);
+  memset(run, 0, sizeof(*run));
+  run->mm__ = mm__;
+  run->pctx = pctx;
+  run->prog = prog;
+  run->arena = arena;
+  run->dfa = get_dfa(mm__, pctx, prog);
+  if (run->dfa->overflows >= H_RVM_DFA_MAX_OVERFLOWS) {
+    nfa_start(run);
+  } else {
+    path_reserve(run, 1);
+    run->path[0] = run->dfa->start;
+  }
+  return run;
+}
+
+HRVMRun *h_rvm_start(HParseCtx *pctx, HRVMProg *prog) {
+  return h_rvm_start__m(pctx ? pctx->mm__ : &system_allocator, pctx, prog);
+}
+
+HRVMRun *h_rvm_start__m(HAllocator *mm__, HParseCtx *pctx, HRVMProg *prog) {
+  if (pctx)
+    h_parse_ctx_reset(pctx); // as h_parse_ctx_parse does
+  return run_start(mm__, pctx, prog);
+}
+
+bool h_rvm_feed(HRVMRun *run, const uint8_t *chunk, size_t len) {
+  if (run->done || (len == 0 && run->nchunks > 0))
+    return run->done;
+  if (run->nchunks == run->chunks_cap) {
+    HArena *arena = run->arena;
+    size_t cap = run->chunks_cap ? run->chunks_cap * 2 : 4;
+    HRVMChunk *chunks = a_new(HRVMChunk, cap);
+    if (run->nchunks)
+      memcpy(chunks, run->chunks, run->nchunks * sizeof(*chunks));
+    run->chunks = chunks;
+    run->chunks_cap = cap;
+  }
+  HRVMChunk *c = &run->chunks[run->nchunks++];
+  c->input = chunk;
+  c->len = len;
+  c->start = run->len;
+  if (run->nfa)
+    nfa_feed(run, chunk, len, run->len);
+  else if (!dfa_feed(run, chunk, len))
+    run_fall_back(run);
+  run->len += len;
+  return run->done;
+}
+
+HParseResult *h_rvm_finish(HRVMRun *run) {
+  HAllocator *mm__ = run->mm__;
+  HParseCtx *pctx = run->pctx;
+  HArena *arena = run->arena;
+  HRVMDFA *dfa = run->dfa;
+  bool matched;
+  HRVMOps trace;
+  if (!run->nfa && !dfa_finish(run))
+    run_fall_back(run);
+  if (run->nfa) {
+    if (!run->done)
+      nfa_step(run, 0, true, run->len);
+    matched = run->accepted != H_RVM_NO_TRACE;
+    if (matched)
+      trace = trace_ops(arena, &dfa->traces, run->accepted);
+  } else {
+    dfa->overflows = 0;
+    matched = run->matched;
+    if (matched)
+      trace = dfa_trace(run);
+  }
+
+  HParseResult *ret = NULL;
+  if (matched) // in its own arena
+    ret = run_trace(mm__, pctx, run->prog, trace, run->chunks, run->nchunks);
+  if (!pctx)
+    put_dfa(run->prog, dfa);
+  h_parse_arena_done(pctx, arena);
+  return ret;
+}
+
+void* h_rvm_run__m(HAllocator *mm__, HParseCtx *pctx, HRVMProg *prog, const uint8_t* input, size_t len) {
+  HRVMRun *run = run_start(mm__, pctx, prog);
+  h_rvm_feed(run, input, len);
+  return h_rvm_finish(run);
+}
+
+// }}}
+
+// {{{ Search
+//
+// h_rvm_find runs the Pike VM unanchored, the way RE2 does: a new thread
+// starts at each offset, behind the ones already running, so threads stay
+// in order of where they started. The first start to accept wins. Its
+// threads run on, as they would in an anchored run, for a later accept,
+// but threads that started after it are dropped, and no more are started.
+// A thread that loses an insn to one that started earlier has the same
+// future as the winner, so none of this changes what h_parse would find
+// at the winning start.
+//
+// While no thread is alive, the search skips ahead to the next byte a match
+// can start with (prog->lead), with memchr if there is only one.
+
+// Work out prog->lead: every byte the first MATCH of a match can take.
+static void rvm_lead(HAllocator *mm__, HRVMProg *prog) {
+  uint8_t *seen = h_new(uint8_t, prog->length);
+  uint32_t *stack = h_new(uint32_t, prog->length);
+  memset(seen, 0, prog->length);
+  memset(prog->lead, 0, sizeof(prog->lead));
+  prog->lead_any = false;
+  size_t top = 0;
+  stack[top++] = 0;
+  seen[0] = 1;
+#define VISIT(ip_) do {				\
+    uint32_t ip__ = (ip_);			\
+    if (!seen[ip__]) {				\
+      seen[ip__] = 1;				\
+      stack[top++] = ip__;			\
+    }						\
+  } while(0)
+  while (top > 0 && !prog->lead_any) {
+    uint32_t ip = stack[--top];
+    const HRVMInsn *insn = &prog->insns[ip];
+    switch (insn->op) {
+    case RVM_MATCH:
+      for (size_t c = insn->arg & 0xff; c <= ((insn->arg >> 8) & 0xff); c++)
+	prog->lead[c >> 3] |= 1 << (c & 7);
+      break;
+    case RVM_MATCH_SET:
+    case RVM_SWITCH:
+      for (size_t i = 0; i < 32; i++)
+	prog->lead[i] |= prog->charsets[insn->arg][i];
+      break;
+    case RVM_GOTO:
+      VISIT(insn->arg);
+      break;
+    case RVM_FORK:
+      VISIT(insn->arg);
+      VISIT(ip + 1);
+      break;
+    case RVM_COUNT_LOOP:
+      // whichever way the count goes
+      VISIT(ip + 1);
+      VISIT(ip + 2);
+      break;
+    case RVM_PUSH:
+    case RVM_ACTION:
+    case RVM_CAPTURE:
+    case RVM_BITS:
+    case RVM_COUNT_PUSH:
+    case RVM_COUNT_INC:
+    case RVM_COUNT_POP:
+      VISIT(ip + 1);
+      break;
+    default:
+      // ACCEPT, EOF or STEP: a match can be empty.
+      prog->lead_any = true;
+    }
+  }
+#undef VISIT
+  prog->lead_byte = -1;
+  size_t n = 0;
+  for (size_t c = 0; c < 256; c++) {
+    if ((prog->lead[c >> 3] >> (c & 7)) & 1) {
+      prog->lead_byte = c;
+      n++;
+    }
+  }
+  if (n != 1)
+    prog->lead_byte = -1;
+  h_free(seen);
+  h_free(stack);
+}
+
+static inline bool is_lead(const HRVMProg *prog, uint8_t ch) {
+  return (prog->lead[ch >> 3] >> (ch & 7)) & 1;
+}
+
+// The first offset from off on where a match can start; len if none.
+static size_t next_lead(const HRVMProg *prog, const uint8_t *input, size_t len, size_t off) {
+  if (prog->lead_byte >= 0) {
+    const uint8_t *p = memchr(input + off, prog->lead_byte, len - off);
+    return p ? (size_t)(p - input) : len;
+  }
+  while (off < len && !is_lead(prog, input[off]))
+    off++;
+  return off;
+}
+
+// The leftmost match from off on, as described above. If there is one,
+// sets *start, *end and its trace, and returns true. Ops are recorded in
+// traces, which is emptied first.
+static bool rvm_find(HArena *arena, HRVMTraces *traces, HRVMProg *prog, const uint8_t *input,
+		     size_t len, size_t off, size_t *start, size_t *end, HRVMOps *trace) {
+  HRVMStep st;
+  st.prog = prog;
+  st.insn_seen = a_new(uint8_t, prog->nslots);
+  st.stack = a_new(HRVMThread, prog->nslots);
+  // One more of these, for the thread started at each offset
+  st.next = a_new(HRVMThread, prog->nslots + 1);
+  st.traces = traces;
+  traces->n = 0;
+  HRVMThread *threads = a_new(HRVMThread, prog->nslots + 1);
+  size_t nthreads = 0;
+
+  size_t ret = H_RVM_NO_TRACE;
+  for (; off <= len; off++) {
+    if (ret == H_RVM_NO_TRACE) {
+      if (nthreads == 0 && !prog->lead_any) {
+	off = next_lead(prog, input, len, off);
+	if (off == len)
+	  break; // and nothing can match the empty rest
+      }
+      if (prog->lead_any || (off < len && is_lead(prog, input[off]))) {
+	threads[nthreads].trace = H_RVM_NO_TRACE;
+	threads[nthreads].parent = 0;
+	threads[nthreads].start = off;
+	threads[nthreads].ip = 0;
+	threads[nthreads].count = 0;
+	nthreads++;
+      }
+    }
+    if (nthreads == 0)
+      break;
+    bool accept;
+    HRVMThread accepted;
+    nthreads = rvm_step(&st, threads, nthreads, (off == len) ? 0 : input[off], off == len, off,
+			&accept, &accepted);
+    if (accept && (ret == H_RVM_NO_TRACE || accepted.start <= *start)) {
+      ret = accepted.trace;
+      *start = accepted.start;
+      *end = off;
+    }
+    HRVMThread *t = threads;
+    threads = st.next;
+    st.next = t;
+    while (ret != H_RVM_NO_TRACE && nthreads > 0 && threads[nthreads - 1].start > *start)
+      nthreads--;
+  }
+  if (ret == H_RVM_NO_TRACE)
+    return false;
+  *trace = trace_ops(arena, traces, ret);
+  return true;
+}
+
+bool h_rvm_find(HParseCtx *pctx, HRVMProg *prog, const uint8_t *input, size_t len,
+		size_t from, HRVMMatch *match) {
+  return h_rvm_find__m(pctx ? pctx->mm__ : &system_allocator, pctx, prog, input, len, from, match);
+}
 
+bool h_rvm_find__m(HAllocator *mm__, HParseCtx *pctx, HRVMProg *prog, const uint8_t *input,
+		   size_t len, size_t from, HRVMMatch *match) {
+  if (pctx)
+    h_parse_ctx_reset(pctx);
+  HArena *arena = h_parse_tmp_arena(mm__, pctx);
+  // A context keeps the trace array of its DFA for the next search.
+  HRVMTraces own = { mm__, NULL, 0, 0 };
+  HRVMTraces *traces = pctx ? &get_dfa(mm__, pctx, prog)->traces : &own;
+  HRVMChunk chunk = { input, len, 0 };
+  HParseResult *res = NULL;
+  HRVMOps trace;
+  // If an action fails, so would h_parse at that start; try the next one.
+  while (!res && rvm_find(arena, traces, prog, input, len, from, &match->start, &match->end, &trace)) {
+    res = run_trace(mm__, pctx, prog, trace, &chunk, 1); // in its own arena
+    from = match->start + 1;
+  }
+  if (res)
+    res->bit_length = (match->end - match->start) * 8;
+  h_free(own.entries);
+  h_parse_arena_done(pctx, arena);
+  match->result = res;
+  return res != NULL;
+}
 
+size_t h_rvm_find_all(HParseCtx *pctx, HRVMProg *prog, const uint8_t *input, size_t len,
+		      HRVMMatchFunc f, void *env) {
+  return h_rvm_find_all__m(pctx ? pctx->mm__ : &system_allocator, pctx, prog, input, len, f, env);
+}
+
+size_t h_rvm_find_all__m(HAllocator *mm__, HParseCtx *pctx, HRVMProg *prog, const uint8_t *input,
+			 size_t len, HRVMMatchFunc f, void *env) {
+  size_t n = 0;
+  HRVMMatch match;
+  for (size_t from = 0; from <= len && h_rvm_find__m(mm__, pctx, prog, input, len, from, &match); ) {
+    n++;
+    bool more = f(&match, env);
+    if (!pctx)
+      h_parse_result_free(match.result);
+    if (!more)
+      break;
+    from = match.end > match.start ? match.end : match.start + 1;
+  }
+  return n;
+}
+
+// }}}
 
 void svm_stack_ensure_cap(HAllocator *mm__, HSVMContext *ctx, size_t addl) {
   if (ctx->stack_count + addl >= ctx->stack_capacity) {
@@ -186,17 +1293,39 @@ void svm_stack_ensure_cap(HAllocator *mm__, HSVMContext *ctx, size_t addl) {
   }
 }
 
-HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace, const uint8_t *input, int len) {
+// Read the field of an RVM_BITS, in the bytes it spans, into tok.
+static void svm_read_bits(HParsedToken *tok, uint32_t arg, const uint8_t *bytes) {
+  size_t pos = H_RVM_BITS_OFFSET(arg), left = H_RVM_BITS_WIDTH(arg);
+  uint64_t val = 0;
+  while (left > 0) {
+    size_t avail = 8 - pos % 8;
+    size_t n = left < avail ? left : avail;
+    val = (val << n) | ((bytes[pos / 8] >> (avail - n)) & ((1u << n) - 1));
+    pos += n;
+    left -= n;
+  }
+  if (H_RVM_BITS_SIGNED(arg)) {
+    uint64_t msb = (uint64_t)1 << (H_RVM_BITS_WIDTH(arg) - 1);
+    tok->token_type = TT_SINT;
+    tok->sint = (int64_t)((val ^ msb) - msb);
+  } else {
+    tok->token_type = TT_UINT;
+    tok->uint = val;
+  }
+}
+
+static HParseResult *run_trace(HAllocator *mm__, HParseCtx *pctx, HRVMProg *orig_prog, HRVMOps trace,
+			       const HRVMChunk *chunks, size_t nchunks) {
   // orig_prog is only used for the action table
   HSVMContext ctx;
-  HArena *arena = h_new_arena(mm__, 0);
+  HArena *arena = h_parse_arena(mm__, pctx);
   ctx.stack_count = 0;
   ctx.stack_capacity = 16;
   ctx.stack = h_new(HParsedToken*, ctx.stack_capacity);
 
   HParsedToken *tmp_res;
-  HRVMTrace *cur;
-  for (cur = trace; cur; cur = cur->next) {
+  const HRVMTraceOp *cur;
+  for (cur = trace.ops; cur < trace.ops + trace.n; cur++) {
     switch (cur->opcode) {
     case SVM_PUSH:
       svm_stack_ensure_cap(mm__, &ctx, 1);
@@ -226,9 +1355,19 @@ HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace,
       // TODO: Will need to copy if bit_offset is nonzero
       assert(tmp_res->bit_offset == 0);
 	
-      tmp_res->bytes.token = input + tmp_res->index;
+      tmp_res->bytes.token = run_bytes(arena, chunks, nchunks, tmp_res->index, cur->input_pos);
       tmp_res->bytes.len = cur->input_pos - tmp_res->index;
       break;
+    case SVM_BITS:
+      svm_stack_ensure_cap(mm__, &ctx, 1);
+      tmp_res = a_new(HParsedToken, 1);
+      tmp_res->index = cur->input_pos;
+      tmp_res->bit_offset = H_RVM_BITS_OFFSET(cur->arg);
+      svm_read_bits(tmp_res, cur->arg,
+		    run_bytes(arena, chunks, nchunks, cur->input_pos,
+			      cur->input_pos + (H_RVM_BITS_OFFSET(cur->arg) + H_RVM_BITS_WIDTH(cur->arg) + 7) / 8));
+      ctx.stack[ctx.stack_count++] = tmp_res;
+      break;
     case SVM_ACCEPT:
       assert(ctx.stack_count <= 1);
 	HParseResult *res = a_new(HParseResult, 1);
@@ -239,16 +1378,18 @@ HParseResult *run_trace(HAllocator *mm__, HRVMProg *orig_prog, HRVMTrace *trace,
       }
       res->bit_length = cur->input_pos * 8;
       res->arena = arena;
+      h_free(ctx.stack);
       return res;
     }
   }
  fail:
-  h_delete_arena(arena);
+  h_free(ctx.stack);
+  h_parse_arena_done(pctx, arena);
   return NULL;
 }
 
-uint16_t h_rvm_create_action(HRVMProg *prog, HSVMActionFunc action_func, void* env) {
-  for (uint16_t i = 0; i < prog->action_count; i++) {
+uint32_t h_rvm_create_action(HRVMProg *prog, HSVMActionFunc action_func, void* env) {
+  for (uint32_t i = 0; i < prog->action_count; i++) {
     if (prog->actions[i].action == action_func && prog->actions[i].env == env)
       return i;
   }
@@ -267,7 +1408,43 @@ uint16_t h_rvm_create_action(HRVMProg *prog, HSVMActionFunc action_func, void* e
   return prog->action_count++;
 }
 
-uint16_t h_rvm_insert_insn(HRVMProg *prog, HRVMOp op, uint16_t arg) {
+uint32_t h_rvm_create_charset(HRVMProg *prog, HCharset cs) {
+  uint8_t set[32] = { 0 };
+  for (size_t c = 0; c < 256; c++) {
+    if (charset_isset(cs, c))
+      set[c >> 3] |= 1 << (c & 7);
+  }
+  for (uint32_t i = 0; i < prog->charset_count; i++) {
+    if (memcmp(prog->charsets[i], set, sizeof(set)) == 0)
+      return i;
+  }
+  // Ensure that there's room in the charset pool...
+  if (!(prog->charset_count & (prog->charset_count + 1))) {
+    size_t array_size = (prog->charset_count + 1) * 2;
+    prog->charsets = prog->allocator->realloc(prog->allocator, prog->charsets, array_size * sizeof(*prog->charsets));
+    // TODO: Handle the allocation failed case nicely.
+  }
+  memcpy(prog->charsets[prog->charset_count], set, sizeof(set));
+  return prog->charset_count++;
+}
+
+uint32_t h_rvm_create_bounds(HRVMProg *prog, uint32_t min, uint32_t max) {
+  for (uint32_t i = 0; i < prog->bounds_count; i++) {
+    if (prog->bounds[i].min == min && prog->bounds[i].max == max)
+      return i;
+  }
+  // Ensure that there's room in the bounds pool...
+  if (!(prog->bounds_count & (prog->bounds_count + 1))) {
+    size_t array_size = (prog->bounds_count + 1) * 2;
+    prog->bounds = prog->allocator->realloc(prog->allocator, prog->bounds, array_size * sizeof(*prog->bounds));
+    // TODO: Handle the allocation failed case nicely.
+  }
+  prog->bounds[prog->bounds_count].min = min;
+  prog->bounds[prog->bounds_count].max = max;
+  return prog->bounds_count++;
+}
+
+uint32_t h_rvm_insert_insn(HRVMProg *prog, HRVMOp op, uint32_t arg) {
   // Ensure that there's room in the insn array...
   if (!(prog->length & (prog->length + 1))) {
     // needs to be scaled up.
@@ -277,16 +1454,19 @@ uint16_t h_rvm_insert_insn(HRVMProg *prog, HRVMOp op, uint16_t arg) {
     // TODO: Handle the allocation failed case nicely.
   }
 
+  if (prog->bit_offset != 0 && (op == RVM_MATCH || op == RVM_MATCH_SET || op == RVM_SWITCH
+				|| op == RVM_STEP || op == RVM_EOF || op == RVM_CAPTURE))
+    prog->misaligned = true;
   prog->insns[prog->length].op = op;
   prog->insns[prog->length].arg = arg;
   return prog->length++;
 }
 
-uint16_t h_rvm_get_ip(HRVMProg *prog) {
+uint32_t h_rvm_get_ip(HRVMProg *prog) {
   return prog->length;
 }
 
-void h_rvm_patch_arg(HRVMProg *prog, uint16_t ip, uint16_t new_val) {
+void h_rvm_patch_arg(HRVMProg *prog, uint32_t ip, uint32_t new_val) {
   assert(prog->length > ip);
   prog->insns[ip].arg = new_val;
 }
@@ -335,34 +1515,64 @@ bool h_compile_regex(HRVMProg *prog, const HParser *parser) {
 static void h_regex_free(HParser *parser) {
   HRVMProg *prog = (HRVMProg*)parser->backend_data;
   HAllocator *mm__ = prog->allocator;
+  if (prog->dfa)
+    dfa_free(prog->dfa);
   h_free(prog->insns);
   h_free(prog->actions);
+  h_free(prog->charsets);
+  h_free(prog->bounds);
+  h_free(prog->code);
   h_free(prog);
   parser->backend_data = NULL;
   parser->backend = PB_PACKRAT;
 }
 
 static int h_regex_compile(HAllocator *mm__, HParser* parser, const void* params) {
+  static size_t serial = 0;
   if (!parser->vtable->isValidRegular(parser->env))
     return 1;
   HRVMProg *prog = h_new(HRVMProg, 1);
+  prog->serial = __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED);
   prog->length = prog->action_count = 0;
   prog->insns = NULL;
   prog->actions = NULL;
+  prog->charset_count = 0;
+  prog->charsets = NULL;
+  prog->bounds_count = 0;
+  prog->bounds = NULL;
+  prog->code = NULL;
+  prog->dfa = NULL;
+  prog->bit_offset = 0;
+  prog->misaligned = false;
   prog->allocator = mm__;
-  if (!h_compile_regex(prog, parser)) {
+  // A match must end on a byte boundary, as must every byte insn.
+  bool ok = h_compile_regex(prog, parser) && prog->bit_offset == 0 && !prog->misaligned;
+  if (ok) {
+    h_rvm_insert_insn(prog, RVM_ACCEPT, 0);
+    // Any longer, and some jump target or table index won't fit in an insn.
+    // Nor can there be too many threads for their scratch space.
+    ok = (prog->length <= H_RVM_MAX_LENGTH
+	  && prog->action_count <= H_RVM_MAX_LENGTH
+	  && prog->charset_count <= H_RVM_MAX_LENGTH
+	  && prog->bounds_count <= H_RVM_MAX_LENGTH
+	  && (prog->nslots = rvm_slots(prog, NULL)) <= H_RVM_MAX_LENGTH);
+  }
+  if (!ok) {
     h_free(prog->insns);
     h_free(prog->actions);
+    h_free(prog->charsets);
+    h_free(prog->bounds);
     h_free(prog);
     return 2;
   }
-  h_rvm_insert_insn(prog, RVM_ACCEPT, 0);
+  prog->code = rvm_superinsns(mm__, prog);
+  rvm_lead(mm__, prog);
   parser->backend_data = prog;
   return 0;
 }
 
-static HParseResult *h_regex_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream) {
-  return h_rvm_run__m(mm__, (HRVMProg*)parser->backend_data, input_stream->input, input_stream->length);
+static HParseResult *h_regex_parse(HAllocator* mm__, const HParser* parser, HInputStream *input_stream, HParseCtx *ctx) {
+  return h_rvm_run__m(mm__, ctx, (HRVMProg*)parser->backend_data, input_stream->input, input_stream->length);
 }
 
 HParserBackendVTable h__regex_backend_vtable = {
@@ -7,7 +7,7 @@
 #ifndef HAMMER_BACKEND_REGEX__H
 #define HAMMER_BACKEND_REGEX__H
 
-// each insn is an 8-bit opcode and a 16-bit parameter
+// each insn is a 32-bit word: an 8-bit opcode and a 24-bit parameter
 // [a] are actions; they add an instruction to the stackvm that is being output.
 // [m] are match ops; they can either succeed or fail, depending on the current character
 // [c] are control ops. They affect the pc non-linearly.
@@ -27,14 +27,49 @@ typedef enum HRVMOp_ {
 	       //     inclusive. An inverted match should be handled
 	       //     as two ranges.
   RVM_STEP,    // [a] Step to the next byte of input
+  RVM_MATCH_SET, // [m] The parameter indexes the program's charset
+	         //     pool; succeeds if the byte is in that set.
+  RVM_SWITCH,  // [c] Like RVM_MATCH_SET, but then jumps to where the
+	       //     GOTO after it for this byte does: there is one such
+	       //     GOTO for each byte in the set, in order.
+  RVM_BITS,    // [a] Push the bit field that starts here as an integer;
+	       //     see H_RVM_BITS. The MATCHes and STEPs over the bytes
+	       //     it ends in follow it.
+  RVM_COUNT_PUSH, // [c] Start counting the rounds of a loop, from 0. The
+		  //     parameter indexes the program's bounds pool, as it
+		  //     does for the other COUNT insns.
+  RVM_COUNT_LOOP, // [c] Go round the loop (on to the insn after next) while
+		  //     the count is below the max, and leave it (by the GOTO
+		  //     that comes next) once it is at least the min; both,
+		  //     going round first, when both hold.
+  RVM_COUNT_INC,  // [c] Count a round.
+  RVM_COUNT_POP,  // [c] Stop counting, on the way out of the loop.
   RVM_OPCOUNT
 } HRVMOp;
 
 typedef struct HRVMInsn_{
-  uint8_t op;
-  uint16_t arg;
+  uint32_t op : 8;
+  uint32_t arg : 24;
 } HRVMInsn;
 
+// Programs, and their action and charset tables, can't be longer than
+// this; h_compile fails on grammars that would need more.
+#define H_RVM_MAX_LENGTH ((size_t)1 << 24)
+
+// The parameter of RVM_BITS: the field starts offset bits (0-7) into the
+// byte, big end first, and is width bits (up to 64) long.
+#define H_RVM_BITS(offset, width, signedp) \
+  ((uint32_t)(offset) | ((uint32_t)(width) << 3) | ((signedp) ? 1u << 10 : 0))
+#define H_RVM_BITS_OFFSET(arg) ((arg) & 7)
+#define H_RVM_BITS_WIDTH(arg) (((arg) >> 3) & 0x7f)
+#define H_RVM_BITS_SIGNED(arg) (((arg) >> 10) & 1)
+
+// The bounds on the rounds of a counted loop, for the RVM_COUNT insns.
+typedef struct HRVMBounds_ {
+  uint32_t min, max; // max is H_RVM_UNBOUNDED if there is none
+} HRVMBounds;
+#define H_RVM_UNBOUNDED UINT32_MAX
+
 #define TT_MARK TT_RESERVED_1
 
 typedef struct HSVMContext_ {
@@ -51,30 +86,92 @@ typedef struct HSVMAction_ {
   void* env;
 } HSVMAction;
 
+typedef struct HRVMSuperInsn_ HRVMSuperInsn;
+typedef struct HRVMDFA_ HRVMDFA;
+
 struct HRVMProg_ {
   HAllocator *allocator;
+  size_t serial; // tells programs apart for caches that outlive them
   size_t length;
   size_t action_count;
   HRVMInsn *insns;
   HSVMAction *actions;
+  size_t charset_count;
+  uint8_t (*charsets)[32]; // 256-bit bitmaps, for RVM_MATCH_SET
+  size_t bounds_count;
+  HRVMBounds *bounds;      // for the RVM_COUNT insns
+  HRVMSuperInsn *code; // insns, prepared for the interpreter
+  size_t nslots;       // the threads there can be at once; see rvm_slots
+  HRVMDFA *dfa;        // for parses without a context; taken while in use
+  // While compiling: how many bits into the byte the next insn is, and
+  // whether a MATCH, STEP, EOF or CAPTURE has been put anywhere but on a
+  // byte boundary, which only an RVM_BITS field may start or end off.
+  uint8_t bit_offset;
+  bool misaligned;
+  uint8_t lead[32];    // the bytes a match can start with,
+  int lead_byte;       // or the only one, or -1
+  bool lead_any;       // unless a match can be empty
 };
 
 // Returns true IFF the provided parser could be compiled.
 bool h_compile_regex(HRVMProg *prog, const HParser* parser);
 
 // These functions are used by the compile_to_rvm method of HParser
-uint16_t h_rvm_create_action(HRVMProg *prog, HSVMActionFunc action_func, void* env);
+uint32_t h_rvm_create_action(HRVMProg *prog, HSVMActionFunc action_func, void* env);
+uint32_t h_rvm_create_charset(HRVMProg *prog, HCharset cs);
+uint32_t h_rvm_create_bounds(HRVMProg *prog, uint32_t min, uint32_t max);
 
 // returns the address of the instruction just created
-uint16_t h_rvm_insert_insn(HRVMProg *prog, HRVMOp op, uint16_t arg);
+uint32_t h_rvm_insert_insn(HRVMProg *prog, HRVMOp op, uint32_t arg);
 
 // returns the address of the next insn to be created.
-uint16_t h_rvm_get_ip(HRVMProg *prog);
+uint32_t h_rvm_get_ip(HRVMProg *prog);
 
 // Used to insert forward references; the idea is to generate a JUMP
 // or FORK instruction with a target of 0, then update it once the
 // correct target is known.
-void h_rvm_patch_arg(HRVMProg *prog, uint16_t ip, uint16_t new_val);
+void h_rvm_patch_arg(HRVMProg *prog, uint32_t ip, uint32_t new_val);
+
+// Matching input that arrives in pieces. A run keeps the state of the
+// match between calls to h_rvm_feed, which takes the next chunk of input and
+// returns true once more input could no longer change the result.
+// h_rvm_finish marks the end of the input, and returns the result as
+// h_parse would, then frees the run.
+//
+// Chunks are not copied, so each must stay valid until h_rvm_finish, and
+// then for as long as the result is used: captured bytes point into them.
+// Only a capture that spans two chunks is copied, into the result. With a
+// parse context, the result lives in the context as with h_parse_ctx_parse,
+// and the context must not be used for anything else until h_rvm_finish.
+typedef struct HRVMRun_ HRVMRun;
+HRVMRun *h_rvm_start(HParseCtx *ctx, HRVMProg *prog);
+HRVMRun *h_rvm_start__m(HAllocator *mm__, HParseCtx *ctx, HRVMProg *prog);
+bool h_rvm_feed(HRVMRun *run, const uint8_t *chunk, size_t len);
+HParseResult *h_rvm_finish(HRVMRun *run);
+
+// Searching: the first match of prog in input that starts at or after
+// from, in one pass over the input. The match is the one h_parse would give
+// on input + start, but for the positions of tokens, which are counted from
+// input. With a parse context, the result lives in the context as with
+// h_parse_ctx_parse; without, free it with h_parse_result_free.
+typedef struct HRVMMatch_ {
+  size_t start, end; // the match is input[start] up to input[end]
+  HParseResult *result;
+} HRVMMatch;
+bool h_rvm_find(HParseCtx *ctx, HRVMProg *prog, const uint8_t *input, size_t len,
+		size_t from, HRVMMatch *match);
+bool h_rvm_find__m(HAllocator *mm__, HParseCtx *ctx, HRVMProg *prog, const uint8_t *input,
+		   size_t len, size_t from, HRVMMatch *match);
+
+// Every match, left to right: each search goes on from the end of the last
+// match, or the byte after it if it was empty. f gets each in turn, and may
+// return false to stop; the result is freed once it returns. Returns how
+// many matches f was given.
+typedef bool (*HRVMMatchFunc)(const HRVMMatch *match, void *env);
+size_t h_rvm_find_all(HParseCtx *ctx, HRVMProg *prog, const uint8_t *input, size_t len,
+		      HRVMMatchFunc f, void *env);
+size_t h_rvm_find_all__m(HAllocator *mm__, HParseCtx *ctx, HRVMProg *prog, const uint8_t *input,
+			 size_t len, HRVMMatchFunc f, void *env);
 
 // Common SVM action funcs...
 bool h_svm_action_make_sequence(HArena *arena, HSVMContext *ctx, void* env);
@@ -34,7 +34,14 @@ const char* rvm_op_names[RVM_OPCOUNT] = {
   "CAPTURE",
   "EOF",
   "MATCH",
-  "STEP"
+  "STEP",
+  "MATCH_SET",
+  "SWITCH",
+  "BITS",
+  "COUNT_PUSH",
+  "COUNT_LOOP",
+  "COUNT_INC",
+  "COUNT_POP"
 };
 
 const char* svm_op_names[SVM_OPCOUNT] = {
@@ -42,18 +49,19 @@ const char* svm_op_names[SVM_OPCOUNT] = {
   "NOP",
   "ACTION",
   "CAPTURE",
-  "ACCEPT"
+  "ACCEPT",
+  "BITS"
 };
 
 void dump_rvm_prog(HRVMProg *prog) {
   char* symref;
   for (unsigned int i = 0; i < prog->length; i++) {
     HRVMInsn *insn = &prog->insns[i];
-    printf("%4d %-10s", i, rvm_op_names[insn->op]);
+    printf("%4d %-11s", i, rvm_op_names[insn->op]);
     switch (insn->op) {
     case RVM_GOTO:
     case RVM_FORK:
-      printf("%hd\n", insn->arg);
+      printf("%u\n", (unsigned)insn->arg);
       break;
     case RVM_ACTION:
       symref = getsym(prog->actions[insn->arg].action);
@@ -80,15 +88,40 @@ void dump_rvm_prog(HRVMProg *prog) {
       }
       break;
     }
+    case RVM_MATCH_SET:
+    case RVM_SWITCH: {
+      const uint8_t *set = prog->charsets[insn->arg];
+      for (int c = 0; c < 256; c++) {
+	if ((set[c >> 3] >> (c & 7)) & 1)
+	  printf(c >= 0x20 && c <= 0x7e ? " '%c'" : " %02x", c);
+      }
+      printf("\n");
+      break;
+    }
+    case RVM_BITS:
+      printf("%s%u bits at +%u\n", H_RVM_BITS_SIGNED(insn->arg) ? "signed " : "",
+	     H_RVM_BITS_WIDTH(insn->arg), H_RVM_BITS_OFFSET(insn->arg));
+      break;
+    case RVM_COUNT_PUSH:
+    case RVM_COUNT_LOOP:
+    case RVM_COUNT_INC:
+    case RVM_COUNT_POP: {
+      const HRVMBounds *b = &prog->bounds[insn->arg];
+      if (b->max == H_RVM_UNBOUNDED)
+	printf("%u..\n", b->min);
+      else
+	printf("%u..%u\n", b->min, b->max);
+      break;
+    }
     default:
       printf("\n");
     }
   }
 }
 
-void dump_svm_prog(HRVMProg *prog, HRVMTrace *trace) {
+void dump_svm_prog(HRVMProg *prog, HRVMOps ops) {
   char* symref;
-  for (; trace != NULL; trace = trace->next) {
+  for (const HRVMTraceOp *trace = ops.ops; trace < ops.ops + ops.n; trace++) {
     printf("@%04zd %-10s", trace->input_pos, svm_op_names[trace->opcode]);
     switch (trace->opcode) {
     case SVM_ACTION:
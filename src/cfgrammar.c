@@ -202,25 +202,18 @@ static void collect_geneps(HCFGrammar *g)
   size_t prevused;
   do {
     prevused = g->geneps->used;
-    size_t i;
-    HHashTableEntry *hte;
-    for(i=0; i < g->nts->capacity; i++) {
-      for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-        if(hte->key == NULL)
-          continue;
-        const HCFChoice *symbol = hte->key;
-        assert(symbol->type == HCF_CHOICE);
-
-        // this NT derives epsilon if any one of its productions does.
-        HCFSequence **p;
-        for(p = symbol->seq; *p != NULL; p++) {
-          if(h_derives_epsilon_seq(g, (*p)->items)) {
-            h_hashset_put(g->geneps, symbol);
-            break;
-          }
+    H_FOREACH_KEY(g->nts, HCFChoice *symbol)
+      assert(symbol->type == HCF_CHOICE);
+
+      // this NT derives epsilon if any one of its productions does.
+      HCFSequence **p;
+      for(p = symbol->seq; *p != NULL; p++) {
+        if(h_derives_epsilon_seq(g, (*p)->items)) {
+          h_hashset_put(g->geneps, symbol);
+          break;
         }
       }
-    }
+    H_END_FOREACH
   } while(g->geneps->used != prevused);
 }
 
@@ -296,17 +289,10 @@ void h_stringmap_replace(HStringMap *m, void *old, void *new)
   }
 
   // iterate over m->char_branches
-  const HHashTable *ht = m->char_branches;
-  for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-
-      HStringMap *m_ = hte->value;
-      if(m_)
-        h_stringmap_replace(m_, old, new);
-    }
-  }
+  H_FOREACH_VALUE(m->char_branches, HStringMap *m_)
+    if(m_)
+      h_stringmap_replace(m_, old, new);
+  H_END_FOREACH
 }
 
 void *h_stringmap_get(const HStringMap *m, const uint8_t *str, size_t n, bool end)
@@ -468,18 +454,11 @@ static bool any_string_shorter(size_t k, const HStringMap *m)
     return true;
 
   // iterate over m->char_branches
-  const HHashTable *ht = m->char_branches;
-  for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      HStringMap *m_ = hte->value;
-
-      // check subtree for strings shorter than k-1
-      if(any_string_shorter(k-1, m_))
-        return true;
-    }
-  }
+  H_FOREACH_VALUE(m->char_branches, HStringMap *m_)
+    // check subtree for strings shorter than k-1
+    if(any_string_shorter(k-1, m_))
+      return true;
+  H_END_FOREACH
 
   return false;
 }
@@ -492,14 +471,9 @@ static void remove_all_shorter(size_t k, HStringMap *m)
   if(k==1) return;
 
   // iterate over m->char_branches
-  const HHashTable *ht = m->char_branches;
-  for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      remove_all_shorter(k-1, hte->value);      // recursion into subtree
-    }
-  }
+  H_FOREACH_VALUE(m->char_branches, HStringMap *m_)
+    remove_all_shorter(k-1, m_);      // recursion into subtree
+  H_END_FOREACH
 }
 
 // h_follow adapted to the signature of StringSetFun
@@ -540,33 +514,27 @@ const HStringMap *h_follow(size_t k, HCFGrammar *g, const HCFChoice *x)
     h_stringmap_put_end(ret, INSET);
 
   // iterate over g->nts
-  size_t i;
-  HHashTableEntry *hte;
-  for(i=0; i < g->nts->capacity; i++) {
-    for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      HCFChoice *a = (void *)hte->key;      // production's left-hand symbol
-      assert(a->type == HCF_CHOICE);
-
-      // iterate over the productions for A
-      HCFSequence **p;
-      for(p=a->seq; *p; p++) {
-        HCFChoice **s = (*p)->items;        // production's right-hand side
-        
-        for(; *s; s++) {
-          if(*s == x) { // occurance found
-            HCFChoice **tail = s+1;
-
-            const HStringMap *first_tail = h_first_seq(k, g, tail);
-
-            // extend the elems of first_k(tail) up to length k from follow(A)
-            stringset_extend(g, ret, k, first_tail, h_follow_, &a);
-          }
+  H_FOREACH_KEY(g->nts, void *key)
+    HCFChoice *a = (void *)key;      // production's left-hand symbol
+    assert(a->type == HCF_CHOICE);
+
+    // iterate over the productions for A
+    HCFSequence **p;
+    for(p=a->seq; *p; p++) {
+      HCFChoice **s = (*p)->items;        // production's right-hand side
+      
+      for(; *s; s++) {
+        if(*s == x) { // occurance found
+          HCFChoice **tail = s+1;
+
+          const HStringMap *first_tail = h_first_seq(k, g, tail);
+
+          // extend the elems of first_k(tail) up to length k from follow(A)
+          stringset_extend(g, ret, k, first_tail, h_follow_, &a);
         }
       }
     }
-  }
+  H_END_FOREACH
 
   return ret;
 }
@@ -609,25 +577,19 @@ static void stringset_extend(HCFGrammar *g, HStringMap *ret,
   }
 
   // iterate over as->char_branches
-  const HHashTable *ht = as->char_branches;
-  for(size_t i=0; i < ht->capacity; i++) {
-    for(HHashTableEntry *hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      uint8_t c = key_char((HCharKey)hte->key);
-      
-      // follow the branch to find the set { a' | t a' <- as }
-      HStringMap *as_ = (HStringMap *)hte->value;
+  H_FOREACH(as->char_branches, void *key, HStringMap *as_)
+    uint8_t c = key_char((HCharKey)key);
 
-      // now the elements of ret that begin with t are given by
-      // t { a b | a <- as_, b <- f_l(tail), l=k-|a|-1 }
-      // so we can use recursion over k
-      HStringMap *ret_ = h_stringmap_new(g->arena);
-      h_stringmap_put_after(ret, c, ret_);
+    // as_ is the branch for c, the set { a' | t a' <- as }
 
-      stringset_extend(g, ret_, k-1, as_, f, tail);
-    }
-  }
+    // now the elements of ret that begin with t are given by
+    // t { a b | a <- as_, b <- f_l(tail), l=k-|a|-1 }
+    // so we can use recursion over k
+    HStringMap *ret_ = h_stringmap_new(g->arena);
+    h_stringmap_put_after(ret, c, ret_);
+
+    stringset_extend(g, ret_, k-1, as_, f, tail);
+  H_END_FOREACH
 }
 
 
@@ -791,21 +753,15 @@ void h_pprint_grammar(FILE *file, const HCFGrammar *g, int indent)
   // determine maximum string length of symbol names
   int len;
   size_t s;
-  for(len=1, s=26; s < g->nts->used; len++, s*=26); 
+  for(len=1, s=26; s < g->nts->used; len++, s*=26)
+    ;
 
   // iterate over g->nts
-  size_t i;
-  HHashTableEntry *hte;
-  for(i=0; i < g->nts->capacity; i++) {
-    for(hte = &g->nts->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      const HCFChoice *a = hte->key;        // production's left-hand symbol
-      assert(a->type == HCF_CHOICE);
-
-      pprint_ntrules(file, g, a, indent, len);
-    }
-  }
+  H_FOREACH_KEY(g->nts, HCFChoice *a)   // production's left-hand symbol
+    assert(a->type == HCF_CHOICE);
+
+    pprint_ntrules(file, g, a, indent, len);
+  H_END_FOREACH
 }
 
 void h_pprint_symbolset(FILE *file, const HCFGrammar *g, const HHashSet *set, int indent)
@@ -816,21 +772,15 @@ void h_pprint_symbolset(FILE *file, const HCFGrammar *g, const HHashSet *set, in
   fputc('{', file);
 
   // iterate over set
-  size_t i;
-  HHashTableEntry *hte;
   const HCFChoice *a = NULL;
-  for(i=0; i < set->capacity; i++) {
-    for(hte = &set->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      if(a != NULL) // we're not on the first element
-          fputc(',', file);
+  H_FOREACH_KEY(set, void *key)
+    if(a != NULL) // we're not on the first element
+        fputc(',', file);
 
-      a = hte->key;        // production's left-hand symbol
+    a = key;        // production's left-hand symbol
 
-      h_pprint_symbol(file, g, a);
-    }
-  }
+    h_pprint_symbol(file, g, a);
+  H_END_FOREACH
 
   fputs("}\n", file);
 }
@@ -874,36 +824,28 @@ pprint_stringmap_elems(FILE *file, bool first, char *prefix, size_t n, char sep,
   }
 
   // iterate over map->char_branches
-  HHashTable *ht = map->char_branches;
-  size_t i;
-  HHashTableEntry *hte;
-  for(i=0; i < ht->capacity; i++) {
-    for(hte = &ht->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      uint8_t c = key_char((HCharKey)hte->key);
-      HStringMap *ends = hte->value;
-
-      size_t n_ = n;
-      switch(c) {
-      case '$':  prefix[n_++] = '\\'; prefix[n_++] = '$'; break;
-      case '"':  prefix[n_++] = '\\'; prefix[n_++] = '"'; break;
-      case '\\': prefix[n_++] = '\\'; prefix[n_++] = '\\'; break;
-      case '\b': prefix[n_++] = '\\'; prefix[n_++] = 'b'; break;
-      case '\t': prefix[n_++] = '\\'; prefix[n_++] = 't'; break;
-      case '\n': prefix[n_++] = '\\'; prefix[n_++] = 'n'; break;
-      case '\r': prefix[n_++] = '\\'; prefix[n_++] = 'r'; break;
-      default:
-        if(isprint(c))
-          prefix[n_++] = c;
-        else
-          n_ += sprintf(prefix+n_, "\\x%.2X", c);
-      }
-
-      first = pprint_stringmap_elems(file, first, prefix, n_,
-                                     sep, valprint, env, ends);
+  H_FOREACH(map->char_branches, void *key, HStringMap *ends)
+    uint8_t c = key_char((HCharKey)key);
+
+    size_t n_ = n;
+    switch(c) {
+    case '$':  prefix[n_++] = '\\'; prefix[n_++] = '$'; break;
+    case '"':  prefix[n_++] = '\\'; prefix[n_++] = '"'; break;
+    case '\\': prefix[n_++] = '\\'; prefix[n_++] = '\\'; break;
+    case '\b': prefix[n_++] = '\\'; prefix[n_++] = 'b'; break;
+    case '\t': prefix[n_++] = '\\'; prefix[n_++] = 't'; break;
+    case '\n': prefix[n_++] = '\\'; prefix[n_++] = 'n'; break;
+    case '\r': prefix[n_++] = '\\'; prefix[n_++] = 'r'; break;
+    default:
+      if(isprint(c))
+        prefix[n_++] = c;
+      else
+        n_ += sprintf(prefix+n_, "\\x%.2X", c);
     }
-  }
+
+    first = pprint_stringmap_elems(file, first, prefix, n_,
+                                   sep, valprint, env, ends);
+  H_END_FOREACH
 
   return first;
 }
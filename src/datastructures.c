@@ -27,8 +27,6 @@ void h_carray_append(HCountedArray *array, void* item) {
     HParsedToken **elements = h_arena_malloc(array->arena, (array->capacity *= 2) * sizeof(HCountedArray*));
     for (size_t i = 0; i < array->used; i++)
       elements[i] = array->elements[i];
-    for (size_t i = array->used; i < array->capacity; i++)
-      elements[i] = 0;
     array->elements = elements;
   }
   array->elements[array->used++] = item;
@@ -129,213 +127,355 @@ void h_slist_free(HSlist *slist) {
   h_arena_free(slist->arena, slist);
 }
 
+// Grow once the number of entries exceeds 3/4 of the bucket count.
+#define H_HASHTABLE_MAX_LOAD(cap) ((cap) / 4 * 3)
+// Number of old buckets to migrate on every update during a rehash. Must be
+// at least 2 so that a rehash completes before the next one is due.
+#define H_HASHTABLE_REHASH_STEP 4
+
+static HHashTableEntry *hte_new_contents(HArena *arena, size_t capacity) {
+  // an entry with a NULL key is an empty bucket
+  return h_arena_malloc0(arena, sizeof(HHashTableEntry) * capacity);
+}
+
 HHashTable* h_hashtable_new(HArena *arena, HEqualFunc equalFunc, HHashFunc hashFunc) {
   HHashTable *ht = h_arena_malloc(arena, sizeof(HHashTable));
   ht->hashFunc = hashFunc;
   ht->equalFunc = equalFunc;
-  ht->capacity = 64; // to start; should be tuned later...
+  ht->capacity = 64; // to start; grows as needed
   ht->used = 0;
   ht->arena = arena;
-  ht->contents = h_arena_malloc(arena, sizeof(HHashTableEntry) * ht->capacity);
-  for (size_t i = 0; i < ht->capacity; i++) {
-    ht->contents[i].key = NULL;
-    ht->contents[i].value = NULL;
-    ht->contents[i].next = NULL;
-    ht->contents[i].hashval = 0;
-  }
-  //memset(ht->contents, 0, sizeof(HHashTableEntry) * ht->capacity);
+  ht->contents = hte_new_contents(arena, ht->capacity);
+  ht->old_contents = NULL;
+  ht->old_capacity = 0;
+  ht->rehash_pos = 0;
   return ht;
 }
 
-void* h_hashtable_get(const HHashTable* ht, const void* key) {
-  HHashValue hashval = ht->hashFunc(key);
+// find the entry for key in the given bucket array, or NULL
+static HHashTableEntry *hte_find(HEqualFunc eq, HHashTableEntry *contents, size_t capacity,
+                                 const void *key, HHashValue hashval) {
 #ifdef CONSISTENCY_CHECK
-  assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
+  assert((capacity & (capacity - 1)) == 0); // capacity is a power of 2
 #endif
-
-  HHashTableEntry *hte = NULL;
-  for (hte = &ht->contents[hashval & (ht->capacity - 1)];
+  for (HHashTableEntry *hte = &contents[hashval & (capacity - 1)];
        hte != NULL;
        hte = hte->next) {
     if (hte->key == NULL)
       continue;
     if (hte->hashval != hashval)
       continue;
-    if (ht->equalFunc(key, hte->key))
-      return hte->value;
+    if (hte->key == key || eq(key, hte->key))
+      return hte;
   }
   return NULL;
 }
 
-void h_hashtable_put(HHashTable* ht, const void* key, void* value) {
-  // # Start with a rebalancing
-  //h_hashtable_ensure_capacity(ht, ht->used + 1);
-
-  HHashValue hashval = ht->hashFunc(key);
-#ifdef CONSISTENCY_CHECK
-  assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
-#endif
+static HHashTableEntry *hte_lookup(const HHashTable *ht, const void *key, HHashValue hashval) {
+  HHashTableEntry *hte = NULL;
+  if (ht->old_contents)
+    hte = hte_find(ht->equalFunc, ht->old_contents, ht->old_capacity, key, hashval);
+  if (hte == NULL)
+    hte = hte_find(ht->equalFunc, ht->contents, ht->capacity, key, hashval);
+  return hte;
+}
 
+// Append an entry known not to be in ht->contents to its bucket. If the
+// bucket is occupied, the entry goes into 'node' (allocated if NULL).
+static void hte_append(HHashTable *ht, HHashTableEntry *node,
+                       const void *key, void *value, HHashValue hashval) {
   HHashTableEntry *hte = &ht->contents[hashval & (ht->capacity - 1)];
   if (hte->key != NULL) {
-    for(;;) {
-      // check each link, stay on last if not found
-      if (hte->hashval == hashval && ht->equalFunc(key, hte->key))
-	goto insert_here;
-      if (hte->next == NULL)
-        break;
+    while (hte->next != NULL)
       hte = hte->next;
-    }
-    // Add a new link...
-    assert (hte->next == NULL);
-    hte->next = h_arena_malloc(ht->arena, sizeof(HHashTableEntry));
-    hte = hte->next;
-    hte->next = NULL;
-    ht->used++;
-  } else
-    ht->used++;
-
- insert_here:
+    if (node == NULL)
+      node = h_arena_malloc(ht->arena, sizeof(HHashTableEntry));
+    hte->next = node;
+    hte = node;
+  } else if (node != NULL) {
+    h_arena_free(ht->arena, node);
+  }
+  hte->next = NULL;
   hte->key = key;
   hte->value = value;
   hte->hashval = hashval;
 }
 
-void h_hashtable_update(HHashTable *dst, const HHashTable *src) {
-  size_t i;
-  HHashTableEntry *hte;
-  for(i=0; i < src->capacity; i++) {
-    for(hte = &src->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      h_hashtable_put(dst, hte->key, hte->value);
-    }
+// Move the entries of old bucket i into the current bucket array.
+static void hte_migrate_bucket(HHashTable *ht, size_t i) {
+  HHashTableEntry *hte = &ht->old_contents[i];
+  if (hte->key == NULL)
+    return;
+  HHashTableEntry *next = hte->next;
+  hte_append(ht, NULL, hte->key, hte->value, hte->hashval);
+  hte->key = hte->value = NULL;
+  hte->next = NULL;
+  hte->hashval = 0;
+  // reuse the chained nodes in the new table
+  while (next != NULL) {
+    hte = next;
+    next = hte->next;
+    hte_append(ht, hte, hte->key, hte->value, hte->hashval);
   }
 }
 
-void h_hashtable_merge(void *(*combine)(void *v1, const void *v2),
-	HHashTable *dst, const HHashTable *src) {
-  size_t i;
-  HHashTableEntry *hte;
-  for(i=0; i < src->capacity; i++) {
-    for(hte = &src->contents[i]; hte; hte = hte->next) {
-      if(hte->key == NULL)
-        continue;
-      void *dstvalue = h_hashtable_get(dst, hte->key);
-      void *srcvalue = hte->value;
-      h_hashtable_put(dst, hte->key, combine(dstvalue, srcvalue));
-    }
+// Advance an ongoing rehash by up to n buckets.
+static void h_hashtable_rehash_step(HHashTable *ht, size_t n) {
+  if (ht->old_contents == NULL)
+    return;
+  for (; n > 0 && ht->rehash_pos < ht->old_capacity; n--)
+    hte_migrate_bucket(ht, ht->rehash_pos++);
+  if (ht->rehash_pos == ht->old_capacity) {
+    h_arena_free(ht->arena, ht->old_contents);
+    ht->old_contents = NULL;
+    ht->old_capacity = 0;
+    ht->rehash_pos = 0;
   }
 }
 
-int   h_hashtable_present(const HHashTable* ht, const void* key) {
+// Start moving the table into a bucket array of twice the size.
+static void h_hashtable_grow(HHashTable *ht) {
+  // finish any previous rehash first; there is only room for one old table
+  h_hashtable_rehash_step(ht, ht->old_capacity);
+  ht->old_contents = ht->contents;
+  ht->old_capacity = ht->capacity;
+  ht->rehash_pos = 0;
+  ht->capacity *= 2;
+  ht->contents = hte_new_contents(ht->arena, ht->capacity);
+}
+
+// Make sure that any key with this hash lives in the current bucket array.
+static inline void h_hashtable_settle(HHashTable *ht, HHashValue hashval) {
+  if (ht->old_contents)
+    hte_migrate_bucket(ht, hashval & (ht->old_capacity - 1));
+}
+
+void* h_hashtable_get(const HHashTable* ht, const void* key) {
+  HHashTableEntry *hte = hte_lookup(ht, key, ht->hashFunc(key));
+  return hte? hte->value : NULL;
+}
+
+void h_hashtable_put(HHashTable* ht, const void* key, void* value) {
   HHashValue hashval = ht->hashFunc(key);
-#ifdef CONSISTENCY_CHECK
-  assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
-#endif
 
-  for (HHashTableEntry *hte = &ht->contents[hashval & (ht->capacity - 1)];
-       hte != NULL;
-       hte = hte->next) {
-    if (hte->hashval != hashval)
-      continue;
-    if (ht->equalFunc(key, hte->key))
-      return true;
+  HHashTableEntry *hte = hte_lookup(ht, key, hashval);
+  if (hte != NULL) {
+    // replacing an existing value leaves the table structure untouched
+    hte->key = key;
+    hte->value = value;
+    return;
   }
-  return false;
+
+  hte_append(ht, NULL, key, value, hashval);
+  ht->used++;
+
+  h_hashtable_rehash_step(ht, H_HASHTABLE_REHASH_STEP);
+  if (ht->used > H_HASHTABLE_MAX_LOAD(ht->capacity))
+    h_hashtable_grow(ht);
+}
+
+void h_hashtable_update(HHashTable *dst, const HHashTable *src) {
+  H_FOREACH(src, void *key, void *value)
+    h_hashtable_put(dst, key, value);
+  H_END_FOREACH
+}
+
+void h_hashtable_merge(void *(*combine)(void *v1, const void *v2),
+	HHashTable *dst, const HHashTable *src) {
+  H_FOREACH(src, void *key, void *srcvalue)
+    void *dstvalue = h_hashtable_get(dst, key);
+    h_hashtable_put(dst, key, combine(dstvalue, srcvalue));
+  H_END_FOREACH
+}
+
+int   h_hashtable_present(const HHashTable* ht, const void* key) {
+  return hte_lookup(ht, key, ht->hashFunc(key)) != NULL;
 }
 
 void  h_hashtable_del(HHashTable* ht, const void* key) {
   HHashValue hashval = ht->hashFunc(key);
-#ifdef CONSISTENCY_CHECK
-  assert((ht->capacity & (ht->capacity - 1)) == 0); // capacity is a power of 2
-#endif
+  h_hashtable_settle(ht, hashval);
 
+  HHashTableEntry *prev = NULL;
   for (HHashTableEntry *hte = &ht->contents[hashval & (ht->capacity - 1)];
        hte != NULL;
-       hte = hte->next) {
-    if (hte->hashval != hashval)
+       prev = hte, hte = hte->next) {
+    if (hte->key == NULL || hte->hashval != hashval)
       continue;
-    if (ht->equalFunc(key, hte->key)) {
+    if (hte->key == key || ht->equalFunc(key, hte->key)) {
       // FIXME: Leaks keys and values.
       HHashTableEntry* hten = hte->next;
-      if (hten != NULL) {
+      if (prev != NULL) {
+	prev->next = hten;
+	h_arena_free(ht->arena, hte);
+      } else if (hten != NULL) {
 	*hte = *hten;
 	h_arena_free(ht->arena, hten);
       } else {
 	hte->key = hte->value = NULL;
 	hte->hashval = 0;
       }
-      return;
+      ht->used--;
+      break;
     }
   }
+
+  h_hashtable_rehash_step(ht, H_HASHTABLE_REHASH_STEP);
 }
 
-void  h_hashtable_free(HHashTable* ht) {
-  for (size_t i = 0; i < ht->capacity; i++) {
-    HHashTableEntry *hten, *hte = &ht->contents[i];
+static void hte_free_contents(HArena *arena, HHashTableEntry *contents, size_t capacity) {
+  for (size_t i = 0; i < capacity; i++) {
+    HHashTableEntry *hten, *hte = &contents[i];
     // FIXME: Free key and value
     hte = hte->next;
     while (hte != NULL) {
       // FIXME: leaks keys and values.
       hten = hte->next;
-      h_arena_free(ht->arena, hte);
+      h_arena_free(arena, hte);
       hte = hten;
     }
   }
-  h_arena_free(ht->arena, ht->contents);
+  h_arena_free(arena, contents);
+}
+
+void  h_hashtable_free(HHashTable* ht) {
+  hte_free_contents(ht->arena, ht->contents, ht->capacity);
+  if (ht->old_contents)
+    hte_free_contents(ht->arena, ht->old_contents, ht->old_capacity);
+}
+
+/* Set equality of HHashSets.
+ * Obviously, 'a' and 'b' must use the same equality function.
+ * Not strictly necessary, but we also assume the same hash function.
+ */
+bool h_hashset_equal(const HHashSet *a, const HHashSet *b) {
+  if(a->used != b->used)
+    return false;
+  // same size, so a == b iff every element of a is in b
+  H_FOREACH_(a)
+    if(hte_lookup(b, hte__->key, hte__->hashval) == NULL)
+      return false;
+  H_END_FOREACH
+  return true;
+}
+
+// Open-addressing hash table
+
+#define H_OPENTABLE_INITIAL_CAPACITY 16
+
+// 0 marks an empty slot, so it is never stored as a hash value
+static inline HHashValue ot_hash(const HOpenTable *ht, const void *key) {
+  HHashValue hashval = ht->hashFunc(key);
+  return hashval? hashval : 1;
 }
 
-// helper for hte_equal
-static bool hte_same_length(HHashTableEntry *xs, HHashTableEntry *ys) {
-  while(xs && ys) {
-    xs=xs->next;
-    ys=ys->next;
-    // skip NULL keys (= element not present)
-    while(xs && xs->key == NULL) xs=xs->next;
-    while(ys && ys->key == NULL) ys=ys->next;
+static void ot_alloc(HOpenTable *ht, size_t capacity) {
+  ht->capacity = capacity;
+  // keys and values are only read where the hash is nonzero
+  ht->hashes = h_arena_malloc0(ht->arena, sizeof(HHashValue) * capacity);
+  ht->keys = h_arena_malloc(ht->arena, sizeof(void*) * capacity);
+  ht->values = h_arena_malloc(ht->arena, sizeof(void*) * capacity);
+}
+
+HOpenTable* h_opentable_new(HArena *arena, HEqualFunc equalFunc, HHashFunc hashFunc) {
+  HOpenTable *ht = h_arena_malloc(arena, sizeof(HOpenTable));
+  ht->hashFunc = hashFunc;
+  ht->equalFunc = equalFunc;
+  ht->used = 0;
+  ht->arena = arena;
+  ot_alloc(ht, H_OPENTABLE_INITIAL_CAPACITY);
+  return ht;
+}
+
+// index of the slot holding key, or of the empty slot where it would go
+static inline size_t ot_probe(const HOpenTable *ht, const void *key, HHashValue hashval) {
+  size_t mask = ht->capacity - 1;
+  size_t i = hashval & mask;
+  while (ht->hashes[i] != 0) {
+    if (ht->hashes[i] == hashval
+        && (ht->keys[i] == key || ht->equalFunc(key, ht->keys[i])))
+      break;
+    i = (i + 1) & mask;
   }
-  return (xs == ys);    // both NULL
+  return i;
 }
 
-// helper for hte_equal: are all elements of xs present in ys?
-static bool hte_subset(HEqualFunc eq, HHashTableEntry *xs, HHashTableEntry *ys)
-{
-  for(; xs; xs=xs->next) {
-    if(xs->key == NULL) continue;   // element not present
+static void ot_grow(HOpenTable *ht) {
+  HHashValue *hashes = ht->hashes;
+  const void **keys = ht->keys;
+  void **values = ht->values;
+  size_t capacity = ht->capacity;
+
+  ot_alloc(ht, capacity * 2);
+  size_t mask = ht->capacity - 1;
+  for (size_t i = 0; i < capacity; i++) {
+    if (hashes[i] == 0)
+      continue;
+    // keys are known to be distinct; just find a free slot
+    size_t j = hashes[i] & mask;
+    while (ht->hashes[j] != 0)
+      j = (j + 1) & mask;
+    ht->hashes[j] = hashes[i];
+    ht->keys[j] = keys[i];
+    ht->values[j] = values[i];
+  }
 
-    HHashTableEntry *hte;
-    for(hte=ys; hte; hte=hte->next) {
-      if(hte->key == xs->key) break; // assume an element is equal to itself
-      if(hte->hashval != xs->hashval) continue; // shortcut
-      if(eq(hte->key, xs->key)) break;
+  h_arena_free(ht->arena, hashes);
+  h_arena_free(ht->arena, keys);
+  h_arena_free(ht->arena, values);
+}
+
+void* h_opentable_get(const HOpenTable* ht, const void* key) {
+  size_t i = ot_probe(ht, key, ot_hash(ht, key));
+  return ht->hashes[i]? ht->values[i] : NULL;
+}
+
+void h_opentable_put(HOpenTable* ht, const void* key, void* value) {
+  HHashValue hashval = ot_hash(ht, key);
+  size_t i = ot_probe(ht, key, hashval);
+  if (ht->hashes[i] == 0) {
+    // keep the load factor at or below 3/4
+    if (ht->used + 1 > ht->capacity / 4 * 3) {
+      ot_grow(ht);
+      i = ot_probe(ht, key, hashval);
     }
-    if(hte == NULL) return false;   // element not found
+    ht->hashes[i] = hashval;
+    ht->used++;
   }
-  return true;                      // all found
+  ht->keys[i] = key;
+  ht->values[i] = value;
 }
 
-// compare two lists of HHashTableEntries
-static inline bool hte_equal(HEqualFunc eq, HHashTableEntry *xs, HHashTableEntry *ys) {
-  return (hte_same_length(xs, ys) && hte_subset(eq, xs, ys));
+int h_opentable_present(const HOpenTable* ht, const void* key) {
+  return ht->hashes[ot_probe(ht, key, ot_hash(ht, key))] != 0;
 }
 
-/* Set equality of HHashSets.
- * Obviously, 'a' and 'b' must use the same equality function.
- * Not strictly necessary, but we also assume the same hash function.
- */
-bool h_hashset_equal(const HHashSet *a, const HHashSet *b) {
-  if(a->capacity == b->capacity) {
-    // iterate over the buckets in parallel
-    for(size_t i=0; i < a->capacity; i++) {
-      if(!hte_equal(a->equalFunc, &a->contents[i], &b->contents[i]))
-        return false;
+void h_opentable_del(HOpenTable* ht, const void* key) {
+  size_t mask = ht->capacity - 1;
+  size_t i = ot_probe(ht, key, ot_hash(ht, key));
+  if (ht->hashes[i] == 0)
+    return;
+  // FIXME: Leaks keys and values.
+  ht->used--;
+  // shift back any following entries that would no longer be reachable
+  for (size_t j = (i + 1) & mask; ht->hashes[j] != 0; j = (j + 1) & mask) {
+    size_t home = ht->hashes[j] & mask;
+    // move entry j into the hole at i unless its home lies in (i, j]
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      ht->hashes[i] = ht->hashes[j];
+      ht->keys[i] = ht->keys[j];
+      ht->values[i] = ht->values[j];
+      i = j;
     }
-  } else {
-    assert_message(0, "h_hashset_equal called on sets of different capacity");
-    // TODO implement general case
   }
-  return true;
+  ht->hashes[i] = 0;
+}
+
+void h_opentable_free(HOpenTable* ht) {
+  // FIXME: Free keys and values
+  h_arena_free(ht->arena, ht->hashes);
+  h_arena_free(ht->arena, ht->keys);
+  h_arena_free(ht->arena, ht->values);
 }
 
 bool h_eq_ptr(const void *p, const void *q) {
@@ -79,7 +79,7 @@ HParsedToken *h_act_ignore(const HParseResult *p, void* user_data) {
 // Low-level helper for the h_make family.
 HParsedToken *h_make_(HArena *arena, HTokenType type)
 {
-  HParsedToken *ret = h_arena_malloc(arena, sizeof(HParsedToken));
+  HParsedToken *ret = h_arena_malloc0(arena, sizeof(HParsedToken));
   ret->token_type = type;
   return ret;
 }
@@ -181,7 +181,7 @@ HParsedToken *h_act_ignore(const HParseResult *p, void* user_data);
 //
 
 // Standard short-hand for arena-allocating a variable in a semantic action.
-#define H_ALLOC(TYP)  ((TYP *) h_arena_malloc(p->arena, sizeof(TYP)))
+#define H_ALLOC(TYP)  ((TYP *) h_arena_malloc0(p->arena, sizeof(TYP)))
 
 // Token constructors...
 
@@ -48,7 +48,7 @@ typedef struct {
 HParseResult* h_parse(const HParser* parser, const uint8_t* input, size_t length) {
   return h_parse__m(&system_allocator, parser, input, length);
 }
-HParseResult* h_parse__m(HAllocator* mm__, const HParser* parser, const uint8_t* input, size_t length) {
+static HParseResult* parse_with(HAllocator* mm__, HParseCtx* ctx, const HParser* parser, const uint8_t* input, size_t length) {
   // Set up a parse state...
   HInputStream input_stream = {
     .index = 0,
@@ -59,7 +59,47 @@ HParseResult* h_parse__m(HAllocator* mm__, const HParser* parser, const uint8_t*
     .input = input
   };
   
-  return backends[parser->backend]->parse(mm__, parser, &input_stream);
+  return backends[parser->backend]->parse(mm__, parser, &input_stream, ctx);
+}
+
+HParseResult* h_parse__m(HAllocator* mm__, const HParser* parser, const uint8_t* input, size_t length) {
+  return parse_with(mm__, NULL, parser, input, length);
+}
+
+// Blocks each context arena keeps from one parse to the next
+#define H_PARSE_CTX_KEEP_BLOCKS 8
+
+HParseCtx* h_parse_ctx_new(void) {
+  return h_parse_ctx_new__m(&system_allocator);
+}
+HParseCtx* h_parse_ctx_new__m(HAllocator* mm__) {
+  HParseCtx *ctx = h_new(HParseCtx, 1);
+  ctx->mm__ = mm__;
+  ctx->arena = h_new_arena(mm__, 0);
+  ctx->tarena = h_new_arena(mm__, 0);
+  ctx->cache_key = NULL;
+  ctx->cache = NULL;
+  ctx->cache_free = NULL;
+  return ctx;
+}
+
+void h_parse_ctx_reset(HParseCtx* ctx) {
+  h_arena_reset(ctx->arena, H_PARSE_CTX_KEEP_BLOCKS);
+  h_arena_reset(ctx->tarena, H_PARSE_CTX_KEEP_BLOCKS);
+}
+
+HParseResult* h_parse_ctx_parse(HParseCtx* ctx, const HParser* parser, const uint8_t* input, size_t length) {
+  h_parse_ctx_reset(ctx);
+  return parse_with(ctx->mm__, ctx, parser, input, length);
+}
+
+void h_parse_ctx_free(HParseCtx* ctx) {
+  HAllocator *mm__ = ctx->mm__;
+  if (ctx->cache_free)
+    ctx->cache_free(ctx->cache);
+  h_delete_arena(ctx->arena);
+  h_delete_arena(ctx->tarena);
+  h_free(ctx);
 }
 
 void h_parse_result_free__m(HAllocator *alloc, HParseResult *result) {
@@ -86,6 +126,22 @@ bool h_not_regular(HRVMProg *prog, void *env) {
   return false;
 }
 
+// visit hook for combinators whose env is the wrapped parser itself
+void h_visit_env_parser(void *env, HParserVisitFn f, void *arg) {
+  if (env)
+    f((const HParser*)env, arg);
+}
+
+static unsigned int next_parser_id = H_PARSER_FIRST_ID;
+
+unsigned int h_new_parser_id(void) {
+  return __sync_fetch_and_add(&next_parser_id, 1);
+}
+
+void h_set_memoize(HParser* parser, HMemoize memoize) {
+  parser->memoize = memoize;
+}
+
 int h_compile(HParser* parser, HParserBackend backend, const void* params) {
   return h_compile__m(&system_allocator, parser, backend, params);
 }
@@ -95,5 +151,7 @@ int h_compile__m(HAllocator* mm__, HParser* parser, HParserBackend backend, cons
   int ret = backends[backend]->compile(mm__, parser, params);
   if (!ret)
     parser->backend = backend;
+  else if (parser->backend_data)
+    backends[backend]->free(parser); // e.g. a LALR table with conflicts
   return ret;
 }
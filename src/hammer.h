@@ -35,6 +35,7 @@ extern "C" {
 #endif
 
 typedef struct HParseState_ HParseState;
+typedef struct HParseCtx_ HParseCtx;
 
 typedef enum HParserBackend_ {
   PB_MIN = 0,
@@ -46,6 +47,30 @@ typedef enum HParserBackend_ {
   PB_MAX = PB_GLR
 } HParserBackend;
 
+/**
+ * Memo table layouts for the packrat backend, passed to h_compile as
+ * (void*)H_PACKRAT_DENSE_MEMO and so on.
+ *
+ * The dense memo indexes results by (rule, byte offset) instead of
+ * hashing. It costs a pointer per rule per input byte touched, so it
+ * suits grammars with few rules parsing short messages. Grammars with
+ * too many rules fall back to the hash memo.
+ */
+typedef enum HPackratMemo_ {
+  H_PACKRAT_HASH_MEMO = 0, // default
+  H_PACKRAT_DENSE_MEMO,
+} HPackratMemo;
+
+/**
+ * Per-parser override for the packrat backend's choice of which
+ * parsers to memoize; see h_set_memoize.
+ */
+typedef enum HMemoize_ {
+  H_MEMO_AUTO = 0, // let h_compile decide (the default)
+  H_MEMO_ALWAYS,
+  H_MEMO_NEVER,
+} HMemoize;
+
 typedef enum HTokenType_ {
   // Before you change the explicit values of these, think of the poor bindings ;_;
   TT_NONE = 1,
@@ -152,6 +177,8 @@ typedef struct HParser_ {
   void* backend_data;
   void *env;
   HCFChoice *desugared; /* if the parser can be desugared, its desugared form */
+  unsigned int id; /* small integer naming this parser, assigned at construction */
+  HMemoize memoize; /* packrat memoization override, see h_set_memoize() */
 } HParser;
 
 // {{{ Stuff for benchmarking
@@ -247,6 +274,20 @@ typedef struct HBenchmarkResults_ {
  */
 HAMMER_FN_DECL(HParseResult*, h_parse, const HParser* parser, const uint8_t* input, size_t length);
 
+/**
+ * A parse context owns the memory used by a series of parses and
+ * recycles it from one parse to the next, so that a steady stream of
+ * parses does not go back to the allocator each time.
+ *
+ * A result returned by h_parse_ctx_parse lives in the context. It stays
+ * valid until the next parse with the same context, or until the
+ * context is freed, and must not be passed to h_parse_result_free.
+ * A context must not be used by two threads at once.
+ */
+HAMMER_FN_DECL_NOARG(HParseCtx*, h_parse_ctx_new);
+HParseResult* h_parse_ctx_parse(HParseCtx* ctx, const HParser* parser, const uint8_t* input, size_t length);
+void h_parse_ctx_free(HParseCtx* ctx);
+
 /**
  * Given a string, returns a parser that parses that string value. 
  * 
@@ -602,6 +643,17 @@ HAMMER_FN_DECL_NOARG(HParser*, h_indirect);
  */
 HAMMER_FN_DECL(void, h_bind_indirect, HParser* indirect, const HParser* inner);
 
+/**
+ * Override whether the packrat backend memoizes [parser]. By default,
+ * h_compile(..., PB_PACKRAT, ...) memoizes only the composite parsers
+ * that can be re-run at the same input position; terminals and parsers
+ * with a single use are simply run again. Parsers on a recursive cycle
+ * are always memoized, since left recursion depends on it.
+ *
+ * Takes effect the next time a grammar containing [parser] is compiled.
+ */
+void h_set_memoize(HParser* parser, HMemoize memoize);
+
 /**
  * Free the memory allocated to an HParseResult when it is no longer needed.
  */
@@ -128,9 +128,10 @@ static inline void h_sarray_clear(HSArray *arr) {
 #define H__INTVAR(pfx) H__APPEND(intvar__##pfx##__,__COUNTER__)
 
 #define H_SARRAY_FOREACH_KV_(var,idx,arr,intvar)			\
-  for (size_t intvar = 0, idx = (var = (arr)->nodes[(arr)->nodes[intvar].elem].content,(arr)->nodes[intvar].elem); \
-       intvar < (arr)->used;						\
-       idx = (arr)->nodes[intvar].elem, var = (arr)->nodes[(arr)->nodes[intvar].elem].content, intvar=intvar+1)
+  for (size_t intvar = 0, idx = 0;					\
+       intvar < (arr)->used &&						\
+         (idx = (arr)->nodes[intvar].elem, var = (arr)->nodes[idx].content, 1); \
+       intvar++)
 
 #define H_SARRAY_FOREACH_KV(var,index,arr) H_SARRAY_FOREACH_KV_(var,index,arr,H__INTVAR(idx))
 #define H_SARRAY_FOREACH_V(var,arr) H_SARRAY_FOREACH_KV_(var,H__INTVAR(elem),arr,H__INTVAR(idx))
@@ -175,8 +176,73 @@ typedef struct HHashTable_ {
   size_t capacity;
   size_t used;
   HArena *arena;
+  // Incremental rehashing: when the table grows, the previous bucket array
+  // is kept in old_contents and drained a few buckets per update, so that no
+  // single put has to move the whole table. Buckets below rehash_pos are
+  // already empty. old_contents is NULL (and old_capacity 0) otherwise.
+  HHashTableEntry *old_contents;
+  size_t old_capacity;
+  size_t rehash_pos;
 } HHashTable;
 
+// Iterate over all entries of a hash table. The table must not be modified
+// while iterating.
+#define H_FOREACH_(HT) {                                                    \
+    const HHashTable *ht__ = HT;                                            \
+    for(int t__=0; t__ < 2; t__++) {                                        \
+      HHashTableEntry *c__ = t__? ht__->contents : ht__->old_contents;      \
+      size_t n__ = t__? ht__->capacity : ht__->old_capacity;                \
+      for(size_t i__=0; i__ < n__; i__++) {                                 \
+        for(HHashTableEntry *hte__ = &c__[i__];                             \
+            hte__;                                                          \
+            hte__ = hte__->next) {                                          \
+          if(hte__->key == NULL) continue;
+
+#define H_FOREACH_KEY(HT, KEYVAR) H_FOREACH_(HT)                            \
+          const KEYVAR = hte__->key;
+
+#define H_FOREACH(HT, KEYVAR, VALVAR) H_FOREACH_KEY(HT, KEYVAR)             \
+          VALVAR = hte__->value;
+
+#define H_FOREACH_VALUE(HT, VALVAR) H_FOREACH_(HT)                          \
+          VALVAR = hte__->value;
+
+#define H_END_FOREACH                                                       \
+        }                                                                   \
+      }                                                                     \
+    }                                                                       \
+  }
+
+/* An open-addressing (linear probing) hash table.
+ *
+ * Same interface as HHashTable, but entries are stored in flat arrays
+ * instead of chained nodes, so a lookup touches one or two cache lines
+ * instead of following pointers around the arena. A stored hash of 0
+ * marks an empty slot. Deletion shifts later entries back, so no
+ * tombstones are needed.
+ */
+typedef struct HOpenTable_ {
+  HHashValue *hashes;
+  const void **keys;
+  void **values;
+  HHashFunc hashFunc;
+  HEqualFunc equalFunc;
+  size_t capacity;
+  size_t used;
+  HArena *arena;
+} HOpenTable;
+
+#define H_OPENTABLE_FOREACH(HT, KEYVAR, VALVAR) {                           \
+    const HOpenTable *ot__ = HT;                                            \
+    for(size_t i__=0; i__ < ot__->capacity; i__++) {                        \
+      if(ot__->hashes[i__] == 0) continue;                                  \
+      const KEYVAR = ot__->keys[i__];                                       \
+      VALVAR = ot__->values[i__];
+
+#define H_OPENTABLE_END_FOREACH                                             \
+    }                                                                       \
+  }
+
 /* The state of the parser.
  *
  * Members:
@@ -188,26 +254,65 @@ typedef struct HHashTable_ {
  *
  */
   
+typedef struct HPackratTable_ HPackratTable; // see packrat.c
+typedef struct HPackratDense_ HPackratDense;
+
 struct HParseState_ {
-  HHashTable *cache; 
+  HOpenTable *cache; 
   HInputStream input_stream;
   HArena * arena;
   HSlist *lr_stack;
-  HHashTable *recursion_heads;
+  HOpenTable *recursion_heads;
+  const HPackratTable *rules; // set by h_compile, or NULL to memoize everything
+  HPackratDense *dense; // NULL unless compiled with H_PACKRAT_DENSE_MEMO
 };
 
+struct HParseCtx_ {
+  HAllocator *mm__;
+  HArena *arena;  // results of the last parse
+  HArena *tarena; // scratch space, reset before each parse
+  // A backend may keep one cache of its own across parses, such as the
+  // regex backend's DFA. cache_key says what it was built for.
+  const void *cache_key;
+  void *cache;
+  void (*cache_free)(void *cache);
+};
+
+// Frees the results of the last parse, before another one.
+void h_parse_ctx_reset(HParseCtx *ctx);
+
+/* Arenas for a single parse: lent out by the context if there is one,
+ * freshly allocated otherwise. A lent arena is reset by the next
+ * h_parse_ctx_parse, so h_parse_arena_done only deletes fresh ones.
+ */
+static inline HArena *h_parse_arena(HAllocator *mm__, HParseCtx *ctx) {
+  return ctx ? ctx->arena : h_new_arena(mm__, 0);
+}
+static inline HArena *h_parse_tmp_arena(HAllocator *mm__, HParseCtx *ctx) {
+  return ctx ? ctx->tarena : h_new_arena(mm__, 0);
+}
+static inline void h_parse_arena_done(HParseCtx *ctx, HArena *arena) {
+  if (!ctx)
+    h_delete_arena(arena);
+}
+
 typedef struct HParserBackendVTable_ {
   int (*compile)(HAllocator *mm__, HParser* parser, const void* params);
-  HParseResult* (*parse)(HAllocator *mm__, const HParser* parser, HInputStream* stream);
+  HParseResult* (*parse)(HAllocator *mm__, const HParser* parser, HInputStream* stream, HParseCtx *ctx);
   void (*free)(HParser* parser);
 } HParserBackendVTable;
 
 
 /* The (location, parser) tuple used to key the cache.
+ *
+ * Members:
+ *   pos - the input position and parser id packed into one word; see
+ *         packrat.c. This alone almost always tells keys apart.
+ *   parser - the parser itself, compared to rule out parser id collisions.
  */
 
 typedef struct HParserCacheKey_ {
-  HInputStream input_pos;
+  uint64_t pos;
   const HParser *parser;
 } HParserCacheKey;
 
@@ -296,12 +401,20 @@ int64_t h_read_bits(HInputStream* state, int count, char signed_p);
 HParseResult* h_do_parse(const HParser* parser, HParseState *state);
 void put_cached(HParseState *ps, const HParser *p, HParseResult *cached);
 
+// Parser ids: none is 0, and the static h_unimplemented() parser has one
+// of its own; h_new_parser_id hands out the rest, from H_PARSER_FIRST_ID.
+#define H_PARSER_NO_ID 0
+#define H_PARSER_ID_UNIMPLEMENTED 1
+#define H_PARSER_FIRST_ID 2
+unsigned int h_new_parser_id(void);
+
 static inline
 HParser *h_new_parser(HAllocator *mm__, const HParserVtable *vt, void *env) {
   HParser *p = h_new(HParser, 1);
   memset(p, 0, sizeof(HParser));
   p->vtable = vt;
   p->env = env;
+  p->id = h_new_parser_id();
   return p;
 }
 
@@ -332,6 +445,14 @@ void  h_hashtable_del(HHashTable* ht, const void* key);
 void  h_hashtable_free(HHashTable* ht);
 static inline bool h_hashtable_empty(const HHashTable* ht) { return (ht->used == 0); }
 
+HOpenTable* h_opentable_new(HArena *arena, HEqualFunc equalFunc, HHashFunc hashFunc);
+void* h_opentable_get(const HOpenTable* ht, const void* key);
+void  h_opentable_put(HOpenTable* ht, const void* key, void* value);
+int   h_opentable_present(const HOpenTable* ht, const void* key);
+void  h_opentable_del(HOpenTable* ht, const void* key);
+void  h_opentable_free(HOpenTable* ht);
+static inline bool h_opentable_empty(const HOpenTable* ht) { return (ht->used == 0); }
+
 typedef HHashTable HHashSet;
 #define h_hashset_new(a,eq,hash) h_hashtable_new(a,eq,hash)
 #define h_hashset_put(ht,el)     h_hashtable_put(ht, el, NULL)
@@ -372,17 +493,23 @@ struct HCFSequence_ {
   HCFChoice **items; // last one is NULL
 };
 
+typedef void (*HParserVisitFn)(const HParser *child, void *arg);
+
 struct HParserVtable_ {
   HParseResult* (*parse)(void *env, HParseState *state);
   bool (*isValidRegular)(void *env);
   bool (*isValidCF)(void *env);
   bool (*compile_to_rvm)(HRVMProg *prog, void* env); // FIXME: forgot what the bool return value was supposed to mean.
   void (*desugar)(HAllocator *mm__, HCFStack *stk__, void *env);
+  // Call f on each direct sub-parser. NULL for parsers without any, and
+  // for those whose sub-parsers cannot be enumerated.
+  void (*visit)(void *env, HParserVisitFn f, void *arg);
 };
 
 bool h_false(void*);
 bool h_true(void*);
 bool h_not_regular(HRVMProg*, void*);
+void h_visit_env_parser(void *env, HParserVisitFn f, void *arg);
 
 #if 0
 #include <stdlib.h>
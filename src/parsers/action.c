@@ -75,12 +75,17 @@ static bool action_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static void action_visit(void *env, HParserVisitFn f, void *arg) {
+  f(((HParseAction*)env)->p, arg);
+}
+
 static const HParserVtable action_vt = {
   .parse = parse_action,
   .isValidRegular = action_isValidRegular,
   .isValidCF = action_isValidCF,
   .desugar = desugar_action,
   .compile_to_rvm = action_ctrvm,
+  .visit = action_visit,
 };
 
 HParser* h_action(const HParser* p, const HAction a, void* user_data) {
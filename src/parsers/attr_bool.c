@@ -73,12 +73,17 @@ static bool ab_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static void ab_visit(void *env, HParserVisitFn f, void *arg) {
+  f(((HAttrBool*)env)->p, arg);
+}
+
 static const HParserVtable attr_bool_vt = {
   .parse = parse_attr_bool,
   .isValidRegular = ab_isValidRegular,
   .isValidCF = ab_isValidCF,
   .desugar = desugar_ab,
   .compile_to_rvm = ab_ctrvm,
+  .visit = ab_visit,
 };
 
 
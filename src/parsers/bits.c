@@ -8,7 +8,7 @@ struct bits_env {
 
 static HParseResult* parse_bits(void* env, HParseState *state) {
   struct bits_env *env_ = env;
-  HParsedToken *result = a_new(HParsedToken, 1);
+  HParsedToken *result = a_new0(HParsedToken, 1);
   result->token_type = (env_->signedp ? TT_SINT : TT_UINT);
   if (env_->signedp)
     result->sint = h_read_bits(&state->input_stream, env_->length, true);
@@ -26,7 +26,7 @@ static HParsedToken *reshape_bits(const HParseResult *p, void* signedp_p) {
   assert(p->ast->token_type == TT_SEQUENCE);
 
   HCountedArray *seq = p->ast->seq;
-  HParsedToken *ret = h_arena_malloc(p->arena, sizeof(HParsedToken));
+  HParsedToken *ret = h_arena_malloc0(p->arena, sizeof(HParsedToken));
   ret->token_type = TT_UINT;
 
   if(signedp && (seq->elements[0]->uint & 128))
@@ -69,30 +69,21 @@ static void desugar_bits(HAllocator *mm__, HCFStack *stk__, void *env) {
   } HCFS_END_CHOICE();
 }
 
-static bool h_svm_action_bits(HArena *arena, HSVMContext *ctx, void* env) {
-  // BUG: relies un undefined behaviour: int64_t is a signed uint64_t; not necessarily true on 32-bit
-  struct bits_env *env_ = env;
-  HParsedToken *top = ctx->stack[ctx->stack_count-1];
-  assert(top->token_type == TT_BYTES);
-  uint64_t res = 0;
-  for (size_t i = 0; i < top->bytes.len; i++)
-    res = (res << 8) | top->bytes.token[i];   // TODO: Handle other endiannesses.
-  uint64_t msb = (env_->signedp ? 1LL:0) << (top->bytes.len * 8 - 1);
-  res = (res ^ msb) - msb;
-  top->uint = res; // possibly cast to signed through union
-  top->token_type = (env_->signedp ? TT_SINT : TT_UINT);
-  return true;
-}
-
+// The field starts where the last one left off, and its value is read
+// once the match is known. It ends where the next one, or else the next
+// byte insn, must start.
 static bool bits_ctrvm(HRVMProg *prog, void* env) {
   struct bits_env *env_ = (struct bits_env*)env;
-  h_rvm_insert_insn(prog, RVM_PUSH, 0);
-  for (size_t i=0; i < (env_->length/8); ++i) { // FUTURE: when we can handle non-byte-aligned, the env_->length/8 part will be different
+  if (env_->length == 0 || env_->length > 64)
+    return false;
+  size_t end = prog->bit_offset + env_->length; // in bits from the current byte
+  h_rvm_insert_insn(prog, RVM_BITS, H_RVM_BITS(prog->bit_offset, env_->length, env_->signedp));
+  prog->bit_offset = 0; // these MATCHes and STEPs go over whole bytes
+  for (size_t i = 0; i < end / 8; ++i) {
     h_rvm_insert_insn(prog, RVM_MATCH, 0xFF00);
     h_rvm_insert_insn(prog, RVM_STEP, 0);
   }
-  h_rvm_insert_insn(prog, RVM_CAPTURE, 0);
-  h_rvm_insert_insn(prog, RVM_ACTION, h_rvm_create_action(prog, h_svm_action_bits, env));
+  prog->bit_offset = end % 8;
   return true;
 }
 
@@ -35,11 +35,18 @@ static HParseResult* parse_butnot(void *env, HParseState *state) {
   }
 }
 
+static void butnot_visit(void *env, HParserVisitFn f, void *arg) {
+  HTwoParsers *parsers = (HTwoParsers*)env;
+  f(parsers->p1, arg);
+  f(parsers->p2, arg);
+}
+
 static const HParserVtable butnot_vt = {
   .parse = parse_butnot,
   .isValidRegular = h_false,
   .isValidCF = h_false, // XXX should this be true if both p1 and p2 are CF?
   .compile_to_rvm = h_not_regular,
+  .visit = butnot_visit,
 };
 
 HParser* h_butnot(const HParser* p1, const HParser* p2) {
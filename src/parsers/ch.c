@@ -6,7 +6,7 @@ static HParseResult* parse_ch(void* env, HParseState *state) {
   uint8_t c = (uint8_t)(unsigned long)(env);
   uint8_t r = (uint8_t)h_read_bits(&state->input_stream, 8, false);
   if (c == r) {
-    HParsedToken *tok = a_new(HParsedToken, 1);    
+    HParsedToken *tok = a_new0(HParsedToken, 1);    
     tok->token_type = TT_UINT; tok->uint = r;
     return make_result(state->arena, tok);
   } else {
@@ -8,7 +8,7 @@ static HParseResult* parse_charset(void *env, HParseState *state) {
   HCharset cs = (HCharset)env;
 
   if (charset_isset(cs, in)) {
-    HParsedToken *tok = a_new(HParsedToken, 1);
+    HParsedToken *tok = a_new0(HParsedToken, 1);
     tok->token_type = TT_UINT; tok->uint = in;
     return make_result(state->arena, tok);    
   } else
@@ -31,39 +31,29 @@ static bool h_svm_action_ch(HArena *arena, HSVMContext *ctx, void* env) {
   return true;
 }
 
-// FUTURE: this is horribly inefficient
 static bool cs_ctrvm(HRVMProg *prog, void *env) {
   HCharset cs = (HCharset)env;
   h_rvm_insert_insn(prog, RVM_PUSH, 0);
 
-  uint16_t start = h_rvm_get_ip(prog);
-
-  uint8_t range_start = 0;
-  bool collecting = false;
-  for (size_t i=0; i<257; ++i) {
-    // Position 256 is only there so that every included character has
-    // a non-included character after it.
-    if (i < 256 && charset_isset(cs, i)) {
-      if (!collecting) {
-	collecting = true;
-	range_start = i;
-      }
-    } else {
-      if (collecting) {
-	collecting = false;
-	uint16_t insn = h_rvm_insert_insn(prog, RVM_FORK, 0);
-	h_rvm_insert_insn(prog, RVM_MATCH, range_start | (i-1) << 8);
-	h_rvm_insert_insn(prog, RVM_GOTO, 0);
-	h_rvm_patch_arg(prog, insn, h_rvm_get_ip(prog));
+  // A single range (or none) is a plain MATCH; anything else is looked up
+  // in a bitmap.
+  size_t ranges = 0, lo = 0, hi = 0;
+  for (size_t i = 0; i < 256; ++i) {
+    if (charset_isset(cs, i)) {
+      if (i == 0 || !charset_isset(cs, i - 1)) {
+	ranges++;
+	lo = i;
       }
+      hi = i;
     }
   }
-  h_rvm_insert_insn(prog, RVM_MATCH, 0x00FF);
-  uint16_t jump = h_rvm_insert_insn(prog, RVM_STEP, 0);
-  for (size_t i=start; i<jump; ++i) {
-    if (RVM_GOTO == prog->insns[i].op)
-      h_rvm_patch_arg(prog, i, jump);
-  }
+  if (ranges == 0)
+    h_rvm_insert_insn(prog, RVM_MATCH, 0x00FF);
+  else if (ranges == 1)
+    h_rvm_insert_insn(prog, RVM_MATCH, lo | hi << 8);
+  else
+    h_rvm_insert_insn(prog, RVM_MATCH_SET, h_rvm_create_charset(prog, cs));
+  h_rvm_insert_insn(prog, RVM_STEP, 0);
 
   h_rvm_insert_insn(prog, RVM_CAPTURE, 0);
   h_rvm_insert_insn(prog, RVM_ACTION, h_rvm_create_action(prog, h_svm_action_ch, env));
@@ -53,28 +53,51 @@ static void desugar_choice(HAllocator *mm__, HCFStack *stk__, void *env) {
 
 static bool choice_ctrvm(HRVMProg *prog, void* env) {
   HSequence *s = (HSequence*)env;
-  uint16_t gotos[s->len];
-  for (size_t i=0; i<s->len; ++i) {
-    uint16_t insn = h_rvm_insert_insn(prog, RVM_FORK, 0);
-    if (!h_compile_regex(prog, s->p_array[i]))
+  uint32_t gotos[s->len];
+  size_t ngotos = 0;
+  // Every alternative starts at the same bit offset, and must end at the
+  // same one, too.
+  uint8_t start = prog->bit_offset, end = 0;
+  for (size_t i=0; i<s->len; ) {
+    prog->bit_offset = start;
+    uint32_t insn = h_rvm_insert_insn(prog, RVM_FORK, 0);
+    // A run of tokens becomes a single trie, rather than a thread each.
+    size_t n = h_tokens_ctrvm(prog, s->p_array + i, s->len - i);
+    if (n == 0) {
+      if (!h_compile_regex(prog, s->p_array[i]))
+	return false;
+      n = 1;
+    }
+    if (i > 0 && prog->bit_offset != end)
       return false;
-    gotos[i] = h_rvm_insert_insn(prog, RVM_GOTO, 65535);
+    end = prog->bit_offset;
+    i += n;
+    gotos[ngotos++] = h_rvm_insert_insn(prog, RVM_GOTO, 65535);
     h_rvm_patch_arg(prog, insn, h_rvm_get_ip(prog));
   }
+  prog->bit_offset = 0; // never matches, so it needn't be aligned
   h_rvm_insert_insn(prog, RVM_MATCH, 0x00FF); // fail.
-  uint16_t jump = h_rvm_get_ip(prog);
-  for (size_t i=0; i<s->len; ++i) {
+  prog->bit_offset = end;
+  uint32_t jump = h_rvm_get_ip(prog);
+  for (size_t i=0; i<ngotos; ++i) {
       h_rvm_patch_arg(prog, gotos[i], jump);
   }
   return true;
 }
 
+static void choice_visit(void *env, HParserVisitFn f, void *arg) {
+  HSequence *s = (HSequence*)env;
+  for (size_t i=0; i<s->len; ++i)
+    f(s->p_array[i], arg);
+}
+
 static const HParserVtable choice_vt = {
   .parse = parse_choice,
   .isValidRegular = choice_isValidRegular,
   .isValidCF = choice_isValidCF,
   .desugar = desugar_choice,
   .compile_to_rvm = choice_ctrvm,
+  .visit = choice_visit,
 };
 
 HParser* h_choice(HParser* p, ...) {
@@ -142,9 +165,5 @@ HParser* h_choice__ma(HAllocator* mm__, void *args[]) {
   }
 
   s->len = len;
-  HParser *ret = h_new(HParser, 1);
-  ret->vtable = &choice_vt; 
-  ret->env = (void*)s;
-  ret->backend = PB_MIN;
-  return ret;
+  return h_new_parser(mm__, &choice_vt, s);
 }
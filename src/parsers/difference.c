@@ -34,11 +34,18 @@ static HParseResult* parse_difference(void *env, HParseState *state) {
   }
 }
 
+static void difference_visit(void *env, HParserVisitFn f, void *arg) {
+  HTwoParsers *parsers = (HTwoParsers*)env;
+  f(parsers->p1, arg);
+  f(parsers->p2, arg);
+}
+
 static HParserVtable difference_vt = {
   .parse = parse_difference,
   .isValidRegular = h_false,
   .isValidCF = h_false, // XXX should this be true if both p1 and p2 are CF?
   .compile_to_rvm = h_not_regular,
+  .visit = difference_visit,
 };
 
 HParser* h_difference(const HParser* p1, const HParser* p2) {
@@ -97,12 +97,19 @@ static bool is_ctrvm(HRVMProg *prog, void* env) {
   return true;
 }
 
+static void is_visit(void *env, HParserVisitFn f, void *arg) {
+  HIgnoreSeq *seq = (HIgnoreSeq*)env;
+  for (size_t i=0; i<seq->len; ++i)
+    f(seq->parsers[i], arg);
+}
+
 static const HParserVtable ignoreseq_vt = {
   .parse = parse_ignoreseq,
   .isValidRegular = is_isValidRegular,
   .isValidCF = is_isValidCF,
   .desugar = desugar_ignoreseq,
   .compile_to_rvm = is_ctrvm,
+  .visit = is_visit,
 };
 
 
@@ -111,12 +111,17 @@ static bool ir_ctrvm(HRVMProg *prog, void *env) {
   return false;
 }
 
+static void ir_visit(void *env, HParserVisitFn f, void *arg) {
+  f(((HRange*)env)->p, arg);
+}
+
 static const HParserVtable int_range_vt = {
   .parse = parse_int_range,
   .isValidRegular = h_true,
   .isValidCF = h_true,
   .desugar = desugar_int_range,
   .compile_to_rvm = ir_ctrvm,
+  .visit = ir_visit,
 };
 
 HParser* h_int_range(const HParser *p, const int64_t lower, const int64_t upper) {
@@ -31,7 +31,7 @@ static HParseResult *parse_many(void* env, HParseState *state) {
     goto err;
  succ:
   ; // necessary for the label to be here...
-  HParsedToken *res = a_new(HParsedToken, 1);
+  HParsedToken *res = a_new0(HParsedToken, 1);
   res->token_type = TT_SEQUENCE;
   res->seq = seq;
   return make_result(state->arena, res);
@@ -112,11 +112,76 @@ static void desugar_many(HAllocator *mm__, HCFStack *stk__, void *env) {
   } HCFS_END_CHOICE();
 }
 
+// Up to this many rounds of h_repeat_n are compiled one after the other;
+// more, and they go round a counted loop.
+#define REPEAT_UNROLL_MAX 4
+
+// Between min and max rounds (see RVM_COUNT_LOOP), as a loop whose rounds
+// are counted:
+//        PUSH
+//        COUNT_PUSH b
+//        COUNT_LOOP b // with a separator, the first round skips it
+//        GOTO end
+//        GOTO mid
+//   nxt: COUNT_LOOP b
+//        GOTO end
+//        <SEP>
+//   mid: <ELEM>
+//        COUNT_INC b
+//        GOTO nxt
+//   end: COUNT_POP b
+//        ACTION make_sequence
+static bool counted_ctrvm(HRVMProg *prog, HRepeat *repeat, uint32_t min, uint32_t max) {
+  if (min > H_RVM_MAX_LENGTH || (max != H_RVM_UNBOUNDED && max > H_RVM_MAX_LENGTH))
+    return false; // far too many threads, in any case
+  uint32_t bounds = h_rvm_create_bounds(prog, min, max);
+  uint8_t bit_offset = prog->bit_offset; // as for many, below
+  uint32_t gotos_end[2], goto_mid = 0;
+  size_t ngotos = 0;
+  h_rvm_insert_insn(prog, RVM_PUSH, 0);
+  h_rvm_insert_insn(prog, RVM_COUNT_PUSH, bounds);
+  if (repeat->sep != NULL) {
+    h_rvm_insert_insn(prog, RVM_COUNT_LOOP, bounds);
+    gotos_end[ngotos++] = h_rvm_insert_insn(prog, RVM_GOTO, 0xFFFF);
+    goto_mid = h_rvm_insert_insn(prog, RVM_GOTO, 0xFFFF);
+  }
+  uint32_t nxt = h_rvm_insert_insn(prog, RVM_COUNT_LOOP, bounds);
+  gotos_end[ngotos++] = h_rvm_insert_insn(prog, RVM_GOTO, 0xFFFF);
+  if (repeat->sep != NULL) {
+    h_rvm_insert_insn(prog, RVM_PUSH, 0);
+    if (!h_compile_regex(prog, repeat->sep) || prog->bit_offset != bit_offset)
+      return false;
+    h_rvm_insert_insn(prog, RVM_ACTION, h_rvm_create_action(prog, h_svm_action_clear_to_mark, NULL));
+    h_rvm_patch_arg(prog, goto_mid, h_rvm_get_ip(prog));
+  }
+  if (!h_compile_regex(prog, repeat->p) || prog->bit_offset != bit_offset)
+    return false;
+  h_rvm_insert_insn(prog, RVM_COUNT_INC, bounds);
+  h_rvm_insert_insn(prog, RVM_GOTO, nxt);
+  for (size_t i = 0; i < ngotos; i++)
+    h_rvm_patch_arg(prog, gotos_end[i], h_rvm_get_ip(prog));
+  h_rvm_insert_insn(prog, RVM_COUNT_POP, bounds);
+  h_rvm_insert_insn(prog, RVM_ACTION, h_rvm_create_action(prog, h_svm_action_make_sequence, NULL));
+  return true;
+}
+
 static bool many_ctrvm(HRVMProg *prog, void *env) {
   HRepeat *repeat = (HRepeat*)env;
-  uint16_t clear_to_mark = h_rvm_create_action(prog, h_svm_action_clear_to_mark, NULL);
-  // TODO: implement min & max properly. Right now, it's always
-  // max==inf, min={0,1}
+  if (repeat->min_p && repeat->count >= 2)
+    return counted_ctrvm(prog, repeat, repeat->count, H_RVM_UNBOUNDED);
+  if (!repeat->min_p && repeat->count > REPEAT_UNROLL_MAX) {
+    // Unless the rounds don't all start at the same bit offset; then
+    // they are unrolled after all.
+    size_t length = prog->length;
+    uint8_t bit_offset = prog->bit_offset;
+    bool misaligned = prog->misaligned;
+    if (counted_ctrvm(prog, repeat, repeat->count, repeat->count))
+      return true;
+    prog->length = length;
+    prog->bit_offset = bit_offset;
+    prog->misaligned = misaligned;
+  }
+  uint32_t clear_to_mark = h_rvm_create_action(prog, h_svm_action_clear_to_mark, NULL);
 
   // Structure:
   // Min == 0:
@@ -127,22 +192,24 @@ static bool many_ctrvm(HRVMProg *prog, void *env) {
   //        FORK nxt
   //   end:
 
+  // Each element, and separator, must start where the one before did, at
+  // the same bit offset; with min == 0, so must whatever comes after.
+  uint8_t bit_offset = prog->bit_offset;
   if (repeat->min_p) {
   h_rvm_insert_insn(prog, RVM_PUSH, 0);
-    assert(repeat->count < 2); // TODO: The other cases should be supported later.
-    uint16_t end_fork = 0xFFFF; // Shut up GCC
+    uint32_t end_fork = 0xFFFF; // Shut up GCC
     if (repeat->count == 0)
       end_fork = h_rvm_insert_insn(prog, RVM_FORK, 0xFFFF);
-    uint16_t goto_mid = h_rvm_insert_insn(prog, RVM_GOTO, 0xFFFF);
-    uint16_t nxt = h_rvm_get_ip(prog);
+    uint32_t goto_mid = h_rvm_insert_insn(prog, RVM_GOTO, 0xFFFF);
+    uint32_t nxt = h_rvm_get_ip(prog);
     if (repeat->sep != NULL) {
       h_rvm_insert_insn(prog, RVM_PUSH, 0);
-      if (!h_compile_regex(prog, repeat->sep))
+      if (!h_compile_regex(prog, repeat->sep) || prog->bit_offset != bit_offset)
 	return false;
       h_rvm_insert_insn(prog, RVM_ACTION, clear_to_mark);
     }
     h_rvm_patch_arg(prog, goto_mid, h_rvm_get_ip(prog));
-    if (!h_compile_regex(prog, repeat->p))
+    if (!h_compile_regex(prog, repeat->p) || prog->bit_offset != bit_offset)
       return false;
     h_rvm_insert_insn(prog, RVM_FORK, nxt);
     if (repeat->count == 0)
@@ -167,12 +234,20 @@ static bool many_ctrvm(HRVMProg *prog, void *env) {
   }
 }
 
+static void many_visit(void *env, HParserVisitFn f, void *arg) {
+  HRepeat *repeat = (HRepeat*)env;
+  f(repeat->p, arg);
+  if (repeat->sep != NULL)
+    f(repeat->sep, arg);
+}
+
 static const HParserVtable many_vt = {
   .parse = parse_many,
   .isValidRegular = many_isValidRegular,
   .isValidCF = many_isValidCF,
   .desugar = desugar_many,
   .compile_to_rvm = many_ctrvm,
+  .visit = many_visit,
 };
 
 HParser* h_many(const HParser* p) {
@@ -257,10 +332,17 @@ static HParseResult* parse_length_value(void *env, HParseState *state) {
   return parse_many(&repeat, state);
 }
 
+static void lv_visit(void *env, HParserVisitFn f, void *arg) {
+  HLenVal *lv = (HLenVal*)env;
+  f(lv->length, arg);
+  f(lv->value, arg);
+}
+
 static const HParserVtable length_value_vt = {
   .parse = parse_length_value,
   .isValidRegular = h_false,
   .isValidCF = h_false,
+  .visit = lv_visit,
 };
 
 HParser* h_length_value(const HParser* length, const HParser* value) {
@@ -7,7 +7,7 @@ static HParseResult* parse_optional(void* env, HParseState* state) {
   if (res0)
     return res0;
   state->input_stream = bak;
-  HParsedToken *ast = a_new(HParsedToken, 1);
+  HParsedToken *ast = a_new0(HParsedToken, 1);
   ast->token_type = TT_NONE;
   return make_result(state->arena, ast);
 }
@@ -32,7 +32,7 @@ static HParsedToken* reshape_optional(const HParseResult *p, void* user_data) {
       return res;
   }
 
-  HParsedToken *ret = h_arena_malloc(p->arena, sizeof(HParsedToken));
+  HParsedToken *ret = h_arena_malloc0(p->arena, sizeof(HParsedToken));
   ret->token_type = TT_NONE;
   return ret;
 }
@@ -69,9 +69,11 @@ static bool h_svm_action_optional(HArena *arena, HSVMContext *ctx, void *env) {
 
 static bool opt_ctrvm(HRVMProg *prog, void* env) {
   h_rvm_insert_insn(prog, RVM_PUSH, 0);
-  uint16_t insn = h_rvm_insert_insn(prog, RVM_FORK, 0);
+  uint32_t insn = h_rvm_insert_insn(prog, RVM_FORK, 0);
   HParser *p = (HParser*) env;
-  if (!h_compile_regex(prog, p))
+  uint8_t bit_offset = prog->bit_offset;
+  // Skipping p must leave us where matching it would.
+  if (!h_compile_regex(prog, p) || prog->bit_offset != bit_offset)
     return false;
   h_rvm_patch_arg(prog, insn, h_rvm_get_ip(prog));
   h_rvm_insert_insn(prog, RVM_ACTION, h_rvm_create_action(prog, h_svm_action_optional, NULL));
@@ -84,6 +86,7 @@ static const HParserVtable optional_vt = {
   .isValidCF = opt_isValidCF,
   .desugar = desugar_optional,
   .compile_to_rvm = opt_ctrvm,
+  .visit = h_visit_env_parser,
 };
 
 HParser* h_optional(const HParser* p) {
@@ -12,11 +12,13 @@
 
 #define a_new_(arena, typ, count) ((typ*)h_arena_malloc((arena), sizeof(typ)*(count)))
 #define a_new(typ, count) a_new_(state->arena, typ, count)
-// we can create a_new0 if necessary. It would allocate some memory and immediately zero it out.
+#define a_new0_(arena, typ, count) ((typ*)h_arena_malloc0((arena), sizeof(typ)*(count)))
+#define a_new0(typ, count) a_new0_(state->arena, typ, count)
 
 static inline HParseResult* make_result(HArena *arena, HParsedToken *tok) {
   HParseResult *ret = h_arena_malloc(arena, sizeof(HParseResult));
   ret->ast = tok;
+  ret->bit_length = 0;
   ret->arena = arena;
   return ret;
 }
@@ -30,6 +32,17 @@ static inline size_t token_length(HParseResult *pr) {
   }
 }
 
+/* Compiles the h_tokens that ps starts with into one trie, for the regex
+ * backend, if there are at least two of them and none is a prefix of
+ * another: then at most one can match, and which alternative it was makes
+ * no difference. Returns how many parsers that covered; 0 if it didn't
+ * apply, and nothing was emitted. */
+size_t h_tokens_ctrvm(HRVMProg *prog, HParser *const *ps, size_t n);
+
+/* A parser that always fails; there is one, shared, and not in hammer.h. */
+const HParser* h_unimplemented(void);
+const HParser* h_unimplemented__m(HAllocator* mm__);
+
 /* Epsilon rules happen during desugaring. This handles them. */
 static inline void desugar_epsilon(HAllocator *mm__, HCFStack *stk__, void *env) {
   HCFS_BEGIN_CHOICE() {
@@ -20,7 +20,7 @@ static HParseResult* parse_sequence(void *env, HParseState *state) {
 	h_carray_append(seq, (void*)tmp->ast);
     }
   }
-  HParsedToken *tok = a_new(HParsedToken, 1);
+  HParsedToken *tok = a_new0(HParsedToken, 1);
   tok->token_type = TT_SEQUENCE; tok->seq = seq;
   return make_result(state->arena, tok);
 }
@@ -87,12 +87,19 @@ static bool sequence_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static void sequence_visit(void *env, HParserVisitFn f, void *arg) {
+  HSequence *s = (HSequence*)env;
+  for (size_t i=0; i<s->len; ++i)
+    f(s->p_array[i], arg);
+}
+
 static const HParserVtable sequence_vt = {
   .parse = parse_sequence,
   .isValidRegular = sequence_isValidRegular,
   .isValidCF = sequence_isValidCF,
   .desugar = desugar_sequence,
   .compile_to_rvm = sequence_ctrvm,
+  .visit = sequence_visit,
 };
 
 HParser* h_sequence(HParser* p, ...) {
@@ -159,9 +166,5 @@ HParser* h_sequence__ma(HAllocator* mm__, void *args[]) {
   }
 
   s->len = len;
-  HParser *ret = h_new(HParser, 1);
-  ret->vtable = &sequence_vt; 
-  ret->env = (void*)s; 
-  ret->backend = PB_MIN;
-  return ret;
+  return h_new_parser(mm__, &sequence_vt, s);
 }
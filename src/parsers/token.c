@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include "parser_internal.h"
 
 typedef struct {
@@ -14,7 +16,7 @@ static HParseResult* parse_token(void *env, HParseState *state) {
       return NULL;
     }
   }
-  HParsedToken *tok = a_new(HParsedToken, 1);
+  HParsedToken *tok = a_new0(HParsedToken, 1);
   tok->token_type = TT_BYTES; tok->bytes.token = t->str; tok->bytes.len = t->len;
   return make_result(state->arena, tok);
 }
@@ -36,7 +38,7 @@ static HParsedToken *reshape_token(const HParseResult *p, void* user_data) {
   }
 
   // create result token
-  HParsedToken *tok = h_arena_malloc(p->arena, sizeof(HParsedToken));
+  HParsedToken *tok = h_arena_malloc0(p->arena, sizeof(HParsedToken));
   tok->token_type = TT_BYTES;
   tok->bytes.len = seq->used;
   tok->bytes.token = arr;
@@ -67,6 +69,56 @@ static bool token_ctrvm(HRVMProg *prog, void *env) {
   return true;
 }
 
+static int token_cmp(const void *a, const void *b) {
+  const HToken *ta = *(HToken *const *)a, *tb = *(HToken *const *)b;
+  int cmp = memcmp(ta->str, tb->str, ta->len < tb->len ? ta->len : tb->len);
+  return cmp ? cmp : (int)ta->len - (int)tb->len;
+}
+
+// The trie below the node for the first depth bytes of toks, which they
+// share. Every token's last byte is stepped over by the same STEP, so that
+// they all end in the same thread; the jumps there are added to ends.
+static void trie_ctrvm(HRVMProg *prog, HToken **toks, size_t n, size_t depth,
+		       uint32_t *ends, size_t *nends) {
+  if (n == 1) {
+    for (size_t i = depth; i < toks[0]->len; i++) {
+      h_rvm_insert_insn(prog, RVM_MATCH, toks[0]->str[i] | toks[0]->str[i] << 8);
+      if (i + 1 < toks[0]->len)
+	h_rvm_insert_insn(prog, RVM_STEP, 0);
+    }
+    ends[(*nends)++] = h_rvm_insert_insn(prog, RVM_GOTO, 0);
+    return;
+  }
+  // No token ends here, since none is a prefix of another.
+  HAllocator *mm__ = prog->allocator;
+  HCharset cs = new_charset(mm__);
+  size_t nchildren = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0 || toks[i]->str[depth] != toks[i-1]->str[depth]) {
+      charset_set(cs, toks[i]->str[depth], 1);
+      nchildren++;
+    }
+  }
+  h_rvm_insert_insn(prog, RVM_SWITCH, h_rvm_create_charset(prog, cs));
+  h_free(cs);
+  uint32_t table = h_rvm_get_ip(prog);
+  for (size_t i = 0; i < nchildren; i++)
+    h_rvm_insert_insn(prog, RVM_GOTO, 0);
+  for (size_t i = 0, child = 0; i < n; child++) {
+    size_t j = i + 1;
+    while (j < n && toks[j]->str[depth] == toks[i]->str[depth])
+      j++;
+    if (j == i + 1 && toks[i]->len == depth + 1) {
+      ends[(*nends)++] = table + child; // this byte ends the token
+    } else {
+      h_rvm_patch_arg(prog, table + child, h_rvm_get_ip(prog));
+      h_rvm_insert_insn(prog, RVM_STEP, 0);
+      trie_ctrvm(prog, toks + i, j - i, depth + 1, ends, nends);
+    }
+    i = j;
+  }
+}
+
 const HParserVtable token_vt = {
   .parse = parse_token,
   .isValidRegular = h_true,
@@ -75,6 +127,37 @@ const HParserVtable token_vt = {
   .compile_to_rvm = token_ctrvm,
 };
 
+size_t h_tokens_ctrvm(HRVMProg *prog, HParser *const *ps, size_t n) {
+  size_t run = 0;
+  while (run < n && ps[run]->vtable == &token_vt)
+    run++;
+  if (run < 2)
+    return 0;
+  HAllocator *mm__ = prog->allocator;
+  HToken **toks = h_new(HToken*, run);
+  for (size_t i = 0; i < run; i++)
+    toks[i] = ps[i]->env;
+  qsort(toks, run, sizeof(HToken*), token_cmp);
+  // Sorted, a token that is a prefix of any other is one of the next.
+  for (size_t i = 0; i + 1 < run; i++) {
+    if (toks[i]->len <= toks[i+1]->len && memcmp(toks[i]->str, toks[i+1]->str, toks[i]->len) == 0) {
+      h_free(toks);
+      return 0;
+    }
+  }
+  uint32_t *ends = h_new(uint32_t, run);
+  size_t nends = 0;
+  h_rvm_insert_insn(prog, RVM_PUSH, 0);
+  trie_ctrvm(prog, toks, run, 0, ends, &nends);
+  uint32_t step = h_rvm_insert_insn(prog, RVM_STEP, 0);
+  h_rvm_insert_insn(prog, RVM_CAPTURE, 0);
+  for (size_t i = 0; i < nends; i++)
+    h_rvm_patch_arg(prog, ends[i], step);
+  h_free(ends);
+  h_free(toks);
+  return run;
+}
+
 HParser* h_token(const uint8_t *str, const size_t len) {
   return h_token__m(&system_allocator, str, len);
 }
@@ -22,7 +22,8 @@ static const HParserVtable unimplemented_vt = {
 
 static HParser unimplemented = {
   .vtable = &unimplemented_vt,
-  .env = NULL
+  .env = NULL,
+  .id = H_PARSER_ID_UNIMPLEMENTED
 };
 
 const HParser* h_unimplemented() {
@@ -51,8 +51,8 @@ static bool ws_isValidCF(void *env) {
 
 static bool ws_ctrvm(HRVMProg *prog, void *env) {
   HParser *p = (HParser*)env;
-  uint16_t start = h_rvm_get_ip(prog);
-  uint16_t next;
+  uint32_t start = h_rvm_get_ip(prog);
+  uint32_t next;
 
   uint16_t ranges[2] = {
     0x0d09,
@@ -75,6 +75,7 @@ static const HParserVtable whitespace_vt = {
   .isValidCF = ws_isValidCF,
   .desugar = desugar_whitespace,
   .compile_to_rvm = ws_ctrvm,
+  .visit = h_visit_env_parser,
 };
 
 HParser* h_whitespace(const HParser* p) {
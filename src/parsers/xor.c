@@ -31,11 +31,18 @@ static HParseResult* parse_xor(void *env, HParseState *state) {
   }
 }
 
+static void xor_visit(void *env, HParserVisitFn f, void *arg) {
+  HTwoParsers *parsers = (HTwoParsers*)env;
+  f(parsers->p1, arg);
+  f(parsers->p2, arg);
+}
+
 static const HParserVtable xor_vt = {
   .parse = parse_xor,
   .isValidRegular = h_false,
   .isValidCF = h_false, // XXX should this be true if both p1 and p2 are CF?
   .compile_to_rvm = h_not_regular,
+  .visit = xor_visit,
 };
 
 HParser* h_xor(const HParser* p1, const HParser* p2) {
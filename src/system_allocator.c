@@ -4,32 +4,36 @@
 
 //#define DEBUG__MEMFILL 0xFF
 
+// The size is stored in front of each block, padded so that the block
+// keeps malloc's alignment.
+#define BLOCK_HEADER sizeof(HMaxAlign)
+
 static void* system_alloc(HAllocator *allocator, size_t size) {
   
-  void* ptr = malloc(size + sizeof(size_t));
+  void* ptr = malloc(size + BLOCK_HEADER);
 #ifdef DEBUG__MEMFILL
-  memset(ptr, DEBUG__MEMFILL, size + sizeof(size_t));
+  memset(ptr, DEBUG__MEMFILL, size + BLOCK_HEADER);
 #endif
   *(size_t*)ptr = size;
-  return ptr + sizeof(size_t);
+  return ptr + BLOCK_HEADER;
 }
 
 static void* system_realloc(HAllocator *allocator, void* ptr, size_t size) {
   if (ptr == NULL)
     return system_alloc(allocator, size);
-  ptr = realloc(ptr - sizeof(size_t), size + sizeof(size_t));
+  ptr = realloc(ptr - BLOCK_HEADER, size + BLOCK_HEADER);
   *(size_t*)ptr = size;
 #ifdef DEBUG__MEMFILL
   size_t old_size = *(size_t*)ptr;
   if (size > old_size)
-    memset(ptr+sizeof(size_t)+old_size, DEBUG__MEMFILL, size - old_size);
+    memset(ptr+BLOCK_HEADER+old_size, DEBUG__MEMFILL, size - old_size);
 #endif
-  return ptr + sizeof(size_t);
+  return ptr + BLOCK_HEADER;
 }
 
 static void system_free(HAllocator *allocator, void* ptr) {
   if (ptr != NULL)
-    free(ptr - sizeof(size_t));
+    free(ptr - BLOCK_HEADER);
 }
 
 HAllocator system_allocator = {
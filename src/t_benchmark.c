@@ -1,7 +1,17 @@
 #include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "hammer.h"
+#include "internal.h"
+#include "backends/regex.h"
+#include "backends/llk.h"
 #include "test_suite.h"
 
+extern void h_benchmark_clock_gettime(struct timespec *ts);
+
 HParserTestcase testcases[] = {
   {(unsigned char*)"1,2,3", 5, "(u0x31 u0x32 u0x33)"},
   {(unsigned char*)"1,3,2", 5, "(u0x31 u0x33 u0x32)"},
@@ -17,6 +27,418 @@ static void test_benchmark_1() {
   h_benchmark_report(stderr, res);
 }
 
+static int64_t parse_time_ns(const HParser *parser, const uint8_t *input, size_t length) {
+  struct timespec ts_start, ts_end;
+  h_benchmark_clock_gettime(&ts_start);
+  HParseResult *res = h_parse(parser, input, length);
+  h_benchmark_clock_gettime(&ts_end);
+  if (!res) {
+    g_test_message("Parse failed on input of length %zu", length);
+    g_test_fail();
+  }
+  h_parse_result_free(res);
+  return (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+}
+
+// Packrat parse time should grow linearly with the input; with a fixed-size
+// memo table it used to grow quadratically.
+static void test_benchmark_packrat_linear() {
+  HParser *parser = h_sepBy1(h_choice(h_ch('1'), h_ch('2'), h_ch('3'), NULL), h_ch(','));
+  const size_t max_len = 1 << 20;
+  uint8_t *input = malloc(max_len);
+  for (size_t i = 0; i < max_len; i++)
+    input[i] = (i % 2) ? ',' : '1' + (i / 2) % 3;
+
+  h_compile(parser, PB_PACKRAT, NULL);
+  for (size_t len = 1 << 14; len <= max_len; len <<= 1) {
+    int64_t ns = parse_time_ns(parser, input, len - 1); // must end on a digit
+    fprintf(stderr, "packrat, %7zu bytes: %10" PRId64 " ns, %6.1f ns/byte\n",
+            len, ns, (double)ns / len);
+  }
+  free(input);
+}
+
+// Allocation-heavy: every input byte becomes a token, a sequence and a
+// result, so the time is dominated by the arena. Kept to 64k because the
+// LR backends build (and flatten) one nested sequence per element.
+static void test_benchmark_arena() {
+  HParser *parser = h_many(h_sequence(h_ch_range('a', 'z'), h_optional(h_ch(',')), NULL));
+  const size_t len = 1 << 16;
+  uint8_t *input = malloc(len);
+  for (size_t i = 0; i < len; i++)
+    input[i] = (i % 2) ? ',' : 'a' + (i / 2) % 26;
+
+  const HParserBackend backends[] = { PB_PACKRAT, PB_LALR };
+  const char *names[] = { "packrat", "lalr" };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    h_compile(parser, backends[i], NULL);
+    int64_t best = INT64_MAX;
+    for (int round = 0; round < 20; round++) {
+      int64_t ns = parse_time_ns(parser, input, len);
+      if (ns < best)
+        best = ns;
+    }
+    fprintf(stderr, "arena, %-7s %7zu bytes: %10" PRId64 " ns, %6.1f ns/byte\n",
+            names[i], len, best, (double)best / len);
+  }
+  free(input);
+}
+
+typedef struct {
+  HAllocator *mm__;
+  const HParser *parser;
+  const uint8_t *input;
+  size_t length;
+  int parses;
+} HParseWorker;
+
+static void *parse_worker(void *arg) {
+  const HParseWorker *w = arg;
+  for (int i = 0; i < w->parses; i++) {
+    HParseResult *res = h_parse__m(w->mm__, w->parser, w->input, w->length);
+    if (!res)
+      return (void*)1;
+    h_parse_result_free(res);
+  }
+  return NULL;
+}
+
+// Independent parses of short messages on N threads: how well do the
+// allocators scale? Each parse takes a few blocks and gives them back.
+static void test_benchmark_threads() {
+  HParser *parser = h_sepBy1(h_choice(h_ch('1'), h_ch('2'), h_ch('3'), NULL), h_ch(','));
+  h_compile(parser, PB_PACKRAT, NULL);
+  const size_t len = 63;
+  const int parses = 20000;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  HAllocator *allocators[] = { &system_allocator, h_thread_cache_allocator() };
+  const char *names[] = { "system", "thread cache" };
+
+  for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); a++) {
+    for (int nthreads = 1; nthreads <= 2 * ncpus && nthreads <= 64; nthreads *= 2) {
+      HParseWorker workers[64];
+      pthread_t threads[64];
+      struct timespec ts_start, ts_end;
+      bool ok = true;
+      clock_gettime(CLOCK_MONOTONIC, &ts_start); // wall time, not this thread's
+      for (int i = 0; i < nthreads; i++) {
+        uint8_t *input = malloc(len); // each thread its own buffer
+        for (size_t j = 0; j < len; j++)
+          input[j] = (j % 2) ? ',' : '1' + (j / 2 + i) % 3;
+        workers[i] = (HParseWorker){ allocators[a], parser, input, len, parses };
+        pthread_create(&threads[i], NULL, parse_worker, &workers[i]);
+      }
+      for (int i = 0; i < nthreads; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        ok &= (ret == NULL);
+        free((void*)workers[i].input);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &ts_end);
+      if (!ok)
+        g_test_fail();
+      int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+      fprintf(stderr, "threads, %-12s %2d threads: %7.0f parses/s\n",
+              names[a], nthreads, nthreads * parses * 1e9 / ns);
+    }
+  }
+}
+
+// Request lines through the regex backend. Without a parse context, each
+// parse builds its own DFA, so short inputs spend most of their time in the
+// RVM interpreter; with one, the DFA is reused and the interpreter only runs
+// to replay the accepting path.
+static void test_benchmark_regex() {
+  const uint8_t path_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789/._-";
+  HParser *method = h_choice(h_token((const uint8_t*)"GET", 3), h_token((const uint8_t*)"POST", 4),
+                             h_token((const uint8_t*)"PUT", 3), NULL);
+  HParser *line = h_sequence(method, h_ch(' '), h_many1(h_in(path_chars, sizeof(path_chars) - 1)),
+                             h_ch(' '), h_token((const uint8_t*)"HTTP/1.1", 8), h_ch('\n'), NULL);
+  HParser *parser = h_many1(line);
+  if (h_compile(parser, PB_REGULAR, NULL)) {
+    g_test_fail();
+    return;
+  }
+  const char *req = "GET /static/img/logo-2x.png HTTP/1.1\nPOST /api/v1/items HTTP/1.1\n";
+  const size_t short_len = strlen(req), long_len = 1 << 16;
+  uint8_t *input = malloc(long_len);
+  for (size_t i = 0; i < long_len; i++)
+    input[i] = req[i % short_len];
+  const size_t lens[] = { short_len, long_len - long_len % short_len };
+  const int parses[] = { 20000, 20 };
+
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+    for (int use_ctx = 0; use_ctx < 2; use_ctx++) {
+      struct timespec ts_start, ts_end;
+      h_benchmark_clock_gettime(&ts_start);
+      for (int i = 0; i < parses[l]; i++) {
+        HParseResult *res = use_ctx ? h_parse_ctx_parse(ctx, parser, input, lens[l])
+                                    : h_parse(parser, input, lens[l]);
+        if (!res) {
+          g_test_fail();
+          break;
+        }
+        if (!use_ctx)
+          h_parse_result_free(res);
+      }
+      h_benchmark_clock_gettime(&ts_end);
+      int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+      fprintf(stderr, "regex, %-10s %6zu bytes: %10.0f ns/parse\n",
+              use_ctx ? "ctx" : "no ctx", lens[l], (double)ns / parses[l]);
+    }
+  }
+  h_parse_ctx_free(ctx);
+  free(input);
+}
+
+// A table of 10000 tokens, a trie of about 22k insns: compiling, then parsing.
+static void test_benchmark_regex_large() {
+  // Sequences, not bare tokens, which the token trie would fold into a
+  // switch: the program must stay longer than 65535 insns. Much more input
+  // outgrows the DFA, and the NFA runs a thread per alternative.
+  const size_t ntokens = 10000, len = 1 << 10;
+  void **alts = malloc((ntokens + 1) * sizeof(void*));
+  for (size_t i = 0; i < ntokens; i++) {
+    char str[5];
+    snprintf(str, sizeof(str), "%04zx", i * 6);
+    alts[i] = h_sequence(h_ch(str[0]), h_token((const uint8_t*)str + 1, 3), NULL);
+  }
+  alts[ntokens] = NULL;
+  HParser *parser = h_many1(h_choice__a(alts));
+  free(alts);
+  uint8_t *input = malloc(len + 1);
+  for (size_t i = 0; i < len; i += 4)
+    snprintf((char*)input + i, 5, "%04zx", (i * 7919 % ntokens) * 6);
+
+  struct timespec ts_start, ts_end;
+  h_benchmark_clock_gettime(&ts_start);
+  int err = h_compile(parser, PB_REGULAR, NULL);
+  h_benchmark_clock_gettime(&ts_end);
+  if (err) {
+    g_test_fail();
+    free(input);
+    return;
+  }
+  int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+  size_t insns = ((HRVMProg*)parser->backend_data)->length;
+  fprintf(stderr, "regex large, compile %zu insns: %10" PRId64 " ns\n", insns, ns);
+  if (insns <= 65535)
+    g_test_fail();
+
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (int use_ctx = 0; use_ctx < 2; use_ctx++) {
+    int64_t best = INT64_MAX;
+    for (int round = 0; round < 3; round++) {
+      h_benchmark_clock_gettime(&ts_start);
+      HParseResult *res = use_ctx ? h_parse_ctx_parse(ctx, parser, input, len)
+                                  : h_parse(parser, input, len);
+      h_benchmark_clock_gettime(&ts_end);
+      if (!res || res->bit_length != (int64_t)len * 8)
+        g_test_fail();
+      if (!use_ctx)
+        h_parse_result_free(res);
+      ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+      if (ns < best)
+        best = ns;
+    }
+    fprintf(stderr, "regex large, %-6s %6zu bytes: %10" PRId64 " ns, %6.1f ns/byte\n",
+            use_ctx ? "ctx" : "no ctx", len, best, (double)best / len);
+  }
+  h_parse_ctx_free(ctx);
+  free(input);
+}
+
+static bool count_match(const HRVMMatch *match, void *env) {
+  (*(size_t*)env)++;
+  return true;
+}
+
+// Finding every match in a log, with h_rvm_find_all and with h_parse tried
+// at each offset. An error code starts with one byte, which memchr finds;
+// a duration, with any digit.
+static void test_benchmark_regex_scan() {
+  HParser *digits = h_many1(h_ch_range('0', '9'));
+  HParser *parsers[] = {
+    h_sequence(h_token((const uint8_t*)"ERROR code=", 11), digits, NULL),
+    h_sequence(digits, h_token((const uint8_t*)"ms", 2), NULL),
+  };
+  const char *names[] = { "error code", "duration" };
+  const size_t len = 1 << 16;
+  uint8_t *input = malloc(len + 64);
+  size_t n = 0;
+  for (int line = 0; n < len; line++) {
+    n += snprintf((char*)input + n, 64, line % 50 ? "12:00:%02d INFO served in %dms\n"
+                  : "12:00:%02d ERROR code=%d\n", line % 60, line % 1000);
+  }
+
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (size_t i = 0; i < sizeof(parsers) / sizeof(parsers[0]); i++) {
+    if (h_compile(parsers[i], PB_REGULAR, NULL)) {
+      g_test_fail();
+      break;
+    }
+    struct timespec ts_start, ts_end;
+    size_t found = 0;
+    h_benchmark_clock_gettime(&ts_start);
+    h_rvm_find_all(ctx, parsers[i]->backend_data, input, len, count_match, &found);
+    h_benchmark_clock_gettime(&ts_end);
+    int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+    fprintf(stderr, "regex scan, %-10s find_all: %6zu matches, %10" PRId64 " ns, %6.1f ns/byte\n",
+            names[i], found, ns, (double)ns / len);
+
+    size_t parsed = 0;
+    h_benchmark_clock_gettime(&ts_start);
+    for (size_t off = 0; off <= len; ) {
+      HParseResult *res = h_parse_ctx_parse(ctx, parsers[i], input + off, len - off);
+      if (!res) {
+        off++;
+        continue;
+      }
+      parsed++;
+      off += res->bit_length > 0 ? res->bit_length / 8 : 1;
+    }
+    h_benchmark_clock_gettime(&ts_end);
+    ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+    fprintf(stderr, "regex scan, %-10s h_parse:  %6zu matches, %10" PRId64 " ns, %6.1f ns/byte\n",
+            names[i], parsed, ns, (double)ns / len);
+    if (found != parsed)
+      g_test_fail();
+  }
+  h_parse_ctx_free(ctx);
+  free(input);
+}
+
+// LL(k) parsing, where "POST" and "PUT" take two bytes of lookahead to tell
+// apart. Every byte is a prediction or more, so this times the table.
+static void test_benchmark_llk() {
+  const uint8_t path_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789/._-";
+  HParser *method = h_choice(h_token((const uint8_t*)"GET", 3), h_token((const uint8_t*)"POST", 4),
+                             h_token((const uint8_t*)"PUT", 3), NULL);
+  HParser *line = h_sequence(method, h_ch(' '), h_many1(h_in(path_chars, sizeof(path_chars) - 1)),
+                             h_ch(' '), h_token((const uint8_t*)"HTTP/1.1", 8), h_ch('\n'), NULL);
+  HParser *parser = h_many1(line);
+  if (h_compile(parser, PB_LLk, (void*)2)) {
+    g_test_fail();
+    return;
+  }
+  const char *req = "GET /static/img/logo-2x.png HTTP/1.1\nPOST /api/v1/items HTTP/1.1\n"
+                    "PUT /api/v1/items/42 HTTP/1.1\n";
+  const size_t short_len = strlen(req), long_len = 1 << 16;
+  uint8_t *input = malloc(long_len);
+  for (size_t i = 0; i < long_len; i++)
+    input[i] = req[i % short_len];
+  const size_t len = long_len - long_len % short_len;
+
+  HParseCtx *ctx = h_parse_ctx_new();
+  int64_t best = INT64_MAX;
+  for (int round = 0; round < 5; round++) {
+    struct timespec ts_start, ts_end;
+    h_benchmark_clock_gettime(&ts_start);
+    HParseResult *res = h_parse_ctx_parse(ctx, parser, input, len);
+    h_benchmark_clock_gettime(&ts_end);
+    if (!res) {
+      g_test_fail();
+      break;
+    }
+    int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+    if (ns < best)
+      best = ns;
+  }
+  fprintf(stderr, "llk, k=2, %6zu bytes: %10" PRId64 " ns, %6.1f ns/byte\n",
+          len, best, (double)best / len);
+
+  // the same, as it would come off a TCP connection
+  const size_t mss = 1460;
+  best = INT64_MAX;
+  for (int round = 0; round < 5; round++) {
+    struct timespec ts_start, ts_end;
+    h_benchmark_clock_gettime(&ts_start);
+    HLLkRun *run = h_llk_start(ctx, parser);
+    for (size_t off = 0; off < len; off += mss)
+      h_llk_feed(run, input + off, len - off < mss ? len - off : mss);
+    HParseResult *res = h_llk_finish(run);
+    h_benchmark_clock_gettime(&ts_end);
+    if (!res) {
+      g_test_fail();
+      break;
+    }
+    int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+    if (ns < best)
+      best = ns;
+  }
+  fprintf(stderr, "llk, k=2, %6zu bytes in %zu-byte chunks: %10" PRId64 " ns, %6.1f ns/byte\n",
+          len, mss, best, (double)best / len);
+  h_parse_ctx_free(ctx);
+  free(input);
+}
+
+// The LR backends on the grammars of their tests: the expression grammar
+// of test_lalr, left-recursive, and the request lines of the regex
+// benchmark. Each input byte is a table lookup or two.
+static void test_benchmark_lalr() {
+  HParser *n = h_ch('n');
+  HParser *E = h_indirect();
+  HParser *T = h_choice(h_sequence(h_ch('('), E, h_ch(')'), NULL), n, NULL);
+  h_bind_indirect(E, h_choice(h_sequence(E, h_ch('-'), T, NULL), T, NULL));
+
+  const uint8_t path_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789/._-";
+  HParser *method = h_choice(h_token((const uint8_t*)"GET", 3), h_token((const uint8_t*)"POST", 4),
+                             h_token((const uint8_t*)"PUT", 3), NULL);
+  HParser *line = h_sequence(method, h_ch(' '), h_many1(h_in(path_chars, sizeof(path_chars) - 1)),
+                             h_ch(' '), h_token((const uint8_t*)"HTTP/1.1", 8), h_ch('\n'), NULL);
+
+  HParser *parsers[] = { E, h_many1(line) };
+  const char *names[] = { "expr", "requests" };
+  const char *heads[] = { "n", "" };  // each input is a head and then units
+  const char *units[] = { "-(n-((n)))", "GET /static/img/logo-2x.png HTTP/1.1\nPOST /api/v1/items HTTP/1.1\n" };
+  const HParserBackend backends[] = { PB_LALR, PB_GLR };
+  const char *bnames[] = { "lalr", "glr" };
+  const size_t max_len = 1 << 14;
+  uint8_t *input = malloc(max_len);
+
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (size_t i = 0; i < sizeof(parsers) / sizeof(parsers[0]); i++) {
+    size_t hlen = strlen(heads[i]), ulen = strlen(units[i]);
+    size_t len = max_len - (max_len - hlen) % ulen;
+    memcpy(input, heads[i], hlen);
+    for (size_t j = hlen; j < len; j++)
+      input[j] = units[i][(j - hlen) % ulen];
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+      if (h_compile(parsers[i], backends[b], NULL)) {
+        g_test_fail();
+        continue;
+      }
+      int64_t best = INT64_MAX;
+      for (int round = 0; round < 5; round++) {
+        struct timespec ts_start, ts_end;
+        h_benchmark_clock_gettime(&ts_start);
+        HParseResult *res = h_parse_ctx_parse(ctx, parsers[i], input, len);
+        h_benchmark_clock_gettime(&ts_end);
+        if (!res) {
+          g_test_fail();
+          break;
+        }
+        int64_t ns = (ts_end.tv_sec - ts_start.tv_sec) * 1000000000 + (ts_end.tv_nsec - ts_start.tv_nsec);
+        if (ns < best)
+          best = ns;
+      }
+      fprintf(stderr, "%-4s %-8s %6zu bytes: %10" PRId64 " ns, %6.1f ns/byte\n",
+              bnames[b], names[i], len, best, (double)best / len);
+    }
+  }
+  h_parse_ctx_free(ctx);
+  free(input);
+}
+
 void register_benchmark_tests(void) {
   g_test_add_func("/core/benchmark/1", test_benchmark_1);
+  g_test_add_func("/core/benchmark/packrat_linear", test_benchmark_packrat_linear);
+  g_test_add_func("/core/benchmark/arena", test_benchmark_arena);
+  g_test_add_func("/core/benchmark/threads", test_benchmark_threads);
+  g_test_add_func("/core/benchmark/regex", test_benchmark_regex);
+  g_test_add_func("/core/benchmark/regex_large", test_benchmark_regex_large);
+  g_test_add_func("/core/benchmark/regex_scan", test_benchmark_regex_scan);
+  g_test_add_func("/core/benchmark/llk", test_benchmark_llk);
+  g_test_add_func("/core/benchmark/lalr", test_benchmark_lalr);
 }
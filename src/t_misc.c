@@ -1,7 +1,9 @@
 #include <glib.h>
+#include <pthread.h>
 #include <string.h>
 #include "test_suite.h"
 #include "hammer.h"
+#include "internal.h"
 
 static void test_tt_user(void) {
   g_check_cmp_int32(TT_USER, >, TT_NONE);
@@ -29,7 +31,313 @@ static void test_tt_registry(void) {
   g_check_cmp_int32(h_get_token_type_number("com.upstandinghackers.test.unkown_token_type"), ==, -1);
 }
 
+static void test_hashtable_grow(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HHashTable *ht = h_hashtable_new(arena, h_eq_ptr, h_hash_ptr);
+  const size_t n = 10000;
+
+  for (uintptr_t i = 1; i <= n; i++) {
+    h_hashtable_put(ht, (void*)(i << 4), (void*)i);
+    // everything inserted so far must stay visible while rehashing
+    if (i % 97 == 0) {
+      for (uintptr_t j = 1; j <= i; j++)
+        g_check_cmp_uint64((uintptr_t)h_hashtable_get(ht, (void*)(j << 4)), ==, j);
+    }
+  }
+  g_check_hashtable_size(ht, n);
+  g_check_cmp_uint64(ht->capacity, >, n);
+
+  for (uintptr_t i = 1; i <= n; i += 2)
+    h_hashtable_del(ht, (void*)(i << 4));
+  g_check_hashtable_size(ht, n / 2);
+  g_check_hashtable_absent(ht, (void*)(1 << 4));
+  g_check_hashtable_present(ht, (void*)(2 << 4));
+
+  size_t count = 0;
+  H_FOREACH(ht, void *key, void *value)
+    g_check_cmp_uint64((uintptr_t)key, ==, (uintptr_t)value << 4);
+    count++;
+  H_END_FOREACH
+  g_check_cmp_uint64(count, ==, n / 2);
+
+  // sets with the same elements compare equal regardless of their history
+  HHashSet *a = h_hashset_new(arena, h_eq_ptr, h_hash_ptr);
+  HHashSet *b = h_hashset_new(arena, h_eq_ptr, h_hash_ptr);
+  for (uintptr_t i = 1; i <= 100; i++)
+    h_hashset_put(a, (void*)(i << 4));
+  for (uintptr_t i = 1000; i > 0; i--)
+    h_hashset_put(b, (void*)(i << 4));
+  for (uintptr_t i = 101; i <= 1000; i++)
+    h_hashset_del(b, (void*)(i << 4));
+  g_check_cmp_int32(h_hashset_equal(a, b), ==, true);
+  h_hashset_del(b, (void*)(50 << 4));
+  g_check_cmp_int32(h_hashset_equal(a, b), ==, false);
+
+  h_delete_arena(arena);
+}
+
+// few distinct values, to force long probe sequences
+static HHashValue hash_mod7(const void *p) {
+  return (uintptr_t)p % 7;
+}
+
+static void test_opentable(void) {
+  HArena *arena = h_new_arena(&system_allocator, 0);
+  HOpenTable *ht = h_opentable_new(arena, h_eq_ptr, hash_mod7);
+  const uintptr_t n = 1000;
+
+  for (uintptr_t i = 1; i <= n; i++)
+    h_opentable_put(ht, (void*)i, (void*)(i * 2));
+  g_check_cmp_uint64(ht->used, ==, n);
+
+  // delete every third key; the rest must stay reachable
+  for (uintptr_t i = 3; i <= n; i += 3)
+    h_opentable_del(ht, (void*)i);
+  for (uintptr_t i = 1; i <= n; i++) {
+    if (i % 3 == 0)
+      g_check_cmp_int32(h_opentable_present(ht, (void*)i), ==, false);
+    else
+      g_check_cmp_uint64((uintptr_t)h_opentable_get(ht, (void*)i), ==, i * 2);
+  }
+  g_check_cmp_uint64(ht->used, ==, n - n / 3);
+
+  size_t count = 0;
+  H_OPENTABLE_FOREACH(ht, void *key, void *value)
+    g_check_cmp_uint64((uintptr_t)value, ==, (uintptr_t)key * 2);
+    count++;
+  H_OPENTABLE_END_FOREACH
+  g_check_cmp_uint64(count, ==, n - n / 3);
+
+  h_delete_arena(arena);
+}
+
+// system_allocator, counting the calls that reach it
+static size_t counted_allocs;
+static void* counting_alloc(HAllocator *allocator, size_t size) {
+  counted_allocs++;
+  return system_allocator.alloc(&system_allocator, size);
+}
+static void* counting_realloc(HAllocator *allocator, void *ptr, size_t size) {
+  counted_allocs++;
+  return system_allocator.realloc(&system_allocator, ptr, size);
+}
+static void counting_free(HAllocator *allocator, void *ptr) {
+  system_allocator.free(&system_allocator, ptr);
+}
+static HAllocator counting_allocator = {
+  .alloc = counting_alloc,
+  .realloc = counting_realloc,
+  .free = counting_free,
+};
+
+static void test_arena_reset(void) {
+  HArena *arena = h_new_arena(&counting_allocator, 256);
+  for (int i = 0; i < 100; i++)
+    memset(h_arena_malloc(arena, 100), 0xAA, 100);
+  h_arena_malloc(arena, 1000); // dedicated block, always released
+
+  h_arena_reset(arena, 10);
+  HArenaStats stats;
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.used, ==, 0);
+
+  // the kept blocks serve the next round without the allocator
+  counted_allocs = 0;
+  for (int i = 0; i < 20; i++) {
+    uint8_t *p = h_arena_malloc0(arena, 100);
+    for (int j = 0; j < 100; j++)
+      g_check_cmp_int32(p[j], ==, 0);
+  }
+  g_check_cmp_uint64(counted_allocs, ==, 0);
+  h_arena_malloc(arena, 200);
+  g_check_cmp_uint64(counted_allocs, ==, 1);
+
+  h_delete_arena(arena);
+}
+
+static void test_arena_align(void) {
+  HArena *arena = h_new_arena(&system_allocator, 1024);
+  for (size_t size = 0; size <= 256; size++) {
+    void *p = h_arena_malloc(arena, size);
+    g_check_cmp_uint64((uintptr_t)p % H_MAX_ALIGN, ==, 0);
+  }
+  HArenaStats stats;
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.used, ==, 256 * 257 / 2);
+  g_check_cmp_uint64(stats.large_blocks, ==, 0);
+  g_check_cmp_uint64(stats.padding, >, 0);
+  g_check_cmp_uint64(stats.padding + stats.slack, <=, stats.wasted);
+  g_check_cmpdouble(stats.fragmentation, <=, 0.25);
+
+  // doesn't fit, but the current block still has room: it stays current
+  h_arena_reset(arena, 1);
+  h_arena_malloc(arena, 100);
+  h_arena_malloc(arena, 1000);
+  h_arena_malloc(arena, 5000);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.blocks, ==, 1);
+  g_check_cmp_uint64(stats.large_blocks, ==, 2);
+  h_arena_malloc(arena, 900);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.blocks, ==, 1);
+  g_check_cmp_uint64(stats.large_blocks, ==, 2);
+  h_delete_arena(arena);
+}
+
+static void test_arena_growth(void) {
+  HArena *arena = h_new_arena(&counting_allocator, 0);
+  counted_allocs = 0;
+  for (int i = 0; i < 80000; i++)
+    h_arena_malloc(arena, 100); // 8.75 MB in size classes
+  // 4k, 8k, ... 1M, then 1M blocks
+  g_check_cmp_uint64(counted_allocs, <, 20);
+  HArenaStats stats;
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.blocks, ==, counted_allocs + 1);
+  for (int i = 12; i < 20; i++)
+    g_check_cmp_uint64(stats.block_histogram[i], ==, 1);
+  g_check_cmp_uint64(stats.block_histogram[20], ==, stats.blocks - 8);
+  h_delete_arena(arena);
+
+  // a fixed block size stays fixed, until a cap is set
+  arena = h_new_arena(&system_allocator, 4096);
+  for (int i = 0; i < 1000; i++)
+    h_arena_malloc(arena, 100);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.block_histogram[12], ==, stats.blocks);
+  h_arena_set_max_block_size(arena, 16384);
+  for (int i = 0; i < 1000; i++)
+    h_arena_malloc(arena, 100);
+  h_allocator_stats(arena, &stats);
+  g_check_cmp_uint64(stats.block_histogram[13], ==, 1);
+  g_check_cmp_uint64(stats.block_histogram[14], >, 1);
+  g_check_cmp_uint64(stats.block_histogram[15], ==, 0);
+  h_delete_arena(arena);
+}
+
+static void test_parse_ctx(void) {
+  HParser *p = h_sepBy1(h_choice(h_ch('1'), h_ch('2'), h_many1(h_ch('3')), NULL), h_ch(','));
+  const char *input = "1,2,33,1,333,2,1";
+  const HParserBackend backends[] = { PB_PACKRAT, PB_LLk, PB_LALR, PB_GLR };
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+    g_check_cmp_int32(h_compile(p, backends[i], NULL), ==, 0);
+    HParseResult *res = h_parse(p, (const uint8_t*)input, strlen(input));
+    char *expected = h_write_result_unamb(res->ast);
+    h_parse_result_free(res);
+
+    HParseCtx *ctx = h_parse_ctx_new__m(&counting_allocator);
+    for (int round = 0; round < 3; round++) {
+      counted_allocs = 0;
+      res = h_parse_ctx_parse(ctx, p, (const uint8_t*)input, strlen(input));
+      // once the context has warmed up, parsing needs no allocator calls
+      if (round > 0)
+	g_check_cmp_uint64(counted_allocs, ==, 0);
+      char *actual = h_write_result_unamb(res->ast);
+      g_check_string(actual, ==, expected);
+      free(actual);
+      g_check_failed(h_parse_ctx_parse(ctx, p, (const uint8_t*)"x", 1));
+    }
+    h_parse_ctx_free(ctx);
+    free(expected);
+  }
+
+  // backends that keep something in the context take turns with it
+  HParser *q = h_many1(h_ch_range('0', '9'));
+  g_check_cmp_int32(h_compile(q, PB_REGULAR, NULL), ==, 0);
+  g_check_cmp_int32(h_compile(p, PB_LLk, NULL), ==, 0);
+  HParser *parsers[] = { p, q, p, q };
+  const char *inputs[] = { input, "1234", input, "1234" };
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (size_t i = 0; i < sizeof(parsers) / sizeof(parsers[0]); i++) {
+    HParseResult *res = h_parse(parsers[i], (const uint8_t*)inputs[i], strlen(inputs[i]));
+    char *expected = h_write_result_unamb(res->ast);
+    h_parse_result_free(res);
+    res = h_parse_ctx_parse(ctx, parsers[i], (const uint8_t*)inputs[i], strlen(inputs[i]));
+    char *actual = h_write_result_unamb(res->ast);
+    g_check_string(actual, ==, expected);
+    free(actual);
+    free(expected);
+  }
+  h_parse_ctx_free(ctx);
+}
+
+static void *free_blocks(void *arg) {
+  void **blocks = arg;
+  HAllocator *mm__ = h_thread_cache_allocator();
+  for (int i = 0; i < 8; i++)
+    h_free(blocks[i]);
+  return NULL;
+}
+
+static void *alloc_blocks(void *arg) {
+  void **blocks = arg;
+  HAllocator *mm__ = h_thread_cache_allocator();
+  for (int i = 0; i < 8; i++)
+    memset(blocks[i] = mm__->alloc(mm__, 4096 + 32 * i), i, 4096);
+  return NULL;
+}
+
+static void *parse_sepBy(void *arg) {
+  HParser *p = arg;
+  HParseResult *res = h_parse__m(h_thread_cache_allocator(), p, (const uint8_t*)"1,2,3", 5);
+  return res;
+}
+
+static void test_thread_cache_allocator(void) {
+  HAllocator *mm__ = h_thread_cache_allocator();
+  void *blocks[8];
+  pthread_t thread;
+
+  // freed on another thread, back in our cache
+  for (int i = 0; i < 8; i++)
+    blocks[i] = mm__->alloc(mm__, 4096 + 32);
+  pthread_create(&thread, NULL, free_blocks, blocks);
+  pthread_join(thread, NULL);
+  void *again = mm__->alloc(mm__, 4096);
+  bool reused = false;
+  for (int i = 0; i < 8; i++)
+    reused |= (again == blocks[i]);
+  g_check_cmp_int32(reused, ==, true);
+  h_free(again);
+
+  // allocated on a thread that has since exited
+  pthread_create(&thread, NULL, alloc_blocks, blocks);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < 8; i++) {
+    g_check_cmp_int32(((uint8_t*)blocks[i])[4095], ==, i);
+    h_free(blocks[i]);
+  }
+
+  // parse on several threads, free the results on this one
+  HParser *p = h_sepBy1(h_choice(h_ch('1'), h_ch('2'), h_ch('3'), NULL), h_ch(','));
+  g_check_cmp_int32(h_compile(p, PB_PACKRAT, NULL), ==, 0);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, parse_sepBy, p);
+  for (int i = 0; i < 4; i++) {
+    HParseResult *res;
+    pthread_join(threads[i], (void**)&res);
+    if (!res) {
+      g_test_message("Parse failed on thread %d", i);
+      g_test_fail();
+      continue;
+    }
+    char *cres = h_write_result_unamb(res->ast);
+    g_check_string(cres, ==, "(u0x31 u0x32 u0x33)");
+    free(cres);
+    h_parse_result_free(res);
+  }
+}
+
 void register_misc_tests(void) {
   g_test_add_func("/core/misc/tt_user", test_tt_user);
   g_test_add_func("/core/misc/tt_registry", test_tt_registry);
+  g_test_add_func("/core/misc/hashtable_grow", test_hashtable_grow);
+  g_test_add_func("/core/misc/opentable", test_opentable);
+  g_test_add_func("/core/misc/arena_reset", test_arena_reset);
+  g_test_add_func("/core/misc/arena_align", test_arena_align);
+  g_test_add_func("/core/misc/arena_growth", test_arena_growth);
+  g_test_add_func("/core/misc/parse_ctx", test_parse_ctx);
+  g_test_add_func("/core/misc/thread_cache_allocator", test_thread_cache_allocator);
 }
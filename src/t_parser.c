@@ -4,6 +4,8 @@
 #include "internal.h"
 #include "test_suite.h"
 #include "parsers/parser_internal.h"
+#include "backends/regex.h"
+#include "backends/llk.h"
 
 static void test_token(gconstpointer backend) {
   const HParser *token_ = h_token((const uint8_t*)"95\xa2", 3);
@@ -226,6 +228,16 @@ static void test_not_in(gconstpointer backend) {
 
 }
 
+static void test_in_scattered(gconstpointer backend) {
+  uint8_t options[5] = { 0x00, '0', '5', 'z', 0xff };
+  const HParser *in_ = h_many1(h_in(options, 5));
+  g_check_parse_match(in_, (HParserBackend)GPOINTER_TO_INT(backend), "\x00" "5z\xff" "0", 5, "(u0 u0x35 u0x7a u0xff u0x30)");
+  g_check_parse_failed(in_, (HParserBackend)GPOINTER_TO_INT(backend), "1", 1);
+  const HParser *not_in_ = h_many1(h_not_in(options, 5));
+  g_check_parse_match(not_in_, (HParserBackend)GPOINTER_TO_INT(backend), "\x01" "4{\xfe", 4, "(u0x1 u0x34 u0x7b u0xfe)");
+  g_check_parse_failed(not_in_, (HParserBackend)GPOINTER_TO_INT(backend), "5", 1);
+}
+
 static void test_end_p(gconstpointer backend) {
   const HParser *end_p_ = h_sequence(h_ch('a'), h_end_p(), NULL);
   g_check_parse_match(end_p_, (HParserBackend)GPOINTER_TO_INT(backend), "a", 1, "(u0x61)");
@@ -440,9 +452,661 @@ static void test_ambiguous(gconstpointer backend) {
   g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d", 1, "(u0x64)");
   g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d", 3, "(u0x64 u0x2b u0x64)");
   g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d+d", 5, "(u0x64 u0x2b u0x64 u0x2b u0x64)");
+  g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d+d+d", 7, "(u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64)");
+  g_check_parse_match(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+d+d+d+d+d", 11, "(u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64 u0x2b u0x64)");
   g_check_parse_failed(expr_, (HParserBackend)GPOINTER_TO_INT(backend), "d+", 2);
 }
 
+// Engines forked deep in the input share the stack below the fork.
+static void test_glr_forks(gconstpointer backend) {
+  HParser *A_ = h_indirect();
+  HParser *B_ = h_indirect();
+  HParser *S_ = h_indirect();
+  h_bind_indirect(A_, h_choice(h_sequence(A_, h_ch('a'), NULL), h_ch('a'), NULL));
+  h_bind_indirect(B_, h_choice(h_sequence(B_, h_ch('a'), NULL), h_ch('a'), NULL));
+  h_bind_indirect(S_, h_choice(h_sequence(h_ch('('), S_, h_ch(')'), NULL),
+                               h_sequence(A_, h_ch('x'), NULL),
+                               h_sequence(B_, h_ch('y'), NULL), NULL));
+  HParser *p_ = h_action(S_, h_act_flatten, NULL);
+
+  // (((...aaa x...))), deeper than a stack segment
+  const size_t depth = 50, as = 3, len = 2 * depth + as + 1;
+  char input[2 * 50 + 3 + 1 + 1], expect[7 * (2 * 50 + 3 + 1) + 1];
+  char *q = expect, *x = NULL;
+  *q++ = '(';
+  for (size_t i = 0; i < len; i++) {
+    input[i] = (i < depth)? '(' : (i < depth + as)? 'a' : (i == depth + as)? 'x' : ')';
+    q += sprintf(q, (i == 0)? "u0x%02x" : " u0x%02x", input[i]);
+    if (i == depth + as)
+      x = q - 1;
+  }
+  strcpy(q, ")");
+  input[len] = '\0';
+  g_check_parse_match(p_, (HParserBackend)GPOINTER_TO_INT(backend), input, len, expect);
+
+  input[depth + as] = 'y';
+  *x = '9';   // u0x78 -> u0x79
+  g_check_parse_match(p_, (HParserBackend)GPOINTER_TO_INT(backend), input, len, expect);
+
+  input[depth + as] = 'z';
+  g_check_parse_failed(p_, (HParserBackend)GPOINTER_TO_INT(backend), input, len);
+}
+
+// An LR table's default reductions must still leave the errors to be found,
+// the one after a whole expression too.
+static void test_lr_errors(gconstpointer backend) {
+  HParser *n_ = h_ch('n');
+  HParser *E_ = h_indirect();
+  HParser *T_ = h_choice(h_sequence(h_ch('('), E_, h_ch(')'), NULL), n_, NULL);
+  h_bind_indirect(E_, h_choice(h_sequence(E_, h_ch('-'), T_, NULL), T_, NULL));
+
+  g_check_parse_match(E_, (HParserBackend)GPOINTER_TO_INT(backend), "n-(n)", 5, "(u0x6e u0x2d (u0x28 u0x6e u0x29))");
+  g_check_parse_failed(E_, (HParserBackend)GPOINTER_TO_INT(backend), "nn", 2);
+  g_check_parse_failed(E_, (HParserBackend)GPOINTER_TO_INT(backend), "(n)n", 4);
+  g_check_parse_failed(E_, (HParserBackend)GPOINTER_TO_INT(backend), "n-(n-((n)))n", 12);
+  g_check_parse_failed(E_, (HParserBackend)GPOINTER_TO_INT(backend), "n)", 2);
+  g_check_parse_failed(E_, (HParserBackend)GPOINTER_TO_INT(backend), "n-", 2);
+}
+
+// The dense packrat memo must not change what a parser returns.
+static void check_dense_memo(HParser *p, const char *input, size_t len) {
+  h_compile(p, PB_PACKRAT, NULL);
+  HParseResult *res = h_parse(p, (const uint8_t*)input, len);
+  char *expected = res ? h_write_result_unamb(res->ast) : NULL;
+  h_parse_result_free(res);
+
+  h_compile(p, PB_PACKRAT, (void*)H_PACKRAT_DENSE_MEMO);
+  g_check_cmp_int32(p->backend_data != NULL, ==, 1);
+  res = h_parse(p, (const uint8_t*)input, len);
+  if (!expected) {
+    g_check_failed(res);
+  } else if (!res) {
+    g_test_message("Dense memo parse failed on \"%s\"", input);
+    g_test_fail();
+  } else {
+    char *cres = h_write_result_unamb(res->ast);
+    g_check_string(cres, ==, expected);
+    free(cres);
+    free(expected);
+    h_parse_result_free(res);
+  }
+  h_compile(p, PB_PACKRAT, NULL);
+}
+
+static void test_packrat_dense_memo(void) {
+  HParser *not_ = h_sequence(h_ch('a'),
+			     h_choice(h_sequence(h_ch('+'), h_not(h_ch('+')), NULL),
+				      h_token((const uint8_t*)"++", 2),
+				      NULL), h_ch('b'), NULL);
+  check_dense_memo(not_, "a+b", 3);
+  check_dense_memo(not_, "a++b", 4);
+  check_dense_memo(not_, "a+++b", 5);
+
+  HParser *rr_ = h_indirect();
+  h_bind_indirect(rr_, h_choice(h_sequence(h_ch('a'), rr_, NULL), h_epsilon_p(), NULL));
+  check_dense_memo(rr_, "aaaa", 4);
+
+  HParser *lr_ = h_indirect();
+  h_bind_indirect(lr_, h_choice(h_sequence(lr_, h_ch('+'), h_ch('d'), NULL), h_ch('d'), NULL));
+  check_dense_memo(lr_, "d+d+d", 5);
+  check_dense_memo(lr_, "d+d+", 4);
+
+  // nibbles leave the input off byte boundaries, where the hash memo is used
+  HParser *bits_ = h_sepBy1(h_choice(h_bits(4, false), h_ch('x'), NULL), h_ch(','));
+  check_dense_memo(bits_, "ab,x", 4);
+
+  HParser *sep_ = h_sepBy(h_many1(h_ch_range('0', '9')), h_ch(','));
+  check_dense_memo(sep_, "1,22,333,4444", 13);
+  check_dense_memo(sep_, "1,22,,4444", 10);
+}
+
+// Compiling p for packrat, with either memo, must not change what it
+// returns on input; p must not have been compiled yet.
+static void check_compiled_memo(HParser *p, const char *input, size_t len) {
+  HParseResult *res = h_parse(p, (const uint8_t*)input, len);
+  char *expected = res ? h_write_result_unamb(res->ast) : NULL;
+  int64_t bits = res ? res->bit_length : 0;
+  h_parse_result_free(res);
+
+  const void *params[] = { NULL, (void*)H_PACKRAT_DENSE_MEMO };
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    h_compile(p, PB_PACKRAT, params[i]);
+    g_check_cmp_int32(p->backend_data != NULL, ==, 1);
+    res = h_parse(p, (const uint8_t*)input, len);
+    if (!expected) {
+      g_check_failed(res);
+    } else if (!res) {
+      g_test_message("Compiled parse failed on \"%s\"", input);
+      g_test_fail();
+    } else {
+      char *cres = h_write_result_unamb(res->ast);
+      g_check_string(cres, ==, expected);
+      g_check_cmp_int64(res->bit_length, ==, bits);
+      free(cres);
+      h_parse_result_free(res);
+    }
+  }
+  free(expected);
+}
+
+// The memo tells parsers apart by id, so no two may share one.
+static void test_packrat_ids(void) {
+  HParser *e_ = h_indirect();
+  g_check_cmp_uint32(e_->id, >=, H_PARSER_FIRST_ID);
+  g_check_cmp_uint32(h_unimplemented()->id, ==, H_PARSER_ID_UNIMPLEMENTED);
+  h_bind_indirect(e_, h_choice(h_sequence(e_, h_ch('+'), h_ch('a'), NULL), h_ch('a'),
+			       h_sequence(h_ch('!'), (HParser*)h_unimplemented(), NULL), NULL));
+  check_compiled_memo(e_, "a+a", 3);
+  check_compiled_memo(e_, "!x", 2);
+}
+
+static void test_packrat_shared_id(void) {
+  HParser *a_ = h_ch('a'), *b_ = h_ch('b');
+  b_->id = a_->id;
+  h_set_memoize(a_, H_MEMO_ALWAYS);
+  h_set_memoize(b_, H_MEMO_ALWAYS);
+  HParser *p_ = h_choice(a_, b_, NULL);
+  check_compiled_memo(p_, "b", 1);
+  check_compiled_memo(p_, "a", 1);
+}
+
+// A parser the table never saw is memoized as uncompiled, even if its id
+// is one the table has: here a left-recursive rule, bound in only after
+// compiling, has the ids of leaves that the table bypasses all round its
+// cycle, which would otherwise recurse without end.
+static HParser *unseen_id_grammar(const void *params) {
+  HParser *c_ = h_ch('c'), *d_ = h_ch('d'), *e_ = h_ch('e');
+  HParser *hole_ = h_indirect();
+  h_bind_indirect(hole_, h_ch('d'));
+  HParser *p_ = h_sequence(c_, d_, e_, hole_, NULL);
+  if (params)
+    h_compile(p_, PB_PACKRAT, *(const void**)params);
+
+  HParser *lr_ = h_indirect();
+  HParser *seq_ = h_sequence(lr_, h_ch('+'), h_ch('d'), NULL);
+  HParser *alt_ = h_choice(seq_, h_ch('d'), NULL);
+  h_bind_indirect(lr_, alt_);
+  lr_->id = c_->id;
+  seq_->id = d_->id;
+  alt_->id = e_->id;
+  h_bind_indirect(hole_, lr_);
+  return p_;
+}
+
+static void test_packrat_unseen_id(void) {
+  HParseResult *res = h_parse(unseen_id_grammar(NULL), (const uint8_t*)"cded+d", 6);
+  g_check_cmp_int32(res != NULL, ==, 1);
+  char *expected = h_write_result_unamb(res->ast);
+  int64_t bits = res->bit_length;
+  h_parse_result_free(res);
+
+  const void *params[] = { NULL, (void*)H_PACKRAT_DENSE_MEMO };
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    HParser *p_ = unseen_id_grammar(&params[i]);
+    g_check_cmp_int32(p_->backend_data != NULL, ==, 1);
+    res = h_parse(p_, (const uint8_t*)"cded+d", 6);
+    g_check_cmp_int32(res != NULL, ==, 1);
+    char *cres = h_write_result_unamb(res->ast);
+    g_check_string(cres, ==, expected);
+    g_check_cmp_int64(res->bit_length, ==, bits);
+    free(cres);
+    h_parse_result_free(res);
+  }
+  free(expected);
+}
+
+static HParsedToken* count_calls(const HParseResult *p, void *user_data) {
+  (*(int*)user_data)++;
+  return (HParsedToken*)p->ast;
+}
+
+static void test_packrat_selective_memo(void) {
+  int calls = 0;
+  HParser *x_ = h_action(h_many1(h_ch('x')), count_calls, &calls);
+  HParser *p_ = h_choice(h_sequence(x_, h_ch('a'), NULL),
+			 h_sequence(x_, h_ch('b'), NULL), NULL);
+
+  // x_ is reached from both alternatives, so the second one finds it memoized
+  g_check_parse_match(p_, PB_PACKRAT, "xxb", 3, "((u0x78 u0x78) u0x62)");
+  g_check_cmp_int32(calls, ==, 1);
+
+  calls = 0;
+  h_set_memoize(x_, H_MEMO_NEVER);
+  g_check_parse_match(p_, PB_PACKRAT, "xxb", 3, "((u0x78 u0x78) u0x62)");
+  g_check_cmp_int32(calls, ==, 2);
+
+  // recursive parsers are memoized regardless
+  HParser *lr_ = h_indirect();
+  h_bind_indirect(lr_, h_choice(h_sequence(lr_, h_ch('+'), h_ch('d'), NULL), h_ch('d'), NULL));
+  h_set_memoize(lr_, H_MEMO_NEVER);
+  g_check_parse_ok(lr_, PB_PACKRAT, "d+d", 3);
+}
+
+// Parses each input with p under packrat, then under backend: once without
+// a parse context, then twice over through one. Checks that they agree.
+static void check_like_packrat(HParser *p, HParserBackend backend, const void *params,
+                               const char **inputs, size_t n) {
+  char *expected[n];
+  h_compile(p, PB_PACKRAT, NULL);
+  for (size_t i = 0; i < n; i++) {
+    HParseResult *res = h_parse(p, (const uint8_t*)inputs[i], strlen(inputs[i]));
+    expected[i] = res ? h_write_result_unamb(res->ast) : NULL;
+    h_parse_result_free(res);
+  }
+  g_check_cmp_int32(h_compile(p, backend, params), ==, 0);
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (int round = 0; round < 3; round++) {
+    for (size_t i = 0; i < n; i++) {
+      const uint8_t *input = (const uint8_t*)inputs[i];
+      HParseResult *res = round ? h_parse_ctx_parse(ctx, p, input, strlen(inputs[i]))
+                                : h_parse(p, input, strlen(inputs[i]));
+      if (!expected[i] || !res) {
+	if (expected[i] || res) {
+	  g_test_message("Parse of \"%s\" disagrees with packrat", inputs[i]);
+	  g_test_fail();
+	}
+      } else {
+	char *cres = h_write_result_unamb(res->ast);
+	g_check_string(cres, ==, expected[i]);
+	free(cres);
+      }
+      if (!round)
+	h_parse_result_free(res);
+    }
+  }
+  h_parse_ctx_free(ctx);
+  for (size_t i = 0; i < n; i++)
+    free(expected[i]);
+}
+
+// Predictions that need more than one byte of lookahead, or the end of the
+// input after some.
+static void test_llk_lookahead(void) {
+  HParser *x_ = h_optional(h_ch('x'));
+  HParser *y_ = h_sequence(h_ch('y'), h_ch('y'), NULL);
+  HParser *p_ = h_choice(h_sequence(x_, y_, h_ch('a'), NULL), h_sequence(y_, h_ch('b'), NULL), NULL);
+  const char *inputs[] = { "xyya", "yya", "yyb", "xyyb", "yyx", "yy", "y", "" };
+  g_check_cmp_int32(h_compile(p_, PB_LLk, (void *)2), !=, 0);
+  check_like_packrat(p_, PB_LLk, (void *)3, inputs, sizeof(inputs) / sizeof(inputs[0]));
+
+  HParser *q_ = h_choice(h_sequence(h_ch('a'), h_end_p(), NULL),
+			 h_sequence(h_ch('a'), h_ch('b'), NULL), NULL);
+  const char *qinputs[] = { "a", "ab", "ac", "abc", "" };
+  check_like_packrat(q_, PB_LLk, (void *)2, qinputs, sizeof(qinputs) / sizeof(qinputs[0]));
+
+  HParser *r_ = h_sequence(h_many(h_choice(h_token((const uint8_t*)"GET", 3),
+					   h_token((const uint8_t*)"PUT", 3),
+					   h_token((const uint8_t*)"POST", 4),
+					   h_token((const uint8_t*)"PATCH", 5),
+					   h_token((const uint8_t*)"xa", 2),
+					   h_token((const uint8_t*)"xb", 2),
+					   NULL)),
+			   h_end_p(), NULL);
+  const char *rinputs[] = { "GETPUTPOSTPATCHxaxb", "PATCH", "PAT", "GE", "",
+			    "POSTxa", "xbxaGET", "PUTT", "P" };
+  check_like_packrat(r_, PB_LLk, (void *)2, rinputs, sizeof(rinputs) / sizeof(rinputs[0]));
+}
+
+// A backend's runs, that take the input a chunk at a time.
+typedef struct HStreamOps_ {
+  void *(*start)(HParseCtx *ctx, HParser *p);
+  bool (*feed)(void *run, const uint8_t *chunk, size_t len);
+  HParseResult *(*finish)(void *run);
+  bool keeps_chunks;    // until finish, so they mustn't change before then
+} HStreamOps;
+
+// Parses each input with p, compiled for the backend of ops, in chunks of
+// every size, and checks that it agrees with h_parse. Runs with odd sizes go
+// through a parse context. Unless the backend keeps them, chunks are copied
+// into a buffer that is scribbled over once it has been fed.
+static void check_stream(HParser *p, const HStreamOps *ops, const char **inputs, size_t n) {
+  HParseCtx *ctx = h_parse_ctx_new();
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *input = (const uint8_t*)inputs[i];
+    size_t len = strlen(inputs[i]);
+    HParseResult *res = h_parse(p, input, len);
+    char *expected = res ? h_write_result_unamb(res->ast) : NULL;
+    h_parse_result_free(res);
+    for (size_t size = 1; size <= len + 1; size++) {
+      uint8_t buf[size];
+      bool use_ctx = size % 2;
+      void *run = ops->start(use_ctx ? ctx : NULL, p);
+      for (size_t off = 0; off < len; off += size) {
+	size_t m = len - off < size ? len - off : size;
+	const uint8_t *chunk = input + off;
+	if (!ops->keeps_chunks)
+	  chunk = memcpy(buf, chunk, m);
+	bool over = ops->feed(run, chunk, m);
+	if (!ops->keeps_chunks)
+	  memset(buf, 0, m);
+	if (over)
+	  break;
+      }
+      res = ops->finish(run);
+      if (!expected || !res) {
+	if (expected || res) {
+	  g_test_message("Parse of \"%s\" in chunks of %zu disagrees with h_parse", inputs[i], size);
+	  g_test_fail();
+	}
+      } else {
+	char *cres = h_write_result_unamb(res->ast);
+	g_check_string(cres, ==, expected);
+	free(cres);
+      }
+      if (!use_ctx)
+	h_parse_result_free(res);
+    }
+    free(expected);
+  }
+  h_parse_ctx_free(ctx);
+}
+
+static void *llk_stream_start(HParseCtx *ctx, HParser *p) {
+  return h_llk_start(ctx, p);
+}
+static bool llk_stream_feed(void *run, const uint8_t *chunk, size_t len) {
+  return h_llk_feed(run, chunk, len);
+}
+static HParseResult *llk_stream_finish(void *run) {
+  return h_llk_finish(run);
+}
+static const HStreamOps llk_stream = {
+  llk_stream_start, llk_stream_feed, llk_stream_finish, false
+};
+
+static void *rvm_stream_start(HParseCtx *ctx, HParser *p) {
+  return h_rvm_start(ctx, p->backend_data);
+}
+static bool rvm_stream_feed(void *run, const uint8_t *chunk, size_t len) {
+  return h_rvm_feed(run, chunk, len);
+}
+static HParseResult *rvm_stream_finish(void *run) {
+  return h_rvm_finish(run);
+}
+static const HStreamOps rvm_stream = {
+  rvm_stream_start, rvm_stream_feed, rvm_stream_finish, true
+};
+
+static void test_llk_stream(void) {
+  HParser *x_ = h_optional(h_ch('x'));
+  HParser *y_ = h_sequence(h_ch('y'), h_ch('y'), NULL);
+  HParser *p_ = h_many(h_choice(h_sequence(x_, y_, h_ch('a'), NULL),
+				h_sequence(y_, h_ch('b'), NULL), NULL));
+  const char *inputs[] = { "xyyayybyyaxyya", "yyb", "yybyy", "xyyb", "yyx", "" };
+  g_check_cmp_int32(h_compile(p_, PB_LLk, (void *)3), ==, 0);
+  check_stream(p_, &llk_stream, inputs, sizeof(inputs) / sizeof(inputs[0]));
+
+  HParser *q_ = h_sequence(h_many(h_choice(h_token((const uint8_t*)"GET", 3),
+					   h_token((const uint8_t*)"PUT", 3),
+					   h_token((const uint8_t*)"POST", 4),
+					   NULL)),
+			   h_end_p(), NULL);
+  const char *qinputs[] = { "GETPUTPOSTGET", "POSTP", "PUTT", "P", "" };
+  g_check_cmp_int32(h_compile(q_, PB_LLk, (void *)2), ==, 0);
+  check_stream(q_, &llk_stream, qinputs, sizeof(qinputs) / sizeof(qinputs[0]));
+
+  // tokens know where they were in the whole of the input
+  HParser *r_ = h_many(h_ch_range('a', 'z'));
+  g_check_cmp_int32(h_compile(r_, PB_LLk, NULL), ==, 0);
+  HLLkRun *run = h_llk_start(NULL, r_);
+  h_llk_feed(run, (const uint8_t*)"abc", 3);
+  h_llk_feed(run, (const uint8_t*)"de", 2);
+  HParseResult *res = h_llk_finish(run);
+  if (!res || res->ast->seq->used != 5) {
+    g_test_fail();
+  } else {
+    g_check_cmp_uint64(res->ast->seq->elements[3]->index, ==, 3);
+    g_check_cmp_uint64(res->ast->seq->elements[4]->index, ==, 4);
+  }
+  h_parse_result_free(res);
+
+  // input that can't parse stops the run
+  run = h_llk_start(NULL, q_);
+  g_check_cmp_int32(h_llk_feed(run, (const uint8_t*)"GETP", 4), ==, false);
+  g_check_cmp_int32(h_llk_feed(run, (const uint8_t*)"X", 1), ==, true);
+  res = h_llk_finish(run);
+  if (res) {
+    g_test_fail();
+    h_parse_result_free(res);
+  }
+
+  // nor is there a run for a parser that isn't compiled for LL(k)
+  g_check_cmp_int32(h_compile(r_, PB_PACKRAT, NULL), ==, 0);
+  run = h_llk_start(NULL, r_);
+  if (run)
+    g_test_fail();
+  g_check_cmp_int32(h_llk_feed(run, (const uint8_t*)"abc", 3), ==, true);
+  if (h_llk_finish(run))
+    g_test_fail();
+}
+
+static void test_regex_dfa(void) {
+  // the NFA used to drop its last thread, and with it this second alternative
+  HParser *p_ = h_choice(h_token((const uint8_t*)"ab", 2), h_token((const uint8_t*)"ac", 2), NULL);
+  g_check_parse_match(p_, PB_REGULAR, "ab", 2, "<61.62>");
+  g_check_parse_match(p_, PB_REGULAR, "ac", 2, "<61.63>");
+
+  // the DFA a context keeps between parses agrees with packrat
+  HParser *q_ = h_sequence(h_many(h_choice(h_token((const uint8_t*)"AB", 2),
+					   h_ch_range('a', 'z'),
+					   h_sequence(h_ch('0'), h_optional(h_ch('1')), NULL),
+					   NULL)),
+			   h_end_p(), NULL);
+  const char *inputs[] = { "ABabd", "a0b01c", "AB0", "", "ABX", "A", "0101ABab" };
+  check_like_packrat(q_, PB_REGULAR, NULL, inputs, sizeof(inputs) / sizeof(inputs[0]));
+}
+
+static void test_regex_token_trie(void) {
+  // GET..PATCH become one trie; "ab" and "a" can't, one being a prefix
+  HParser *p_ = h_sequence(h_many(h_sequence(h_choice(h_token((const uint8_t*)"GET", 3),
+						      h_token((const uint8_t*)"PUT", 3),
+						      h_token((const uint8_t*)"POST", 4),
+						      h_token((const uint8_t*)"PATCH", 5),
+						      h_ch('x'),
+						      h_token((const uint8_t*)"ab", 2),
+						      h_token((const uint8_t*)"a", 1),
+						      NULL),
+					     h_ch(' '), NULL)),
+			   h_end_p(), NULL);
+  const char *inputs[] = { "GET PUT POST PATCH x ab a ", "PATCH ", "PAT ", "GET", "",
+			   "POSTx ", "ab a x GET ", "PUTT " };
+  check_like_packrat(p_, PB_REGULAR, NULL, inputs, sizeof(inputs) / sizeof(inputs[0]));
+}
+
+// Fields that don't start or end on a byte boundary, as in an IPv4 header.
+static void test_regex_bits(void) {
+  HParser *p_ = h_sequence(h_bits(4, false), h_bits(4, false), h_uint8(), h_uint16(),
+			   h_bits(3, false), h_bits(13, false), h_int8(),
+			   h_many(h_sequence(h_bits(1, true), h_bits(7, true), NULL)),
+			   h_end_p(), NULL);
+  const char *inputs[] = { "\x45\x10\x01\x02\x5f\xff\x80",
+			   "\x45\x10\x01\x02\x5f\xff\x80\xff\x40\x81",
+			   "\x45\x10\x01\x02\x5f\xff", "\xf4" };
+  check_like_packrat(p_, PB_REGULAR, NULL, inputs, sizeof(inputs) / sizeof(inputs[0]));
+
+  // alternatives may split a byte the same way, but not differently
+  HParser *q_ = h_sequence(h_choice(h_sequence(h_ch('a'), h_bits(2, false), h_bits(8, false), NULL),
+				    h_sequence(h_ch('b'), h_bits(10, true), NULL), NULL),
+			   h_bits(6, false), NULL);
+  const char *qinputs[] = { "a\xc1\x7f", "b\xc1\x7f", "b\x01\x7f", "a\x7f", "c\x01\x7f" };
+  check_like_packrat(q_, PB_REGULAR, NULL, qinputs, sizeof(qinputs) / sizeof(qinputs[0]));
+
+  // and may start off one, as may a repetition that stays on its offset
+  HParser *r_ = h_sequence(h_bits(4, false), h_choice(h_bits(12, true), h_bits(4, false), NULL),
+			   h_end_p(), NULL);
+  HParser *s_ = h_sequence(h_bits(4, false), h_many(h_bits(8, true)), h_bits(4, false),
+			   h_end_p(), NULL);
+  const char *rinputs[] = { "\x12", "\x12\x34", "\x12\x34\x56", "" };
+  check_like_packrat(r_, PB_REGULAR, NULL, rinputs, sizeof(rinputs) / sizeof(rinputs[0]));
+  check_like_packrat(s_, PB_REGULAR, NULL, rinputs, sizeof(rinputs) / sizeof(rinputs[0]));
+
+  // the match has to end on one
+  g_check_cmp_int32(h_compile(h_bits(4, false), PB_REGULAR, NULL), !=, 0);
+  g_check_cmp_int32(h_compile(h_choice(h_bits(4, false), h_bits(8, false), NULL),
+			      PB_REGULAR, NULL), !=, 0);
+  g_check_cmp_int32(h_compile(h_sequence(h_bits(4, false), h_optional(h_bits(4, false)),
+					 h_bits(4, false), NULL), PB_REGULAR, NULL), !=, 0);
+}
+
+// Long repetitions go round a loop that counts, rather than being unrolled.
+static void test_regex_counted(void) {
+  HParser *p_ = h_sequence(h_repeat_n(h_uint8(), 1000), h_end_p(), NULL);
+  g_check_cmp_int32(h_compile(p_, PB_REGULAR, NULL), ==, 0);
+  g_check_cmp_int32(((HRVMProg*)p_->backend_data)->length, <, 32);
+  uint8_t input[1001];
+  for (size_t i = 0; i < sizeof(input); i++)
+    input[i] = i;
+  HParseResult *res = h_parse(p_, input, 1000);
+  g_check_cmp_int32(res != NULL, ==, 1);
+  if (res) {
+    HCountedArray *seq = res->ast->seq->elements[0]->seq;
+    g_check_cmp_int32(seq->used, ==, 1000);
+    g_check_cmp_int32(seq->elements[999]->uint, ==, 999 % 256);
+  }
+  h_parse_result_free(res);
+  g_check_parse_failed(p_, PB_REGULAR, (const char*)input, 999);
+  g_check_parse_failed(p_, PB_REGULAR, (const char*)input, 1001);
+
+  // nested, and with fields that split bytes
+  HParser *q_ = h_sequence(h_repeat_n(h_sequence(h_repeat_n(h_ch_range('a', 'z'), 5), h_ch(','),
+					       NULL), 6),
+			   h_repeat_n(h_sequence(h_bits(4, false), h_bits(4, true), NULL), 5),
+			   h_end_p(), NULL);
+  const char *inputs[] = { "abcde,fghij,klmno,pqrst,uvwxy,zabcd,\x12\x34\x56\x78\x9a",
+			   "abcde,fghij,klmno,pqrst,uvwxy,zabcd,\x12\x34\x56\x78",
+			   "abcde,fghij,klmno,pqrst,uvwxy,zabc,d\x12\x34\x56\x78\x9a",
+			   "abcde,fghij,klmno,pqrst,uvwxy," };
+  check_like_packrat(q_, PB_REGULAR, NULL, inputs, sizeof(inputs) / sizeof(inputs[0]));
+  // rounds that each start elsewhere in the byte are unrolled after all
+  HParser *s_ = h_sequence(h_repeat_n(h_bits(4, false), 6), h_end_p(), NULL);
+  const char *sinputs[] = { "\x12\x34\x56", "\x12\x34", "\x12\x34\x56\x78" };
+  check_like_packrat(s_, PB_REGULAR, NULL, sinputs, sizeof(sinputs) / sizeof(sinputs[0]));
+
+  // threads in the same place, but on different rounds
+  HParser *r_ = h_sequence(h_repeat_n(h_choice(h_token((const uint8_t*)"aa", 2), h_ch('a'), NULL), 6),
+			   h_ch('b'), NULL);
+  g_check_parse_failed(r_, PB_REGULAR, "aaaaab", 6);
+  g_check_parse_ok(r_, PB_REGULAR, "aaaaaab", 7);
+  g_check_parse_ok(r_, PB_REGULAR, "aaaaaaaaab", 10);
+  g_check_parse_ok(r_, PB_REGULAR, "aaaaaaaaaaaab", 13);
+  g_check_parse_failed(r_, PB_REGULAR, "aaaaaaaaaaaaab", 14);
+
+  // and searching, where they may start anywhere
+  HParser *t_ = h_repeat_n(h_ch_range('0', '9'), 5);
+  g_check_cmp_int32(h_compile(t_, PB_REGULAR, NULL), ==, 0);
+  HRVMMatch match;
+  g_check_cmp_int32(h_rvm_find(NULL, t_->backend_data, (const uint8_t*)"ab1234x123456", 13, 0, &match), ==, 1);
+  g_check_cmp_int32(match.start, ==, 7);
+  g_check_cmp_int32(match.end, ==, 12);
+  h_parse_result_free(match.result);
+}
+
+// Every way of cutting the input into chunks of one size gives what
+// h_parse does.
+static void test_regex_stream(void) {
+  HParser *p_ = h_sequence(h_many1(h_choice(h_token((const uint8_t*)"abc", 3),
+					    h_ch_range('0', '9'), NULL)),
+			   h_ch(';'), NULL);
+  const char *inputs[] = { "abc1abcabc2;", "abc;", "ab;", "abcq", "" };
+  g_check_cmp_int32(h_compile(p_, PB_REGULAR, NULL), ==, 0);
+  HRVMProg *prog = p_->backend_data;
+  check_stream(p_, &rvm_stream, inputs, sizeof(inputs) / sizeof(inputs[0]));
+
+  // Captures point into their chunk, unless they span two.
+  const uint8_t *chunk1 = (const uint8_t*)"abc1ab", *chunk2 = (const uint8_t*)"cabc2;";
+  HRVMRun *run = h_rvm_start(NULL, prog);
+  h_rvm_feed(run, chunk1, 6);
+  h_rvm_feed(run, chunk2, 6);
+  HParseResult *res = h_rvm_finish(run);
+  if (!res) {
+    g_test_fail();
+    return;
+  }
+  HParsedToken **elems = res->ast->seq->elements[0]->seq->elements;
+  if (elems[0]->bytes.token != chunk1 || elems[3]->bytes.token != chunk2 + 1)
+    g_test_fail();
+  char *cres = h_write_result_unamb(elems[2]);
+  g_check_string(cres, ==, "<61.62.63>");
+  free(cres);
+  h_parse_result_free(res);
+
+  // Input that can't match anymore stops the run.
+  run = h_rvm_start(NULL, prog);
+  g_check_cmp_int32(h_rvm_feed(run, (const uint8_t*)"abc", 3), ==, false);
+  g_check_cmp_int32(h_rvm_feed(run, (const uint8_t*)"q", 1), ==, true);
+  res = h_rvm_finish(run);
+  if (res) {
+    g_test_fail();
+    h_parse_result_free(res);
+  }
+}
+
+static bool append_match(const HRVMMatch *match, void *env) {
+  char *cres = h_write_result_unamb(match->result->ast);
+  size_t used = strlen(env);
+  snprintf((char*)env + used, 512 - used, "%zu-%zu:%s ", match->start, match->end, cres);
+  free(cres);
+  return true;
+}
+
+// h_rvm_find_all finds what h_parse does when tried at each offset in turn.
+static void test_regex_find(void) {
+  struct {
+    HParser *p;
+    const char *input;
+  } cases[] = {
+    { h_sequence(h_token((const uint8_t*)"ERR", 3), h_many1(h_ch_range('0', '9')), NULL),
+      "xxERR12 ERRa ERR3ERR" },
+    { h_choice(h_token((const uint8_t*)"cat", 3), h_token((const uint8_t*)"dog", 3), NULL),
+      "hotdogcatcowcadog" },
+    { h_sequence(h_many1(h_ch('a')), h_ch('b'), NULL), "aaac aab ab" },
+    { h_many(h_ch('a')), "baab" },
+    { h_sequence(h_ch('x'), h_end_p(), NULL), "xax x" },
+    { h_ch('q'), "no match here" },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const uint8_t *input = (const uint8_t*)cases[i].input;
+    size_t len = strlen(cases[i].input);
+    g_check_cmp_int32(h_compile(cases[i].p, PB_REGULAR, NULL), ==, 0);
+    char expected[512] = "", found[512] = "";
+    for (size_t off = 0; off <= len; ) {
+      HParseResult *res = h_parse(cases[i].p, input + off, len - off);
+      if (!res) {
+	off++;
+	continue;
+      }
+      HRVMMatch match = { off, off + res->bit_length / 8, res };
+      append_match(&match, expected);
+      off = match.end > off ? match.end : off + 1;
+      h_parse_result_free(res);
+    }
+    HParseCtx *ctx = h_parse_ctx_new();
+    h_rvm_find_all(i % 2 ? ctx : NULL, cases[i].p->backend_data, input, len, append_match, found);
+    h_parse_ctx_free(ctx);
+    g_check_string(found, ==, expected);
+  }
+}
+
+// More insns than a 16-bit address reaches: jumps past 65535 used to wrap.
+static void test_regex_large(void) {
+  // Sequences, which the token trie can't fold into one switch, so that
+  // the program is longer than 65535 insns.
+  const size_t n = 8000;
+  void **alts = malloc((n + 1) * sizeof(void*));
+  for (size_t i = 0; i < n; i++) {
+    char str[5];
+    snprintf(str, sizeof(str), "%04zx", i);
+    alts[i] = h_sequence(h_ch(str[0]), h_token((const uint8_t*)str + 1, 3), NULL);
+  }
+  alts[n] = NULL;
+  HParser *p_ = h_many1(h_choice__a(alts));
+  free(alts);
+  g_check_parse_match(p_, PB_REGULAR, "1f3f00000abc", 12,
+                      "((u0x31 <66.33.66>) (u0x30 <30.30.30>) (u0x30 <61.62.63>))");
+  g_check_cmp_uint64(((HRVMProg*)p_->backend_data)->length, >, 65535);
+  g_check_parse_failed(p_, PB_REGULAR, "1f40", 4);
+}
+
 void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/packrat/token", GINT_TO_POINTER(PB_PACKRAT), test_token);
   g_test_add_data_func("/core/parser/packrat/ch", GINT_TO_POINTER(PB_PACKRAT), test_ch);
@@ -467,6 +1131,7 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/packrat/action", GINT_TO_POINTER(PB_PACKRAT), test_action);
   g_test_add_data_func("/core/parser/packrat/in", GINT_TO_POINTER(PB_PACKRAT), test_in);
   g_test_add_data_func("/core/parser/packrat/not_in", GINT_TO_POINTER(PB_PACKRAT), test_not_in);
+  g_test_add_data_func("/core/parser/packrat/in_scattered", GINT_TO_POINTER(PB_PACKRAT), test_in_scattered);
   g_test_add_data_func("/core/parser/packrat/end_p", GINT_TO_POINTER(PB_PACKRAT), test_end_p);
   g_test_add_data_func("/core/parser/packrat/nothing_p", GINT_TO_POINTER(PB_PACKRAT), test_nothing_p);
   g_test_add_data_func("/core/parser/packrat/sequence", GINT_TO_POINTER(PB_PACKRAT), test_sequence);
@@ -487,6 +1152,11 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/packrat/ignore", GINT_TO_POINTER(PB_PACKRAT), test_ignore);
   //g_test_add_data_func("/core/parser/packrat/leftrec", GINT_TO_POINTER(PB_PACKRAT), test_leftrec);
   g_test_add_data_func("/core/parser/packrat/rightrec", GINT_TO_POINTER(PB_PACKRAT), test_rightrec);
+  g_test_add_func("/core/parser/packrat/dense_memo", test_packrat_dense_memo);
+  g_test_add_func("/core/parser/packrat/selective_memo", test_packrat_selective_memo);
+  g_test_add_func("/core/parser/packrat/ids", test_packrat_ids);
+  g_test_add_func("/core/parser/packrat/shared_id", test_packrat_shared_id);
+  g_test_add_func("/core/parser/packrat/unseen_id", test_packrat_unseen_id);
 
   g_test_add_data_func("/core/parser/llk/token", GINT_TO_POINTER(PB_LLk), test_token);
   g_test_add_data_func("/core/parser/llk/ch", GINT_TO_POINTER(PB_LLk), test_ch);
@@ -525,6 +1195,8 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/llk/ignore", GINT_TO_POINTER(PB_LLk), test_ignore);
   //g_test_add_data_func("/core/parser/llk/leftrec", GINT_TO_POINTER(PB_LLk), test_leftrec);
   g_test_add_data_func("/core/parser/llk/rightrec", GINT_TO_POINTER(PB_LLk), test_rightrec);
+  g_test_add_func("/core/parser/llk/lookahead", test_llk_lookahead);
+  g_test_add_func("/core/parser/llk/stream", test_llk_stream);
 
   g_test_add_data_func("/core/parser/regex/token", GINT_TO_POINTER(PB_REGULAR), test_token);
   g_test_add_data_func("/core/parser/regex/ch", GINT_TO_POINTER(PB_REGULAR), test_ch);
@@ -548,7 +1220,15 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/regex/middle", GINT_TO_POINTER(PB_REGULAR), test_middle);
   g_test_add_data_func("/core/parser/regex/action", GINT_TO_POINTER(PB_REGULAR), test_action);
   g_test_add_data_func("/core/parser/regex/in", GINT_TO_POINTER(PB_REGULAR), test_in);
+  g_test_add_func("/core/parser/regex/dfa", test_regex_dfa);
+  g_test_add_func("/core/parser/regex/large", test_regex_large);
+  g_test_add_func("/core/parser/regex/token_trie", test_regex_token_trie);
+  g_test_add_func("/core/parser/regex/bits", test_regex_bits);
+  g_test_add_func("/core/parser/regex/counted", test_regex_counted);
+  g_test_add_func("/core/parser/regex/stream", test_regex_stream);
+  g_test_add_func("/core/parser/regex/find", test_regex_find);
   g_test_add_data_func("/core/parser/regex/not_in", GINT_TO_POINTER(PB_REGULAR), test_not_in);
+  g_test_add_data_func("/core/parser/regex/in_scattered", GINT_TO_POINTER(PB_REGULAR), test_in_scattered);
   g_test_add_data_func("/core/parser/regex/end_p", GINT_TO_POINTER(PB_REGULAR), test_end_p);
   g_test_add_data_func("/core/parser/regex/nothing_p", GINT_TO_POINTER(PB_REGULAR), test_nothing_p);
   g_test_add_data_func("/core/parser/regex/sequence", GINT_TO_POINTER(PB_REGULAR), test_sequence);
@@ -600,6 +1280,7 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/lalr/ignore", GINT_TO_POINTER(PB_LALR), test_ignore);
   g_test_add_data_func("/core/parser/lalr/leftrec", GINT_TO_POINTER(PB_LALR), test_leftrec);
   g_test_add_data_func("/core/parser/lalr/rightrec", GINT_TO_POINTER(PB_LALR), test_rightrec);
+  g_test_add_data_func("/core/parser/lalr/errors", GINT_TO_POINTER(PB_LALR), test_lr_errors);
 
   g_test_add_data_func("/core/parser/glr/token", GINT_TO_POINTER(PB_GLR), test_token);
   g_test_add_data_func("/core/parser/glr/ch", GINT_TO_POINTER(PB_GLR), test_ch);
@@ -639,4 +1320,6 @@ void register_parser_tests(void) {
   g_test_add_data_func("/core/parser/glr/leftrec", GINT_TO_POINTER(PB_GLR), test_leftrec);
   g_test_add_data_func("/core/parser/glr/rightrec", GINT_TO_POINTER(PB_GLR), test_rightrec);
   g_test_add_data_func("/core/parser/glr/ambiguous", GINT_TO_POINTER(PB_GLR), test_ambiguous);
+  g_test_add_data_func("/core/parser/glr/forks", GINT_TO_POINTER(PB_GLR), test_glr_forks);
+  g_test_add_data_func("/core/parser/glr/errors", GINT_TO_POINTER(PB_GLR), test_lr_errors);
 }
@@ -0,0 +1,220 @@
+/* Thread-caching allocator for Hammer.
+ *
+ * Every block carries a header naming the thread cache it came from and its
+ * size class. Freed blocks of the common sizes (arena blocks above all) go
+ * back into a magazine, a small per-thread, per-class stack, which serves
+ * the next allocation of that class without touching malloc.
+ *
+ * A block freed on a thread other than its owner is pushed onto the owner's
+ * lock-free "remote" stack; the owner moves those into its magazines when it
+ * next runs dry. When a thread exits, its cache is emptied and parked on a
+ * list for the next new thread to adopt, so that late remote frees always
+ * have somewhere to go.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "internal.h"
+
+// Size classes are a power of two, from 64 bytes to 1M, plus some slack for
+// the arena's block header.
+#define TC_MIN_SHIFT 6
+#define TC_NCLASSES 15
+#define TC_SLACK 64
+#define TC_UNCACHED TC_NCLASSES
+// Each magazine holds up to about this many bytes, and 2 to 64 blocks.
+#define TC_MAGAZINE_BYTES (1 << 20)
+#define TC_MAGAZINE_MAX 64
+
+typedef struct HThreadCache_ HThreadCache;
+
+typedef union {
+  struct {
+    HThreadCache *owner;
+    size_t cls;
+  };
+  HMaxAlign align;
+} HBlockHeader;
+
+struct HThreadCache_ {
+  HThreadCache *next_parked;
+  int alive;
+  size_t count[TC_NCLASSES];
+  HBlockHeader *magazine[TC_NCLASSES][TC_MAGAZINE_MAX];
+  char pad[64]; // remote is written by other threads; keep it off our cache lines
+  HBlockHeader *remote;
+};
+
+static __thread HThreadCache *thread_cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static HThreadCache *parked;
+
+static inline size_t class_size(size_t cls) {
+  return ((size_t)1 << (cls + TC_MIN_SHIFT)) + TC_SLACK;
+}
+
+static inline size_t class_of(size_t size) {
+  if (size <= class_size(0))
+    return 0;
+  size_t n = size - TC_SLACK - 1; // > 2^TC_MIN_SHIFT - 1
+  size_t cls = (sizeof(unsigned long) * 8 - __builtin_clzl(n)) - TC_MIN_SHIFT;
+  return cls < TC_NCLASSES ? cls : TC_UNCACHED;
+}
+
+static inline size_t magazine_cap(size_t cls) {
+  size_t cap = TC_MAGAZINE_BYTES / class_size(cls);
+  return cap < 2 ? 2 : cap > TC_MAGAZINE_MAX ? TC_MAGAZINE_MAX : cap;
+}
+
+// The remote stack is linked through the first word after the header.
+static inline HBlockHeader **remote_next(HBlockHeader *hdr) {
+  return (HBlockHeader**)(hdr + 1);
+}
+
+static void free_remote(HBlockHeader *hdr) {
+  while (hdr) {
+    HBlockHeader *next = *remote_next(hdr);
+    free(hdr);
+    hdr = next;
+  }
+}
+
+static void local_free(HThreadCache *tc, HBlockHeader *hdr) {
+  size_t cls = hdr->cls;
+  if (tc->count[cls] < magazine_cap(cls))
+    tc->magazine[cls][tc->count[cls]++] = hdr;
+  else
+    free(hdr);
+}
+
+// Move the blocks other threads have freed into our magazines.
+static void drain_remote(HThreadCache *tc) {
+  HBlockHeader *hdr = __atomic_exchange_n(&tc->remote, NULL, __ATOMIC_ACQUIRE);
+  while (hdr) {
+    HBlockHeader *next = *remote_next(hdr);
+    local_free(tc, hdr);
+    hdr = next;
+  }
+}
+
+static void remote_free(HThreadCache *owner, HBlockHeader *hdr) {
+  HBlockHeader *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+  do {
+    *remote_next(hdr) = head;
+  } while (!__atomic_compare_exchange_n(&owner->remote, &head, hdr, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  // If the owner has exited, it may have emptied the stack before our push;
+  // whoever takes the stack from here on frees it.
+  if (!__atomic_load_n(&owner->alive, __ATOMIC_SEQ_CST))
+    free_remote(__atomic_exchange_n(&owner->remote, NULL, __ATOMIC_ACQUIRE));
+}
+
+static void cache_release(void *arg) {
+  HThreadCache *tc = arg;
+  thread_cache = NULL;
+  for (size_t cls = 0; cls < TC_NCLASSES; cls++) {
+    while (tc->count[cls] > 0)
+      free(tc->magazine[cls][--tc->count[cls]]);
+  }
+  __atomic_store_n(&tc->alive, 0, __ATOMIC_SEQ_CST);
+  free_remote(__atomic_exchange_n(&tc->remote, NULL, __ATOMIC_ACQUIRE));
+
+  pthread_mutex_lock(&parked_lock);
+  tc->next_parked = parked;
+  parked = tc;
+  pthread_mutex_unlock(&parked_lock);
+}
+
+static void make_cache_key(void) {
+  pthread_key_create(&cache_key, cache_release);
+}
+
+static HThreadCache *get_cache(void) {
+  HThreadCache *tc = thread_cache;
+  if (tc)
+    return tc;
+  pthread_once(&cache_key_once, make_cache_key);
+  pthread_mutex_lock(&parked_lock);
+  tc = parked;
+  if (tc)
+    parked = tc->next_parked;
+  pthread_mutex_unlock(&parked_lock);
+  if (!tc) {
+    tc = calloc(1, sizeof(HThreadCache));
+    if (!tc)
+      return NULL;
+  }
+  __atomic_store_n(&tc->alive, 1, __ATOMIC_SEQ_CST);
+  pthread_setspecific(cache_key, tc);
+  thread_cache = tc;
+  return tc;
+}
+
+static void* tc_alloc(HAllocator *allocator, size_t size) {
+  size_t cls = class_of(size);
+  HThreadCache *tc = cls == TC_UNCACHED ? NULL : get_cache();
+  HBlockHeader *hdr;
+  if (!tc) {
+    hdr = malloc(sizeof(HBlockHeader) + size);
+    if (!hdr)
+      return NULL;
+    hdr->owner = NULL;
+    hdr->cls = TC_UNCACHED;
+    return hdr + 1;
+  }
+  if (tc->count[cls] == 0 && __atomic_load_n(&tc->remote, __ATOMIC_RELAXED))
+    drain_remote(tc);
+  if (tc->count[cls] > 0)
+    return tc->magazine[cls][--tc->count[cls]] + 1;
+  hdr = malloc(sizeof(HBlockHeader) + class_size(cls));
+  if (!hdr)
+    return NULL;
+  hdr->owner = tc;
+  hdr->cls = cls;
+  return hdr + 1;
+}
+
+static void tc_free(HAllocator *allocator, void *ptr) {
+  if (!ptr)
+    return;
+  HBlockHeader *hdr = (HBlockHeader*)ptr - 1;
+  if (!hdr->owner)
+    free(hdr);
+  else if (hdr->owner == thread_cache)
+    local_free(hdr->owner, hdr);
+  else
+    remote_free(hdr->owner, hdr);
+}
+
+static void* tc_realloc(HAllocator *allocator, void *ptr, size_t size) {
+  if (!ptr)
+    return tc_alloc(allocator, size);
+  HBlockHeader *hdr = (HBlockHeader*)ptr - 1;
+  if (!hdr->owner) {
+    hdr = realloc(hdr, sizeof(HBlockHeader) + size);
+    return hdr ? hdr + 1 : NULL;
+  }
+  size_t old_size = class_size(hdr->cls);
+  if (size <= old_size)
+    return ptr;
+  void *ret = tc_alloc(allocator, size);
+  if (!ret)
+    return NULL;
+  memcpy(ret, ptr, old_size);
+  tc_free(allocator, ptr);
+  return ret;
+}
+
+static HAllocator thread_cache_allocator = {
+  .alloc = tc_alloc,
+  .realloc = tc_realloc,
+  .free = tc_free,
+};
+
+HAllocator* h_thread_cache_allocator(void) {
+  return &thread_cache_allocator;
+}